@@ -0,0 +1,288 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  cgi.c
+ *
+ *    Description:  Request arguments in a small open addressing hash table, so that
+ *                  handlers looking up a dozen fields don't scan a list each time.
+ *                  Names live in one buffer per table and each value is a single
+ *                  Octstr. Form bodies are split and decoded in one pass; the scan for
+ *                  delimiters and escapes looks at 8 bytes at a time.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 21:42:19
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "cgi.h"
+
+#define CGI_INITIAL_SLOTS 32 /* a /queue post has ~17 fields: no rehash, load under 0.6 */
+
+struct cgi_entry {
+    unsigned long hash;
+    long name; /* offset into names */
+    long nlen;
+    Octstr *value; /* NULL: free slot */
+};
+
+struct cgi {
+    struct cgi_entry *slots;
+    long size, used;
+    Octstr *names;
+};
+
+/* Whether any byte of w is b (the usual has-zero-byte trick) */
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+static inline int has_byte(uint64_t w, unsigned char b)
+{
+    uint64_t x = w ^ (ONES * b);
+
+    return ((x - ONES) & ~x & HIGHS) != 0;
+}
+
+static unsigned long hash_name(const char *s, long len)
+{
+    unsigned long h = 2166136261UL; /* FNV-1a */
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*s++) * 16777619UL;
+    return h;
+}
+
+cgi_t *cgi_create(void)
+{
+    cgi_t *t = gw_malloc(sizeof *t);
+
+    t->slots = NULL; /* on first add: most GETs have no arguments */
+    t->size = t->used = 0;
+    t->names = NULL;
+    return t;
+}
+
+void cgi_destroy(cgi_t *t)
+{
+    long i;
+
+    if (t == NULL)
+        return;
+    for (i = 0; i < t->size; i++)
+        octstr_destroy(t->slots[i].value);
+    gw_free(t->slots);
+    octstr_destroy(t->names);
+    gw_free(t);
+}
+
+static struct cgi_entry *lookup(cgi_t *t, const char *name, long nlen, unsigned long h)
+{
+    long i = h & (t->size - 1);
+
+    while (t->slots[i].value != NULL) {
+        struct cgi_entry *e = &t->slots[i];
+
+        if (e->hash == h && e->nlen == nlen &&
+                memcmp(octstr_get_cstr(t->names) + e->name, name, nlen) == 0)
+            return e;
+        i = (i + 1) & (t->size - 1);
+    }
+    return &t->slots[i];
+}
+
+static void grow(cgi_t *t)
+{
+    struct cgi_entry *old = t->slots;
+    long i, n = t->size;
+
+    t->size = n ? 2 * n : CGI_INITIAL_SLOTS;
+    t->slots = gw_malloc(t->size * sizeof t->slots[0]);
+    memset(t->slots, 0, t->size * sizeof t->slots[0]);
+    for (i = 0; i < n; i++)
+        if (old[i].value != NULL) {
+            long j = old[i].hash & (t->size - 1);
+
+            while (t->slots[j].value != NULL)
+                j = (j + 1) & (t->size - 1);
+            t->slots[j] = old[i];
+        }
+    gw_free(old);
+}
+
+void cgi_add(cgi_t *t, const char *name, long nlen, Octstr *value)
+{
+    unsigned long h = hash_name(name, nlen);
+    struct cgi_entry *e;
+
+    if (value == NULL)
+        value = octstr_create("");
+    if (2 * (t->used + 1) > t->size)
+        grow(t);
+    if (t->names == NULL)
+        t->names = octstr_create("");
+
+    if ((e = lookup(t, name, nlen, h))->value != NULL) {
+        octstr_destroy(value); /* first one wins */
+        return;
+    }
+    e->hash = h;
+    e->name = octstr_len(t->names);
+    e->nlen = nlen;
+    e->value = value;
+    octstr_append_data(t->names, name, nlen);
+    t->used++;
+}
+
+void cgi_add_list(cgi_t *t, List *cgivars)
+{
+    HTTPCGIVar *v;
+
+    if (cgivars == NULL)
+        return;
+    while ((v = gwlist_extract_first(cgivars)) != NULL) {
+        cgi_add(t, octstr_get_cstr(v->name), octstr_len(v->name), v->value);
+        octstr_destroy(v->name);
+        gw_free(v);
+    }
+    gwlist_destroy(cgivars, NULL);
+}
+
+Octstr *cgi_get(cgi_t *t, const char *name)
+{
+    long nlen = strlen(name);
+
+    if (t == NULL || t->used == 0)
+        return NULL;
+    return lookup(t, name, nlen, hash_name(name, nlen))->value;
+}
+
+static int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+long cgi_url_decode(const char *s, long len, char *out)
+{
+    const char *end = s + len, *q;
+    char *o = out;
+    int hi, lo;
+
+    while (s < end) {
+        /* copy everything up to the next escape in one go */
+        for (q = s; end - q >= 8; q += 8) {
+            uint64_t w;
+
+            memcpy(&w, q, 8);
+            if (has_byte(w, '%') || has_byte(w, '+'))
+                break;
+        }
+        while (q < end && *q != '%' && *q != '+')
+            q++;
+        if (q > s) {
+            memmove(o, s, q - s);
+            o += q - s;
+            s = q;
+        }
+        if (s == end)
+            break;
+        if (*s == '+') {
+            *o++ = ' ';
+            s++;
+        } else if (end - s >= 3 && (hi = hexval(s[1])) >= 0 && (lo = hexval(s[2])) >= 0) {
+            *o++ = (hi << 4) | lo;
+            s += 3;
+        } else
+            *o++ = *s++; /* stray '%' is kept */
+    }
+    return o - out;
+}
+
+static int b64val(int c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+long cgi_base64_decode(const char *s, long len, char *out)
+{
+    long i, n = 0;
+    int a, b, c, d;
+
+    while (len > 0 && s[len - 1] == '=')
+        len--;
+    if (len % 4 == 1)
+        return -1;
+    /* four characters make three bytes */
+    for (i = 0; i + 4 <= len; i += 4) {
+        if ((a = b64val(s[i])) < 0 || (b = b64val(s[i + 1])) < 0 ||
+                (c = b64val(s[i + 2])) < 0 || (d = b64val(s[i + 3])) < 0)
+            return -1;
+        out[n++] = (a << 2) | (b >> 4);
+        out[n++] = (b << 4) | (c >> 2);
+        out[n++] = (c << 6) | d;
+    }
+    if (i < len) {
+        if ((a = b64val(s[i])) < 0 || (b = b64val(s[i + 1])) < 0)
+            return -1;
+        out[n++] = (a << 2) | (b >> 4);
+        if (len - i == 3) {
+            if ((c = b64val(s[i + 2])) < 0)
+                return -1;
+            out[n++] = (b << 4) | (c >> 2);
+        }
+    }
+    return n;
+}
+
+/* Trim blanks, as octstr_strip_blanks() did for the old split-based parser */
+static void trim(const char **s, const char **end)
+{
+    while (*s < *end && isspace((unsigned char)**s))
+        (*s)++;
+    while (*end > *s && isspace((unsigned char)(*end)[-1]))
+        (*end)--;
+}
+
+void cgi_parse_urlencoded(cgi_t *t, Octstr *body)
+{
+    const char *p = octstr_get_cstr(body), *end = p + octstr_len(body);
+    char *scratch = gw_malloc(octstr_len(body) + 1);
+
+    while (p < end) {
+        const char *amp = memchr(p, '&', end - p), *seg = amp ? amp : end;
+        const char *eq = memchr(p, '=', seg - p);
+        const char *n = p, *nend = eq ? eq : seg, *v = eq ? eq + 1 : seg, *vend = seg;
+        long nlen, vlen;
+
+        p = seg + 1;
+        trim(&n, &nend);
+        trim(&v, &vend);
+        if (nend == n && vend == v)
+            continue; /* empty field e.g. "a=1&&b=2" */
+        nlen = cgi_url_decode(n, nend - n, scratch);
+        vlen = cgi_url_decode(v, vend - v, scratch + nlen);
+        cgi_add(t, scratch, nlen, octstr_create_from_data(scratch + nlen, vlen));
+    }
+    gw_free(scratch);
+}
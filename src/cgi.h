@@ -0,0 +1,49 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  cgi.h
+ *
+ *    Description:  Request arguments (query string and form fields) by name, plus the
+ *                  URL and base64 decoding used to get them
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 21:37:06
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_CGI_H
+#define __DISPATCHER2_CGI_H
+
+#include <gwlib/gwlib.h>
+
+typedef struct cgi cgi_t;
+
+cgi_t *cgi_create(void);
+void cgi_destroy(cgi_t *t);
+
+/* Add a value, which the table takes over. As with http_cgi_variable() the first value
+ * for a name is the one found; later ones are dropped. */
+void cgi_add(cgi_t *t, const char *name, long nlen, Octstr *value);
+
+/* Move gwlib's query string arguments (a List of HTTPCGIVar) in; the list is destroyed */
+void cgi_add_list(cgi_t *t, List *cgivars);
+
+/* application/x-www-form-urlencoded, in one pass */
+void cgi_parse_urlencoded(cgi_t *t, Octstr *body);
+
+/* NULL if not there. The Octstr belongs to the table */
+Octstr *cgi_get(cgi_t *t, const char *name);
+
+/* Decode %XX and '+' from s into out (which may be s); returns the decoded length */
+long cgi_url_decode(const char *s, long len, char *out);
+
+/* Decode base64 into out, which needs room for 3 * len / 4 bytes. Returns the decoded
+ * length or -1 if s is not base64 */
+long cgi_base64_decode(const char *s, long len, char *out);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  cluster.c
+ *
+ *    Description:  Multi-node mode. Each node heartbeats into cluster_nodes and
+ *                  takes ownership of its fair share of the destination servers by
+ *                  holding a session-level advisory lock per destination. Locks die
+ *                  with the session, so when a node goes away the survivors pick
+ *                  up its destinations on their next heartbeat.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 11:24:03
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <unistd.h>
+#include <libpq-fe.h>
+
+#include "cluster.h"
+
+static dispatcher2conf_t cconf;
+static int enabled = 0;
+static volatile int cstop = 0;
+static long cluster_th = -1;
+
+static Mutex *owned_lock;
+static int *owned_ids; /* servers we hold the advisory lock for */
+static int num_owned, max_owned;
+
+static PGconn *cluster_connect(void)
+{
+    char port_str[32];
+    PGconn *c;
+
+    sprintf(port_str, "%d", cconf->dbport);
+    c = PQsetdbLogin(cconf->dbhost, cconf->dbport > 0 ? port_str : NULL, NULL, NULL,
+            cconf->dbname, cconf->dbuser, cconf->dbpass);
+    if (PQstatus(c) != CONNECTION_OK) {
+        error(0, "cluster: Failed to connect to database: %s", PQerrorMessage(c));
+        PQfinish(c);
+        return NULL;
+    }
+    return c;
+}
+
+static int owned_index(int server_id)
+{
+    int i;
+
+    for (i = 0; i < num_owned; i++)
+        if (owned_ids[i] == server_id)
+            return i;
+    return -1;
+}
+
+static void add_owned(int server_id)
+{
+    mutex_lock(owned_lock);
+    if (num_owned == max_owned) {
+        max_owned = max_owned ? 2 * max_owned : 16;
+        owned_ids = gw_realloc(owned_ids, max_owned * sizeof owned_ids[0]);
+    }
+    owned_ids[num_owned++] = server_id;
+    mutex_unlock(owned_lock);
+    info(0, "cluster: node %s now owns destination %d", cconf->node_name, server_id);
+}
+
+static void remove_owned(int server_id)
+{
+    int i;
+
+    mutex_lock(owned_lock);
+    if ((i = owned_index(server_id)) >= 0)
+        owned_ids[i] = owned_ids[--num_owned];
+    mutex_unlock(owned_lock);
+    info(0, "cluster: node %s released destination %d", cconf->node_name, server_id);
+}
+
+static int lock_call(PGconn *c, const char *fn, int server_id)
+{
+    char cmd[128];
+    PGresult *r;
+    int ret;
+
+    sprintf(cmd, "SELECT %s(%d, %d)", fn, CLUSTER_LOCK_CLASS, server_id);
+    r = PQexec(c, cmd);
+    ret = PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0 &&
+        strcmp(PQgetvalue(r, 0, 0), "t") == 0;
+    PQclear(r);
+    return ret;
+}
+
+static int heartbeat(PGconn *c)
+{
+    char pid[32], port[32], timeout[32];
+    const char *pvals[] = {cconf->node_name, cconf->myhostname, pid, port};
+    const char *tvals[] = {timeout};
+    PGresult *r;
+    int ret;
+
+    sprintf(pid, "%d", (int)getpid());
+    sprintf(port, "%d", cconf->http_port);
+    sprintf(timeout, "%d", cconf->node_timeout * 10);
+
+    r = PQexecParams(c, "INSERT INTO cluster_nodes (name, hostname, pid, http_port) "
+            "VALUES ($1, $2, $3, $4) ON CONFLICT (name) DO UPDATE SET "
+            "hostname = EXCLUDED.hostname, http_port = EXCLUDED.http_port, pid = EXCLUDED.pid, "
+            "started = CASE WHEN cluster_nodes.pid <> EXCLUDED.pid "
+            "    THEN current_timestamp ELSE cluster_nodes.started END, "
+            "heartbeat = current_timestamp",
+            4, NULL, pvals, NULL, NULL, 0);
+    ret = PQresultStatus(r) == PGRES_COMMAND_OK ? 0 : -1;
+    if (ret < 0)
+        error(0, "cluster: heartbeat failed: %s", PQresultErrorMessage(r));
+    PQclear(r);
+
+    /* Forget nodes that have been gone for a long time */
+    r = PQexecParams(c, "DELETE FROM cluster_nodes WHERE "
+            "heartbeat < current_timestamp - ($1 || ' seconds')::interval",
+            1, NULL, tvals, NULL, NULL, 0);
+    PQclear(r);
+    return ret;
+}
+
+/* Take or give back destinations so that we hold our fair share */
+static void rebalance(PGconn *c)
+{
+    char timeout[32];
+    const char *pvals[] = {timeout, cconf->node_name};
+    PGresult *r;
+    int i, n, nlive, rank = 0, share, *dests;
+
+    /* How many nodes are live, and how many of them sort before us by name */
+    sprintf(timeout, "%d", cconf->node_timeout);
+    r = PQexecParams(c, "SELECT count(*), count(*) FILTER (WHERE name < $2) FROM cluster_nodes "
+            "WHERE heartbeat > current_timestamp - ($1 || ' seconds')::interval",
+            2, NULL, pvals, NULL, NULL, 0);
+    nlive = PQresultStatus(r) == PGRES_TUPLES_OK ? atoi(PQgetvalue(r, 0, 0)) : 0;
+    if (nlive > 0)
+        rank = atoi(PQgetvalue(r, 0, 1));
+    PQclear(r);
+    if (nlive < 1)
+        nlive = 1;
+
+    /* Destinations are the servers that accept anything */
+    r = PQexec(c, "SELECT DISTINCT server_id FROM server_allowed_sources ORDER BY 1");
+    if (PQresultStatus(r) != PGRES_TUPLES_OK) {
+        error(0, "cluster: failed to list destinations: %s", PQresultErrorMessage(r));
+        PQclear(r);
+        return;
+    }
+    n = PQntuples(r);
+    dests = gw_malloc((n + 1) * sizeof dests[0]);
+    for (i = 0; i < n; i++)
+        dests[i] = atoi(PQgetvalue(r, i, 0));
+    PQclear(r);
+
+    /* Everyone gets n / nlive; the first n % nlive nodes by name take one extra each. Rounding
+     * every share up instead could leave a node with none (4 destinations over 3 nodes: 2+2+0) */
+    share = n / nlive + (rank < n % nlive);
+
+    /* Drop destinations that went away, then anything above our share */
+    for (i = num_owned - 1; i >= 0; i--) {
+        int id = owned_ids[i], j, found = 0;
+
+        for (j = 0; j < n && !found; j++)
+            found = (dests[j] == id);
+        if (!found || num_owned > share) {
+            remove_owned(id);
+            lock_call(c, "pg_advisory_unlock", id);
+        }
+    }
+
+    for (i = 0; i < n && num_owned < share; i++)
+        if (owned_index(dests[i]) < 0 && lock_call(c, "pg_try_advisory_lock", dests[i]))
+            add_owned(dests[i]);
+
+    gw_free(dests);
+}
+
+static void cluster_run(void *unused)
+{
+    PGconn *c = NULL;
+
+    while (!cstop) {
+        if (c == NULL || PQstatus(c) != CONNECTION_OK) {
+            /* our locks went with the old session: stop claiming until we have them again */
+            mutex_lock(owned_lock);
+            if (num_owned > 0)
+                warning(0, "cluster: lost database session, dropping %d destination(s)", num_owned);
+            num_owned = 0;
+            mutex_unlock(owned_lock);
+            if (c)
+                PQfinish(c);
+            c = cluster_connect();
+        }
+        if (c && heartbeat(c) == 0)
+            rebalance(c);
+
+        gwthread_sleep(cconf->heartbeat_interval);
+    }
+
+    mutex_lock(owned_lock);
+    num_owned = 0;
+    mutex_unlock(owned_lock);
+    if (c) {
+        /* Leave straight away so that the others need not wait for node-timeout */
+        const char *pvals[] = {cconf->node_name};
+        PGresult *r = PQexecParams(c, "DELETE FROM cluster_nodes WHERE name = $1",
+                1, NULL, pvals, NULL, NULL, 0);
+        PQclear(r);
+        PQfinish(c); /* releases the advisory locks */
+    }
+}
+
+void start_cluster(dispatcher2conf_t config)
+{
+    if (!config->cluster_mode)
+        return;
+    cconf = config;
+    owned_lock = mutex_create();
+    enabled = 1;
+    info(0, "cluster: starting as node %s", config->node_name);
+    cluster_th = gwthread_create(cluster_run, NULL);
+}
+
+void stop_cluster(void)
+{
+    if (!enabled)
+        return;
+    cstop = 1;
+    gwthread_wakeup(cluster_th);
+    gwthread_join(cluster_th);
+    gw_free(owned_ids);
+    owned_ids = NULL;
+    max_owned = 0;
+    mutex_destroy(owned_lock);
+    enabled = 0;
+    info(0, "cluster: node shutdown complete");
+}
+
+int cluster_enabled(void)
+{
+    return enabled;
+}
+
+int cluster_owns(int server_id)
+{
+    int ret;
+
+    if (!enabled)
+        return 1;
+    mutex_lock(owned_lock);
+    ret = owned_index(server_id) >= 0;
+    mutex_unlock(owned_lock);
+    return ret;
+}
+
+Octstr *cluster_owned_servers(void)
+{
+    Octstr *s = octstr_create("{");
+    int i;
+
+    mutex_lock(owned_lock);
+    for (i = 0; i < num_owned; i++)
+        octstr_format_append(s, "%s%d", i ? "," : "", owned_ids[i]);
+    mutex_unlock(owned_lock);
+    octstr_append_char(s, '}');
+    return s;
+}
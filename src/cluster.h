@@ -0,0 +1,39 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  cluster.h
+ *
+ *    Description:  Multi-node mode: several dispatcher2d instances sharing one
+ *                  database, each owning a share of the destination servers.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 11:20:45
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_CLUSTER_H
+#define __DISPATCHER2_CLUSTER_H
+
+#include "conf.h"
+
+/* First key of the two-key advisory locks that mark destination ownership */
+#define CLUSTER_LOCK_CLASS 0x4432
+
+void start_cluster(dispatcher2conf_t config);
+void stop_cluster(void);
+
+/* Non-zero if clustering is on, whether or not we currently own anything */
+int cluster_enabled(void);
+
+/* Whether this node currently owns deliveries to the given server */
+int cluster_owns(int server_id);
+
+/* Owned servers as a Postgres array literal e.g. "{1,4,7}", for use as a query parameter */
+Octstr *cluster_owned_servers(void);
+
+#endif
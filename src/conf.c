@@ -27,6 +27,7 @@
 
 #include "conf.h"
 #include "misc.h"
+#include "log.h"
 
 static int conf_init(dispatcher2conf_t config);
 static int pg_init_db(char *dbhost, int dbport, char *dbname, char *dbuser, char *dbpass);
@@ -108,15 +109,49 @@ static int conf_init(dispatcher2conf_t config)
     config->start_submission_period = 7;
     config->end_submission_period = 22;
 
+    config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    config->acceptor_threads = DEFAULT_ACCEPTOR_THREADS;
+    config->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    config->max_keepalive_requests = DEFAULT_MAX_KEEPALIVE_REQUESTS;
+    config->rate_limit = 0;
+    config->rate_burst = 0;
+    config->daily_quota = 0;
+    config->usage_flush_interval = DEFAULT_USAGE_FLUSH_INTERVAL;
+    config->delivery_target_latency = DEFAULT_DELIVERY_TARGET_LATENCY;
+    config->max_ingest_queue = DEFAULT_MAX_INGEST_QUEUE;
+    config->max_delivery_queue = DEFAULT_MAX_DELIVERY_QUEUE;
+    config->max_destination_queue = DEFAULT_MAX_DESTINATION_QUEUE;
+    config->sms_concurrency = DEFAULT_SMS_CONCURRENCY;
+    config->sms_batch_size = 1;
+    config->db_ingest_pool_size = 0;
+    config->db_delivery_pool_size = 0;
+    config->db_maintenance_pool_size = DEFAULT_MAINTENANCE_POOL_SIZE;
+    config->db_pool_wait = DEFAULT_DB_POOL_WAIT;
+    config->db_health_check_interval = DEFAULT_DB_HEALTH_CHECK_INTERVAL;
+    config->segment_size = DEFAULT_SEGMENT_SIZE;
+    config->segment_fsync_interval = DEFAULT_SEGMENT_FSYNC_INTERVAL;
+    config->dedup_filter_size = DEFAULT_DEDUP_FILTER_SIZE;
+    config->dedup_preload_days = DEFAULT_DEDUP_PRELOAD_DAYS;
+    config->priority_weights[PRIORITY_HIGH] = 8;
+    config->priority_weights[PRIORITY_NORMAL] = 4;
+    config->priority_weights[PRIORITY_LOW] = 1;
+    config->import_poll_interval = DEFAULT_IMPORT_POLL_INTERVAL;
+    config->import_timeout = DEFAULT_IMPORT_TIMEOUT;
+
+    config->cluster_mode = 0;
+    config->heartbeat_interval = DEFAULT_HEARTBEAT_INTERVAL;
+    config->node_timeout = DEFAULT_NODE_TIMEOUT;
+
     return 0;
 }
 
-int parse_conf(FILE *f, dispatcher2conf_t config)
+/* With reload set, only fills in config: logs, SSL and the database are left alone */
+static int parse_conf_real(FILE *f, dispatcher2conf_t config, int reload)
 {
     char field[32], xvalue[512], buf[1024], *xbuf;
 
     /*struct in_addr addr; */
-    int loglevel = 0;
+    int loglevel = 0, i;
 
 #ifdef HAVE_LIBSSL
     Octstr *ssl_client_certfile = NULL, *ssl_serv_certfile = NULL;
@@ -135,6 +170,14 @@ int parse_conf(FILE *f, dispatcher2conf_t config)
         switch(ch) {
             case '#':
                 break;
+            case 'a':
+                if (strcasecmp(field, "acceptor-threads") == 0)
+                    config->acceptor_threads = atoi(value);
+                break;
+            case 'c':
+                if (strcasecmp(field, "cluster-mode") == 0)
+                    config->cluster_mode = (strcasecmp(value, "true") == 0);
+                break;
             case 'd':
                 if (strcasecmp(field, "database") == 0)
                     snprintf(config->dbname, sizeof config->dbname,"%s", value);
@@ -144,6 +187,36 @@ int parse_conf(FILE *f, dispatcher2conf_t config)
                 else if (strcasecmp(field, "default-sender") == 0)
                     snprintf(config->default_sender,
                             sizeof config->default_sender,"%s", value);
+                else if (strcasecmp(field, "drain-timeout") == 0)
+                    config->drain_timeout = atof(value);
+                else if (strcasecmp(field, "daily-quota") == 0)
+                    config->daily_quota = atol(value);
+                else if (strcasecmp(field, "delivery-target-latency") == 0)
+                    config->delivery_target_latency = atof(value) / 1000;
+                else if (strcasecmp(field, "db-ingest-pool-size") == 0)
+                    config->db_ingest_pool_size = atoi(value);
+                else if (strcasecmp(field, "db-delivery-pool-size") == 0)
+                    config->db_delivery_pool_size = atoi(value);
+                else if (strcasecmp(field, "db-maintenance-pool-size") == 0)
+                    config->db_maintenance_pool_size = atoi(value);
+                else if (strcasecmp(field, "db-pool-wait") == 0)
+                    config->db_pool_wait = atof(value);
+                else if (strcasecmp(field, "db-health-check-interval") == 0)
+                    config->db_health_check_interval = atof(value);
+                else if (strcasecmp(field, "dedup-filter-size") == 0)
+                    config->dedup_filter_size = atol(value) * 1024 * 1024;
+                else if (strcasecmp(field, "dedup-preload-days") == 0)
+                    config->dedup_preload_days = atoi(value);
+                break;
+            case 'i':
+                if (strcasecmp(field, "import-poll-interval") == 0)
+                    config->import_poll_interval = atof(value);
+                else if (strcasecmp(field, "import-timeout") == 0)
+                    config->import_timeout = atof(value);
+                break;
+            case 'k':
+                if (strcasecmp(field, "keepalive-timeout") == 0)
+                    config->keepalive_timeout = atoi(value);
                 break;
             case 'e':
                 if (strcasecmp(field, "end-submission-period") == 0)
@@ -154,34 +227,81 @@ int parse_conf(FILE *f, dispatcher2conf_t config)
                     config->num_threads  = strtoul(value, NULL, 16);
                 else if  (strstr(field, "max-retries") != NULL)
                     config->max_retries = atoi(value);
+                else if (strcasecmp(field, "max-keepalive-requests") == 0)
+                    config->max_keepalive_requests = atoi(value);
+                else if (strcasecmp(field, "max-ingest-queue") == 0)
+                    config->max_ingest_queue = atoi(value);
+                else if (strcasecmp(field, "max-delivery-queue") == 0)
+                    config->max_delivery_queue = atoi(value);
+                else if (strcasecmp(field, "max-destination-queue") == 0)
+                    config->max_destination_queue = atoi(value);
                 break;
             case 'h': /* host: database host or http_port */
                 if (strcasecmp(field, "host") == 0)
                     snprintf(config->dbhost, sizeof config->dbhost, "%s", value);
                 else if (strcasecmp(field, "http-port") == 0)
                     config->http_port = atoi(value);
+                else if (strcasecmp(field, "heartbeat-interval") == 0)
+                    config->heartbeat_interval = atof(value);
                 break;
             case 'l': /*  log dir */
                 if (strstr(field, "logdir") != NULL)
                     strncpy(config->logdir, value, sizeof config->logdir);
                 else if (strcasecmp(field, "loglevel") == 0)
                     loglevel = atoi(value);
+                else if (strcasecmp(field, "log-body-bytes") == 0)
+                    config->log_body_bytes = atoi(value);
+                break;
+            case 'n':
+                if (strcasecmp(field, "node-name") == 0)
+                    snprintf(config->node_name, sizeof config->node_name, "%s", value);
+                else if (strcasecmp(field, "node-timeout") == 0)
+                    config->node_timeout = atoi(value);
                 break;
             case 'p':
                 if (strcasecmp(field, "password") == 0)
                     snprintf(config->dbpass, sizeof config->dbpass, "%s", value);
                 else if (strcasecmp(field, "port") == 0)
                     config->dbport = atoi(value);
+                else if (strcasecmp(field, "priority-weights") == 0)
+                    /* high, normal, low */
+                    sscanf(value, "%d,%d,%d", &config->priority_weights[PRIORITY_HIGH],
+                            &config->priority_weights[PRIORITY_NORMAL],
+                            &config->priority_weights[PRIORITY_LOW]);
+                break;
+            case 'q':
+                if (strcasecmp(field, "queue-admission-limit") == 0)
+                    config->queue_admission_limit = atoi(value);
                 break;
             case 'r':
                 if (strcasecmp(field,"request-process-interval") == 0)
                     config->request_process_interval = atof(value);
+                else if (strcasecmp(field, "rate-limit") == 0)
+                    config->rate_limit = atof(value);
+                else if (strcasecmp(field, "rate-burst") == 0)
+                    config->rate_burst = atof(value);
+                break;
             case 's':
                 if (strcasecmp(field, "start-submission-period") == 0)
                     config->start_submission_period = atoi(value);
                 else if (strcasecmp(field, "sendsms-url") == 0)
                     snprintf(config->sendsmsurl,
                             sizeof config->sendsmsurl, "%s", value);
+                else if (strcasecmp(field, "sendsms-admission-limit") == 0)
+                    config->sendsms_admission_limit = atoi(value);
+                else if (strcasecmp(field, "sms-concurrency") == 0)
+                    config->sms_concurrency = atoi(value);
+                else if (strcasecmp(field, "sms-batch-size") == 0)
+                    config->sms_batch_size = atoi(value);
+                else if (strcasecmp(field, "segment-log-dir") == 0)
+                    snprintf(config->segment_log_dir, sizeof config->segment_log_dir, "%s", value);
+                else if (strcasecmp(field, "segment-log-destinations") == 0)
+                    snprintf(config->segment_log_destinations,
+                            sizeof config->segment_log_destinations, "%s", value);
+                else if (strcasecmp(field, "segment-size") == 0)
+                    config->segment_size = atol(value) * 1024 * 1024;
+                else if (strcasecmp(field, "segment-fsync-interval") == 0)
+                    config->segment_fsync_interval = atof(value) / 1000;
 #ifdef HAVE_LIBSSL
                 else if (strcasecmp(field, "ssl-client-certkey-file") == 0)
                     ssl_client_certfile = octstr_create(value);
@@ -202,18 +322,20 @@ int parse_conf(FILE *f, dispatcher2conf_t config)
                 else if (strcasecmp(field, "use-ssl") == 0)
                     config->use_ssl = (strcasecmp(value, "true") == 0);
 #endif
-                    break;
+                else if (strcasecmp(field, "usage-flush-interval") == 0)
+                    config->usage_flush_interval = atof(value);
+                break;
         }
 
     }
 
 #ifdef HAVE_LIBSSL
-    if (ssl_client_certfile)
+    if (ssl_client_certfile && !reload)
         use_global_client_certkey_file(ssl_client_certfile);
 
-    if (ssl_serv_certfile)
+    if (ssl_serv_certfile && !reload)
         use_global_server_certkey_file(ssl_serv_certfile, ssl_serv_certfile);
-    if (ssl_ca_file)
+    if (ssl_ca_file && !reload)
         use_global_trusted_ca_file(ssl_ca_file);
 
     octstr_destroy(ssl_client_certfile);
@@ -221,6 +343,10 @@ int parse_conf(FILE *f, dispatcher2conf_t config)
     octstr_destroy(ssl_ca_file);
 #endif
 
+    config->loglevel = loglevel;
+    if (reload)
+        goto validate;
+
     if (config->logdir[0]) {
          char buf[512];
 
@@ -229,22 +355,139 @@ int parse_conf(FILE *f, dispatcher2conf_t config)
     }
 
     log_set_output_level(loglevel); /*  Set stderr level of logging as well */
+validate:
     if (config->num_threads < DEFAULT_NUM_THREADS)
         config->num_threads = DEFAULT_NUM_THREADS;
+    if (config->acceptor_threads < 1)
+        config->acceptor_threads = 1;
+    if (config->delivery_target_latency <= 0)
+        config->delivery_target_latency = DEFAULT_DELIVERY_TARGET_LATENCY;
+    if (config->usage_flush_interval <= 0)
+        config->usage_flush_interval = DEFAULT_USAGE_FLUSH_INTERVAL;
+    if (config->max_ingest_queue < 1)
+        config->max_ingest_queue = DEFAULT_MAX_INGEST_QUEUE;
+    if (config->max_delivery_queue < 1)
+        config->max_delivery_queue = DEFAULT_MAX_DELIVERY_QUEUE;
+    if (config->max_destination_queue < 1)
+        config->max_destination_queue = DEFAULT_MAX_DESTINATION_QUEUE;
+    if (config->max_destination_queue > config->max_delivery_queue)
+        config->max_destination_queue = config->max_delivery_queue;
+    if (config->sms_concurrency < 1)
+        config->sms_concurrency = DEFAULT_SMS_CONCURRENCY;
+    if (config->sms_batch_size < 1)
+        config->sms_batch_size = 1;
+    if (config->keepalive_timeout < 1)
+        config->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    if (config->db_ingest_pool_size < 0)
+        config->db_ingest_pool_size = 0;
+    if (config->db_delivery_pool_size < 0)
+        config->db_delivery_pool_size = 0;
+    if (config->db_maintenance_pool_size < 1)
+        config->db_maintenance_pool_size = DEFAULT_MAINTENANCE_POOL_SIZE;
+    if (config->db_pool_wait < 0)
+        config->db_pool_wait = DEFAULT_DB_POOL_WAIT;
+    if (config->db_health_check_interval < 0)
+        config->db_health_check_interval = DEFAULT_DB_HEALTH_CHECK_INTERVAL;
+    if (config->segment_size < 1024 * 1024)
+        config->segment_size = DEFAULT_SEGMENT_SIZE;
+    if (config->segment_fsync_interval < 0)
+        config->segment_fsync_interval = DEFAULT_SEGMENT_FSYNC_INTERVAL;
+    if (config->dedup_filter_size < 0)
+        config->dedup_filter_size = 0;
+    if (config->dedup_preload_days < 0)
+        config->dedup_preload_days = 0;
+    for (i = PRIORITY_HIGH; i < NUM_PRIORITIES; i++)
+        if (config->priority_weights[i] < 1)
+            config->priority_weights[i] = 1;
+    if (config->import_poll_interval < 1)
+        config->import_poll_interval = 1;
+    if (config->import_timeout <= 0)
+        config->import_timeout = DEFAULT_IMPORT_TIMEOUT;
+
+    if (config->node_name[0] == 0)
+        snprintf(config->node_name, sizeof config->node_name, "%s:%d",
+                config->myhostname, config->http_port);
+    if (config->heartbeat_interval <= 0)
+        config->heartbeat_interval = DEFAULT_HEARTBEAT_INTERVAL;
+    if (config->node_timeout < 2 * config->heartbeat_interval)
+        config->node_timeout = 2 * config->heartbeat_interval + 1;
+    /* A node's segment log is only delivered by that node, whatever the ring says */
+    if (config->cluster_mode && config->segment_log_dir[0]) {
+        error(0, "readconfig: segment-log-dir cannot be used with cluster-mode");
+        return -1;
+    }
 
+    if (reload)
+        return 0;
     if (pg_init_db(config->dbhost, config->dbport, config->dbname, config->dbuser, config->dbpass) < 0)
         return -1;
     else
         return 0;
 }
 
+int parse_conf(FILE *f, dispatcher2conf_t config)
+{
+    return parse_conf_real(f, config, 0);
+}
+
+/* Re-reads the config file and applies the settings that can change while we run.
+ * Database, port, SSL and cluster identity need a restart (or a takeover, see -t). */
+int reload_conf(FILE *f, dispatcher2conf_t config)
+{
+    struct dispatcher2conf *x = gw_malloc(sizeof *x);
+
+    if (parse_conf_real(f, x, 1) < 0) {
+        gw_free(x);
+        return -1;
+    }
+    config->num_threads = x->num_threads;
+    config->max_retries = x->max_retries;
+    config->request_process_interval = x->request_process_interval;
+    config->use_global_submission_period = x->use_global_submission_period;
+    config->start_submission_period = x->start_submission_period;
+    config->end_submission_period = x->end_submission_period;
+    config->heartbeat_interval = x->heartbeat_interval;
+    config->node_timeout = x->node_timeout;
+    config->drain_timeout = x->drain_timeout;
+    config->max_keepalive_requests = x->max_keepalive_requests;
+    config->rate_limit = x->rate_limit; /* buckets pick these up on their next flush */
+    config->rate_burst = x->rate_burst;
+    config->daily_quota = x->daily_quota;
+    config->usage_flush_interval = x->usage_flush_interval;
+    config->delivery_target_latency = x->delivery_target_latency;
+    config->max_ingest_queue = x->max_ingest_queue;
+    config->max_delivery_queue = x->max_delivery_queue;
+    config->max_destination_queue = x->max_destination_queue;
+    config->queue_admission_limit = x->queue_admission_limit;
+    config->sendsms_admission_limit = x->sendsms_admission_limit;
+    config->sms_batch_size = x->sms_batch_size;
+    config->log_body_bytes = x->log_body_bytes;
+    config->db_ingest_pool_size = x->db_ingest_pool_size; /* see dbpool_resize() */
+    config->db_delivery_pool_size = x->db_delivery_pool_size;
+    config->db_maintenance_pool_size = x->db_maintenance_pool_size;
+    config->db_pool_wait = x->db_pool_wait;
+    config->db_health_check_interval = x->db_health_check_interval;
+    memcpy(config->priority_weights, x->priority_weights, sizeof x->priority_weights);
+    config->import_poll_interval = x->import_poll_interval;
+    config->import_timeout = x->import_timeout;
+    if (x->loglevel != config->loglevel) {
+        config->loglevel = x->loglevel;
+        log_set_log_level(x->loglevel);
+        log_set_output_level(x->loglevel);
+        d2log_set_level(x->loglevel);
+    }
+    gw_free(x);
+    return 0;
+}
+
 #include <libpq-fe.h>
 
 #define DEFAULT_DB "template1"
-#define MIN_PG_VERSION 80400 /*  v8.4 */
+#define MIN_PG_VERSION 90600 /* v9.6: ADD COLUMN IF NOT EXISTS; 9.5 for ON CONFLICT and SKIP LOCKED */
 
 static int check_db_structure(PGconn *c);
 static int handle_db_init(char *dbhost, char *dbport, char *dbname, char *dbuser, char *dbpass);
+static void handle_db_upgrade(PGconn *c);
 
 static int pg_init_db(char *dbhost, int dbport, char *dbname, char *dbuser, char *dbpass)
 {
@@ -269,14 +512,17 @@ static int pg_init_db(char *dbhost, int dbport, char *dbname, char *dbuser, char
           PQfinish(c);
           if (x < 0)
                return -1;
+          c = PQsetdbLogin(dbhost, port_str, NULL, NULL, dbname, dbuser, dbpass);
      }  else if ((x = PQserverVersion(c)) < MIN_PG_VERSION) {
           error(1, "Current database version [%d.%d.%d] is not supported. Minimum should be v%d.%d.%d",
                 (x/10000), (x/100) % 100, x % 100,
                 (MIN_PG_VERSION/10000), (MIN_PG_VERSION/100) % 100, MIN_PG_VERSION % 100);
           PQfinish(c);
           return -1;
-     } else
-          PQfinish(c);
+     }
+     if (PQstatus(c) == CONNECTION_OK)
+          handle_db_upgrade(c);
+     PQfinish(c);
      return 0;
 }
 
@@ -370,3 +616,55 @@ static int handle_db_init(char *dbhost, char *dbport, char *dbname, char *dbuser
           info(0, "Hopefully we are done initialising the database [%s] [%d error(s)], we'll try to connect to it", dbname, err);
      return 0;
 }
+
+/* Creates requests_submission_idx unless it is there already. Building it on a table with
+ * duplicate (source, submissionid) rows would sort the whole table only to fail, so look for
+ * them first and leave the index out, with one warning, while there are any */
+static void create_submission_index(PGconn *c)
+{
+     PGresult *r;
+     long dups;
+
+     r = PQexec(c, "SELECT to_regclass('requests_submission_idx') IS NOT NULL");
+     if (PQresultStatus(r) != PGRES_TUPLES_OK || strcmp(PQgetvalue(r, 0, 0), "t") == 0) {
+          PQclear(r);
+          return;
+     }
+     PQclear(r);
+
+     r = PQexec(c, "SELECT count(*) FROM (SELECT 1 FROM requests WHERE submissionid > 0 "
+                "GROUP BY source, submissionid HAVING count(*) > 1) d");
+     if (PQresultStatus(r) != PGRES_TUPLES_OK) {
+          warning(0, "Failed to check requests for duplicate submissions: %s", PQresultErrorMessage(r));
+          PQclear(r);
+          return;
+     }
+     dups = atol(PQgetvalue(r, 0, 0));
+     PQclear(r);
+     if (dups > 0) {
+          warning(0, "Not creating unique index requests_submission_idx: %ld (source, submissionid) "
+                  "pair(s) in requests are queued more than once. Submissions are still deduplicated "
+                  "by lookup; delete or renumber (submissionid = 0) the extra rows and restart to add it",
+                  dups);
+          return;
+     }
+     r = PQexec(c, SUBMISSION_INDEX_CMD);
+     if (PQresultStatus(r) != PGRES_COMMAND_OK)
+          warning(0, "Failed to create requests_submission_idx: %s", PQresultErrorMessage(r));
+     PQclear(r);
+}
+
+/* Bring an existing database up to date. Every command is idempotent, so they all run on each start. */
+static void handle_db_upgrade(PGconn *c)
+{
+     PGresult *r;
+     int i;
+
+     for (i = 0; upgrade_cmds[i]; i++) {
+          r = PQexec(c, upgrade_cmds[i]);
+          if (PQresultStatus(r) != PGRES_COMMAND_OK)
+               warning(0, "Database upgrade command %d failed: %s", i+1, PQresultErrorMessage(r));
+          PQclear(r);
+     }
+     create_submission_index(c);
+}
@@ -7,7 +7,33 @@
 #define CONFFILE "/etc/dispatcher2.conf"
 
 #define DEFAULT_NUM_THREADS 4
+#define DEFAULT_ACCEPTOR_THREADS 2
+#define DEFAULT_KEEPALIVE_TIMEOUT 60 /* seconds an idle ingest connection is kept open */
+#define DEFAULT_MAX_KEEPALIVE_REQUESTS 1000
+#define DEFAULT_DELIVERY_TARGET_LATENCY 2 /* seconds */
+#define DEFAULT_MAX_INGEST_QUEUE 1000 /* accepted requests waiting for a dispatcher */
+#define DEFAULT_MAX_DELIVERY_QUEUE 10000 /* requests loaded from the database for delivery */
+#define DEFAULT_MAX_DESTINATION_QUEUE 1000 /* of those, for any one destination */
+#define DEFAULT_SMS_CONCURRENCY 4 /* parallel calls to sendsms-url */
+#define DEFAULT_MAINTENANCE_POOL_SIZE 2 /* usage flushes, server config loads */
+#define DEFAULT_DB_POOL_WAIT 5 /* seconds to wait for a pooled database connection */
+#define DEFAULT_DB_HEALTH_CHECK_INTERVAL 30 /* ping pooled connections idle this long */
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024) /* bytes per segment log file */
+#define DEFAULT_SEGMENT_FSYNC_INTERVAL 0.002 /* seconds appends wait to share a flush */
+#define DEFAULT_DEDUP_FILTER_SIZE (4 * 1024 * 1024) /* bytes: ~1.6 million submissions per half */
+#define DEFAULT_DEDUP_PRELOAD_DAYS 7
+#define DEFAULT_IMPORT_POLL_INTERVAL 5 /* seconds before the first poll of an async import */
+#define DEFAULT_IMPORT_TIMEOUT 3600 /* seconds an async import may run before it is failed */
+
+/* Request priority classes: critical is always served first, the others share what is
+ * left by priority-weights */
+enum { PRIORITY_CRITICAL, PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW, NUM_PRIORITIES };
+#define PRIORITY_NAMES {"critical", "high", "normal", "low"}
+#define DEFAULT_USAGE_FLUSH_INTERVAL 10 /* seconds between saving per-user usage */
 #define MAX_BATCH_RETRIES 10
+#define DEFAULT_DRAIN_TIMEOUT 30 /* seconds to finish in-flight work on shutdown/handoff */
+#define DEFAULT_HEARTBEAT_INTERVAL 5 /* seconds */
+#define DEFAULT_NODE_TIMEOUT 30 /* seconds without a heartbeat before a node is considered dead */
 struct dispatcher2conf {
     char dbhost[128];
     char dbuser[128];
@@ -18,9 +44,40 @@ struct dispatcher2conf {
     int dbport;
     int  http_port;
     unsigned num_threads;
+    int acceptor_threads; /* threads taking connections off the listener */
+    int keepalive_timeout;
+    int max_keepalive_requests; /* ask the client to reconnect after this many */
+    double rate_limit; /* per user requests/sec unless users.max_rate is set, 0 = none */
+    double rate_burst;
+    long daily_quota; /* per user unless users.daily_quota is set, 0 = none */
+    double usage_flush_interval;
+    double delivery_target_latency; /* destinations get more concurrency while under this */
+    int max_ingest_queue; /* beyond this, new requests are shed with 503 */
+    int max_delivery_queue;
+    int max_destination_queue; /* so that one destination's backlog can't fill the queue */
+    int queue_admission_limit; /* per route pending requests, 0 = only max_ingest_queue */
+    int sendsms_admission_limit;
+    int sms_concurrency;
+    int sms_batch_size; /* recipients per gateway call, for messages with the same text */
+    int db_ingest_pool_size; /* 0 = one per dispatcher */
+    int db_delivery_pool_size; /* 0 = one per delivery worker, plus the producer */
+    int db_maintenance_pool_size;
+    double db_pool_wait;
+    double db_health_check_interval;
+    char segment_log_dir[256]; /* empty: every request goes to the requests table */
+    char segment_log_destinations[512]; /* server names, comma separated; empty = all */
+    long segment_size;
+    double segment_fsync_interval;
+    long dedup_filter_size; /* bytes, 0 = look every submission up */
+    int dedup_preload_days;
+    int priority_weights[NUM_PRIORITIES]; /* [PRIORITY_CRITICAL] unused: strict */
+    double import_poll_interval; /* servers.async_import: polls back off from this */
+    double import_timeout;
 
     int use_ssl;
     char logdir[128];
+    int loglevel;
+    int log_body_bytes; /* of request/response bodies logged at debug level, 0 = none */
     int max_retries;
     double request_process_interval;
     int use_global_submission_period;
@@ -29,11 +86,18 @@ struct dispatcher2conf {
     char default_queue_status[128];
     char sendsmsurl[512];
     char default_sender[128];
+    double drain_timeout;
+
+    int cluster_mode; /* share the database with other dispatcher2d nodes */
+    char node_name[128];
+    double heartbeat_interval;
+    int node_timeout;
 };
 
 typedef struct dispatcher2conf *dispatcher2conf_t;
 
 dispatcher2conf_t readconfig(char *conffile);
 int parse_conf(FILE * f, dispatcher2conf_t config);
+int reload_conf(FILE *f, dispatcher2conf_t config);
 
 #endif
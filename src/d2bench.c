@@ -0,0 +1,373 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  d2bench.c
+ *
+ *    Description:  Microbenchmarks for the daemon's hot functions: CGI parsing,
+ *                  Basic Auth decoding, XPath extraction of import summaries, JSON
+ *                  response parsing, INSERT parameter marshalling and URI routing.
+ *                  Reports ns/op and allocations/op and compares against a saved
+ *                  baseline.
+ *
+ *                  Allocations are counted by wrapping malloc/calloc/realloc at link
+ *                  time (see src/Makefile.am), so they cover our code and the static
+ *                  gwlib but not the shared libxml2, jansson or libpq.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 10:31:17
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "dispatcher2.h"
+#include "misc.h"
+#include "log.h"
+#include "request_processor.h"
+
+#define MIN_BENCH_TIME 0.5 /* seconds per benchmark */
+#define MAX_BENCHES 32
+
+/* ---- allocation counting ---- */
+static volatile unsigned long alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_realloc(p, size);
+}
+
+/* ---- inputs ---- */
+static char *testdir = "../testcases";
+static Octstr *t3_xml, *resp_xml, *resp_json, *form_body, *multipart_body;
+static List *form_headers, *multipart_headers, *auth_headers;
+static cgi_t *form_args;
+static xmlDocPtr resp_doc;
+static request_t bench_req;
+static struct dispatcher2conf bench_conf;
+static Octstr *uris[3];
+
+static Octstr *read_input(char *name, char *fallback)
+{
+    Octstr *path = octstr_format("%s/%s", testdir, name);
+    Octstr *s = octstr_read_file(octstr_get_cstr(path));
+
+    if (s == NULL) {
+        warning(0, "d2bench: %s not found, using built-in input", octstr_get_cstr(path));
+        s = octstr_create(fallback);
+    }
+    octstr_destroy(path);
+    return s;
+}
+
+static void setup_inputs(void)
+{
+    Octstr *b;
+
+    t3_xml = read_input("t3.xml", "<dataValueSet xmlns=\"http://dhis2.org/schema/dxf/2.0\" "
+            "dataSet=\"V1kJRs8CtW4\" period=\"2013W33\"><dataValue dataElement=\"KPmTI3TGwZw\" "
+            "categoryOptionCombo=\"3W3d2AqT4Aq\" value=\"48\" /></dataValueSet>");
+    resp_xml = read_input("resp.xml", "<?xml version='1.0' encoding='UTF-8'?><importSummary "
+            "xmlns=\"http://dhis2.org/schema/dxf/2.0\"><status>SUCCESS</status>"
+            "<importCount imported=\"5\" updated=\"13\" ignored=\"8\" deleted=\"1\"/></importSummary>");
+    resp_doc = xmlParseMemory(octstr_get_cstr(resp_xml), octstr_len(resp_xml));
+    resp_json = octstr_create("{\"responseType\":\"ImportSummary\",\"status\":\"SUCCESS\","
+            "\"description\":\"Import process completed successfully\","
+            "\"importCount\":{\"imported\":5,\"updated\":13,\"ignored\":8,\"deleted\":1}}");
+
+    /* A /queue form post as sent by mTrac: the report travels in raw_msg */
+    b = octstr_duplicate(t3_xml);
+    octstr_url_encode(b);
+    form_body = octstr_format("source=mtrack&destination=dhis2&msgid=10001&week=W33&year=2016"
+            "&msisdn=%%2B256782820208&facility=Kampala%%20HC%%20IV&district=Kampala"
+            "&report_type=cases&raw_msg=%S", b);
+    octstr_destroy(b);
+    form_headers = http_create_empty_headers();
+    http_header_add(form_headers, "Content-Type", "application/x-www-form-urlencoded");
+    form_args = cgi_create();
+    cgi_parse_urlencoded(form_args, form_body);
+
+    multipart_body = octstr_format("--XyZ\r\nContent-Disposition: form-data; name=\"source\"\r\n\r\nmtrack\r\n"
+            "--XyZ\r\nContent-Disposition: form-data; name=\"destination\"\r\n\r\ndhis2\r\n"
+            "--XyZ\r\nContent-Disposition: form-data; name=\"payload\"\r\nContent-Type: text/xml\r\n\r\n"
+            "%S\r\n--XyZ--\r\n", t3_xml);
+    multipart_headers = http_create_empty_headers();
+    http_header_add(multipart_headers, "Content-Type", "multipart/form-data; boundary=XyZ");
+
+    auth_headers = http_create_empty_headers();
+    http_header_add(auth_headers, "Authorization", "Basic YWRtaW46YWRtaW4="); /* admin:admin */
+
+    bench_req.source = 2;
+    bench_req.destination = 4;
+    bench_req.payload = t3_xml;
+    bench_req.ctype = octstr_create("xml");
+    bench_req.msgid = 10001;
+    bench_req.week = octstr_create("W33");
+    bench_req.month = octstr_create("");
+    bench_req.year = 2016;
+    bench_req.msisdn = octstr_create("+256782820208");
+    bench_req.facility = octstr_create("Kampala HC IV");
+    bench_req.district = octstr_create("Kampala");
+    bench_req.report_type = octstr_create("cases");
+    bench_req.priority = PRIORITY_NORMAL;
+    sprintf(bench_conf.default_queue_status, "ready");
+
+    uris[0] = octstr_create("/queue");
+    uris[1] = octstr_create("/sendsms");
+    uris[2] = octstr_create("/favicon.ico");
+}
+
+/* ---- benchmarks ---- */
+static void bench_parse_cgivars_form(void)
+{
+    cgi_t *cgivars = cgi_create(), *ctypes = cgi_create();
+
+    parse_cgivars(form_headers, form_body, cgivars, ctypes);
+    cgi_destroy(cgivars);
+    cgi_destroy(ctypes);
+}
+
+static void bench_parse_cgivars_multipart(void)
+{
+    cgi_t *cgivars = cgi_create(), *ctypes = cgi_create();
+
+    parse_cgivars(multipart_headers, multipart_body, cgivars, ctypes);
+    cgi_destroy(cgivars);
+    cgi_destroy(ctypes);
+}
+
+/* the fields queue_request() looks up */
+static void bench_cgi_get_queue(void)
+{
+    static const char *names[] = {"username", "password", "source", "destination", "msgid",
+        "week", "month", "year", "is_qparams", "msisdn", "raw_msg", "facility", "district",
+        "report_type"};
+    int i;
+
+    for (i = 0; i < NELEMS(names); i++)
+        cgi_get(form_args, names[i]);
+}
+
+static void bench_ba_credentials(void)
+{
+    Octstr *user, *pass;
+
+    ba_credentials(auth_headers, &user, &pass);
+    octstr_destroy(user);
+    octstr_destroy(pass);
+}
+
+static void bench_findvalue(void)
+{
+    xmlChar *v[4];
+    int i;
+
+    v[0] = findvalue(resp_doc, (xmlChar *)"//xmlns:status", 1);
+    v[1] = findvalue(resp_doc, (xmlChar *)"//xmlns:importCount[1]/@imported", 1);
+    v[2] = findvalue(resp_doc, (xmlChar *)"//xmlns:importCount[1]/@ignored", 1);
+    v[3] = findvalue(resp_doc, (xmlChar *)"//xmlns:importCount[1]/@updated", 1);
+    for (i = 0; i < 4; i++)
+        if (v[i])
+            xmlFree(v[i]);
+}
+
+static void bench_xml_response(void)
+{
+    xmlDocPtr doc = xmlParseMemory(octstr_get_cstr(resp_xml), octstr_len(resp_xml));
+    xmlChar *s = findvalue(doc, (xmlChar *)"//xmlns:status", 1);
+
+    if (s)
+        xmlFree(s);
+    xmlFreeDoc(doc);
+}
+
+static void bench_json_response(void)
+{
+    char st[64], buf[256];
+
+    parse_json_response(resp_json, st, sizeof st, buf, sizeof buf);
+}
+
+static void bench_request_to_params(void)
+{
+    struct request_params p;
+
+    request_to_params(&bench_req, &bench_conf, &p);
+}
+
+static void bench_uri2handler(void)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+        (void)uri2handler(uris[i]);
+}
+
+static struct {
+    char *name;
+    void (*func)(void);
+} benches[] = {
+    {"parse_cgivars/form", bench_parse_cgivars_form},
+    {"parse_cgivars/multipart", bench_parse_cgivars_multipart},
+    {"cgi_get/queue", bench_cgi_get_queue},
+    {"ba_credentials", bench_ba_credentials},
+    {"findvalue/import_summary", bench_findvalue},
+    {"do_request/xml_response", bench_xml_response},
+    {"do_request/json_response", bench_json_response},
+    {"save_request/params", bench_request_to_params},
+    {"uri2handler/3_lookups", bench_uri2handler},
+};
+
+typedef struct {
+    char name[64];
+    double ns_op;
+    double allocs_op;
+} bench_result_t;
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void run_bench(int i, bench_result_t *res)
+{
+    long n, iters = 1;
+    unsigned long a0;
+    double t0, elapsed;
+
+    benches[i].func(); /* warm up */
+    for (;;) {
+        a0 = alloc_count;
+        t0 = now();
+        for (n = 0; n < iters; n++)
+            benches[i].func();
+        elapsed = now() - t0;
+        if (elapsed >= MIN_BENCH_TIME)
+            break;
+        iters = elapsed > 0.01 ? (long)(iters * MIN_BENCH_TIME * 1.2 / elapsed) + 1 : iters * 10;
+    }
+    snprintf(res->name, sizeof res->name, "%s", benches[i].name);
+    res->ns_op = elapsed * 1e9 / iters;
+    res->allocs_op = (double)(alloc_count - a0) / iters;
+}
+
+static int load_baseline(char *file, bench_result_t *base, int max)
+{
+    FILE *f = fopen(file, "r");
+    int n = 0;
+
+    if (!f) {
+        error(0, "d2bench: cannot read baseline %s", file);
+        return -1;
+    }
+    while (n < max && fscanf(f, "%63s %lf %lf", base[n].name, &base[n].ns_op, &base[n].allocs_op) == 3)
+        n++;
+    fclose(f);
+    return n;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "usage: d2bench [-d testcases-dir] [-f filter] [-o save-baseline] [-b baseline]\n"
+            "               [-t regression-threshold-percent]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_result_t res[MAX_BENCHES], base[MAX_BENCHES];
+    char *filter = NULL, *save = NULL, *baseline = NULL;
+    double threshold = 10.0;
+    int i, j, nres = 0, nbase = 0, regressions = 0, c;
+
+    gwlib_init();
+    while ((c = getopt(argc, argv, "d:f:o:b:t:h")) != -1) {
+        switch (c) {
+            case 'd':
+                testdir = optarg;
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'o':
+                save = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            default:
+                bench_usage();
+        }
+    }
+    log_set_output_level(GW_WARNING);
+    d2log_set_level(GW_WARNING); /* what production runs at: hot path logging is skipped */
+    if (baseline && (nbase = load_baseline(baseline, base, MAX_BENCHES)) < 0)
+        bench_usage();
+
+    setup_inputs();
+
+    fprintf(stdout, "%-28s %12s %12s", "benchmark", "ns/op", "allocs/op");
+    if (nbase > 0)
+        fprintf(stdout, " %12s %8s", "base ns/op", "delta");
+    fprintf(stdout, "\n");
+
+    for (i = 0; i < NELEMS(benches); i++) {
+        if (filter && strstr(benches[i].name, filter) == NULL)
+            continue;
+        run_bench(i, &res[nres]);
+        fprintf(stdout, "%-28s %12.1f %12.2f", res[nres].name, res[nres].ns_op, res[nres].allocs_op);
+        for (j = 0; j < nbase; j++)
+            if (strcmp(base[j].name, res[nres].name) == 0) {
+                double delta = (res[nres].ns_op - base[j].ns_op) * 100.0 / base[j].ns_op;
+
+                fprintf(stdout, " %12.1f %+7.1f%%%s", base[j].ns_op, delta,
+                        delta > threshold || res[nres].allocs_op > base[j].allocs_op ? " REGRESSION" : "");
+                if (delta > threshold || res[nres].allocs_op > base[j].allocs_op)
+                    regressions++;
+                break;
+            }
+        fprintf(stdout, "\n");
+        nres++;
+    }
+
+    if (save) {
+        FILE *f = fopen(save, "w");
+
+        if (!f)
+            panic(0, "d2bench: cannot write baseline %s", save);
+        for (i = 0; i < nres; i++)
+            fprintf(f, "%s %.1f %.2f\n", res[i].name, res[i].ns_op, res[i].allocs_op);
+        fclose(f);
+    }
+
+    gwlib_shutdown();
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  d2loadgen.c
+ *
+ *    Description:  Load generator and benchmark driver for the dispatcher2 /queue
+ *                  endpoint. Keeps a fixed number of submissions in flight, mixes
+ *                  XML and JSON payloads of several sizes and supports Basic Auth,
+ *                  CGI credentials or no credentials. With -D it waits for the daemon
+ *                  to deliver what was queued and reports queue-to-delivery latency
+ *                  from the requests table.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 09:40:02
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <libpq-fe.h>
+#include "gwlib/gwlib.h"
+
+#define MAX_SIZES 16
+
+enum auth_mode { AUTH_BASIC, AUTH_CGI, AUTH_NONE };
+
+static char *queue_url = "http://localhost:9090/queue";
+static char *source = "mtrack";
+static char *destination = "dhis2";
+static char *credentials = "admin:admin";
+static enum auth_mode auth = AUTH_BASIC;
+static long total = 1000;
+static int concurrency = 10;
+static int json_percent = 0;
+static int sizes[MAX_SIZES] = {5};
+static int num_sizes = 1;
+static char *db_conninfo = NULL;
+static double drain_timeout = 600;
+static Octstr *xml_file = NULL, *json_file = NULL;
+
+typedef struct {
+    double started;
+} inflight_t;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: d2loadgen [-u queue-url] [-n requests] [-c concurrency] [-J json-percent]\n"
+            "                 [-s values-per-payload[,...]] [-x payload.xml] [-j payload.json]\n"
+            "                 [-a basic|cgi|none] [-U user:pass] [-f source] [-t destination]\n"
+            "                 [-D conninfo] [-w drain-timeout-secs]\n");
+    exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, long n, double p)
+{
+    long i;
+
+    if (n <= 0)
+        return 0;
+    i = (long)(p * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+/* Synthetic DHIS2 dataValueSet with nvalues data values, shaped like testcases/t3.xml */
+static Octstr *make_xml_payload(int nvalues, long seq)
+{
+    Octstr *p;
+    int i;
+
+    if (xml_file)
+        return octstr_duplicate(xml_file);
+    p = octstr_format("<dataValueSet xmlns=\"http://dhis2.org/schema/dxf/2.0\" dataSet=\"V1kJRs8CtW4\" "
+            "completeDate=\"2016-08-19T19:27:29Z\" period=\"2016W33\" orgUnitIdScheme=\"uuid\" "
+            "orgUnit=\"8f353545-8d62-4af3-9a6c-%012ld\">\n", seq);
+    for (i = 0; i < nvalues; i++)
+        octstr_format_append(p, "<dataValue dataElement=\"KPmTI3TGwZw\" "
+                "categoryOptionCombo=\"c%010d\" value=\"%ld\" />\n", i, (seq + i) % 100);
+    octstr_append_cstr(p, "</dataValueSet>\n");
+    return p;
+}
+
+static Octstr *make_json_payload(int nvalues, long seq)
+{
+    Octstr *p;
+    int i;
+
+    if (json_file)
+        return octstr_duplicate(json_file);
+    p = octstr_format("{\"dataSet\":\"V1kJRs8CtW4\",\"completeDate\":\"2016-08-19\",\"period\":\"2016W33\","
+            "\"orgUnit\":\"8f353545-8d62-4af3-9a6c-%012ld\",\"dataValues\":[", seq);
+    for (i = 0; i < nvalues; i++)
+        octstr_format_append(p, "%s{\"dataElement\":\"KPmTI3TGwZw\",\"categoryOptionCombo\":"
+                "\"c%010d\",\"value\":\"%ld\"}", i ? "," : "", i, (seq + i) % 100);
+    octstr_append_cstr(p, "]}");
+    return p;
+}
+
+static void start_one(HTTPCaller *caller, long seq)
+{
+    List *h = http_create_empty_headers();
+    int is_json = (seq * 7919 % 100) < json_percent; /* deterministic mix */
+    int nvalues = sizes[seq % num_sizes];
+    Octstr *body = is_json ? make_json_payload(nvalues, seq) : make_xml_payload(nvalues, seq);
+    Octstr *url;
+    inflight_t *t = gw_malloc(sizeof *t);
+
+    url = octstr_format("%s%ssource=%E&destination=%E&msgid=%ld&week=W33&year=2016&report_type=bench",
+            queue_url, strchr(queue_url, '?') ? "&" : "?",
+            octstr_imm(source), octstr_imm(destination), seq + 1);
+    if (auth == AUTH_CGI) {
+        char *p = strchr(credentials, ':');
+        Octstr *u = octstr_create_from_data(credentials, p ? p - credentials : (long)strlen(credentials));
+
+        octstr_format_append(url, "&username=%E&password=%E", u, octstr_imm(p ? p + 1 : ""));
+        octstr_destroy(u);
+    } else if (auth == AUTH_BASIC) {
+        Octstr *b = octstr_create(credentials), *hv;
+
+        octstr_binary_to_base64(b);
+        octstr_strip_crlfs(b);
+        hv = octstr_format("Basic %S", b);
+        http_header_add(h, "Authorization", octstr_get_cstr(hv));
+        octstr_destroy(hv);
+        octstr_destroy(b);
+    }
+    http_header_add(h, "Content-Type", is_json ? "application/json" : "text/xml");
+
+    t->started = now();
+    http_start_request(caller, HTTP_METHOD_POST, url, h, body, 0, t, NULL);
+
+    octstr_destroy(url);
+    octstr_destroy(body);
+    http_destroy_headers(h);
+}
+
+static int64_t max_request_id(PGconn *c)
+{
+    PGresult *r = PQexec(c, "SELECT COALESCE(max(id), 0) FROM requests");
+    int64_t id = 0;
+
+    if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0)
+        id = strtoll(PQgetvalue(r, 0, 0), NULL, 10);
+    PQclear(r);
+    return id;
+}
+
+/* Wait until everything we queued has left 'ready'/'pending', then report delivery figures */
+static void report_delivery(PGconn *c, int64_t first_id)
+{
+    char buf[32];
+    const char *pvals[] = {buf};
+    double started = now();
+    long pending = -1;
+    PGresult *r;
+
+    sprintf(buf, "%lld", (long long)first_id);
+    while (now() - started < drain_timeout) {
+        r = PQexecParams(c, "SELECT count(*) FROM requests WHERE id > $1 "
+                "AND status IN ('ready', 'pending', 'inprogress')", 1, NULL, pvals, NULL, NULL, 0);
+        pending = PQresultStatus(r) == PGRES_TUPLES_OK ? atol(PQgetvalue(r, 0, 0)) : -1;
+        PQclear(r);
+        if (pending <= 0)
+            break;
+        gwthread_sleep(1.0);
+    }
+    if (pending != 0)
+        fprintf(stdout, "delivery: %ld requests still undelivered after %.0fs\n", pending, drain_timeout);
+
+    r = PQexecParams(c, "SELECT count(*), "
+            "sum(CASE WHEN status = 'completed' THEN 1 ELSE 0 END), "
+            "extract(epoch FROM max(updated) - min(created)), "
+            "percentile_cont(ARRAY[0.5, 0.99, 0.999]) WITHIN GROUP "
+            "(ORDER BY extract(epoch FROM updated - created)) "
+            "FROM requests WHERE id > $1 AND status NOT IN ('ready', 'pending', 'inprogress')",
+            1, NULL, pvals, NULL, NULL, 0);
+    if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) < 1) {
+        fprintf(stderr, "delivery: query failed: %s", PQresultErrorMessage(r));
+    } else {
+        long n = atol(PQgetvalue(r, 0, 0)), ok = atol(PQgetvalue(r, 0, 1));
+        double span = atof(PQgetvalue(r, 0, 2));
+        double p50 = 0, p99 = 0, p999 = 0;
+
+        sscanf(PQgetvalue(r, 0, 3), "{%lf,%lf,%lf}", &p50, &p99, &p999);
+        fprintf(stdout, "delivery: %ld delivered (%ld completed) in %.2fs = %.1f req/s\n",
+                n, ok, span, span > 0 ? n / span : 0);
+        fprintf(stdout, "delivery latency (queue to delivery): p50=%.1fms p99=%.1fms p999=%.1fms\n",
+                p50 * 1000, p99 * 1000, p999 * 1000);
+    }
+    PQclear(r);
+}
+
+int main(int argc, char *argv[])
+{
+    HTTPCaller *caller;
+    PGconn *c = NULL;
+    int64_t first_id = 0;
+    double *lat, t0, elapsed;
+    long sent = 0, done = 0, ok = 0, failed = 0;
+    int ch;
+
+    gwlib_init();
+
+    while ((ch = getopt(argc, argv, "u:n:c:J:s:x:j:a:U:f:t:D:w:h")) != -1) {
+        switch (ch) {
+            case 'u':
+                queue_url = optarg;
+                break;
+            case 'n':
+                total = atol(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'J':
+                json_percent = atoi(optarg);
+                break;
+            case 's': {
+                char *p = optarg;
+
+                for (num_sizes = 0; num_sizes < MAX_SIZES && p && *p; num_sizes++) {
+                    sizes[num_sizes] = atoi(p);
+                    p = strchr(p, ',');
+                    p = p ? p + 1 : NULL;
+                }
+                break;
+            }
+            case 'x':
+                if ((xml_file = octstr_read_file(optarg)) == NULL)
+                    panic(0, "Failed to read %s", optarg);
+                break;
+            case 'j':
+                if ((json_file = octstr_read_file(optarg)) == NULL)
+                    panic(0, "Failed to read %s", optarg);
+                break;
+            case 'a':
+                if (strcasecmp(optarg, "basic") == 0)
+                    auth = AUTH_BASIC;
+                else if (strcasecmp(optarg, "cgi") == 0)
+                    auth = AUTH_CGI;
+                else if (strcasecmp(optarg, "none") == 0)
+                    auth = AUTH_NONE;
+                else
+                    usage();
+                break;
+            case 'U':
+                credentials = optarg;
+                break;
+            case 'f':
+                source = optarg;
+                break;
+            case 't':
+                destination = optarg;
+                break;
+            case 'D':
+                db_conninfo = optarg;
+                break;
+            case 'w':
+                drain_timeout = atof(optarg);
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (total <= 0 || concurrency <= 0 || num_sizes <= 0)
+        usage();
+    log_set_output_level(GW_WARNING);
+
+    if (db_conninfo) {
+        c = PQconnectdb(db_conninfo);
+        if (PQstatus(c) != CONNECTION_OK)
+            panic(0, "d2loadgen: failed to connect to database: %s", PQerrorMessage(c));
+        first_id = max_request_id(c);
+    }
+
+    lat = gw_malloc(total * sizeof lat[0]);
+    caller = http_caller_create();
+
+    t0 = now();
+    while (sent < total && sent < concurrency)
+        start_one(caller, sent++);
+
+    while (done < total) {
+        int status = -1;
+        Octstr *final_url = NULL, *rbody = NULL;
+        List *rh = NULL;
+        inflight_t *t = http_receive_result(caller, &status, &final_url, &rh, &rbody);
+
+        if (t == NULL)
+            break;
+        lat[done++] = now() - t->started;
+        if (status == HTTP_ACCEPTED || status == HTTP_OK)
+            ok++;
+        else
+            failed++;
+        gw_free(t);
+        octstr_destroy(final_url);
+        octstr_destroy(rbody);
+        http_destroy_headers(rh);
+
+        if (sent < total)
+            start_one(caller, sent++);
+    }
+    elapsed = now() - t0;
+
+    qsort(lat, done, sizeof lat[0], cmp_double);
+    fprintf(stdout, "ingest: %ld requests (%ld accepted, %ld failed) in %.2fs = %.1f req/s, concurrency %d\n",
+            done, ok, failed, elapsed, elapsed > 0 ? done / elapsed : 0, concurrency);
+    fprintf(stdout, "ingest latency: p50=%.1fms p99=%.1fms p999=%.1fms max=%.1fms\n",
+            percentile(lat, done, 0.5) * 1000, percentile(lat, done, 0.99) * 1000,
+            percentile(lat, done, 0.999) * 1000, done > 0 ? lat[done - 1] * 1000 : 0);
+
+    if (c) {
+        report_delivery(c, first_id);
+        PQfinish(c);
+    }
+
+    http_caller_destroy(caller);
+    gw_free(lat);
+    octstr_destroy(xml_file);
+    octstr_destroy(json_file);
+    gwlib_shutdown();
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,379 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  d2mockserver.c
+ *
+ *    Description:  Mock DHIS2 /api/dataValueSets endpoint for throughput benchmarks.
+ *                  Replies after a configurable latency and fails a configurable
+ *                  fraction of requests either at HTTP level (5xx) or in the import
+ *                  summary (status ERROR). With async=true the import is answered
+ *                  straight away with a task, whose summary is ready once the latency
+ *                  has passed, as DHIS2 does for asynchronous imports.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 09:12:40
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <stdio.h>
+#include <signal.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "gwlib/gwlib.h"
+
+#define MOCK_PATH "/api/dataValueSets"
+#define TASK_PATHS "/api/system/task"
+#define TASKS_PATH "/api/system/tasks/DATAVALUE_IMPORT/"
+#define SUMMARIES_PATH "/api/system/taskSummaries/DATAVALUE_IMPORT/"
+
+#define XML_SUCCESS "<?xml version='1.0' encoding='UTF-8'?><importSummary " \
+    "xmlns=\"http://dhis2.org/schema/dxf/2.0\" responseType=\"ImportSummary\">" \
+    "<status>SUCCESS</status><description>Import process completed successfully</description>" \
+    "<importCount imported=\"5\" updated=\"0\" ignored=\"0\" deleted=\"0\"/></importSummary>"
+#define XML_ERROR "<?xml version='1.0' encoding='UTF-8'?><importSummary " \
+    "xmlns=\"http://dhis2.org/schema/dxf/2.0\" responseType=\"ImportSummary\">" \
+    "<status>ERROR</status><description>Mock import failure</description>" \
+    "<importCount imported=\"0\" updated=\"0\" ignored=\"5\" deleted=\"0\"/></importSummary>"
+#define JSON_SUCCESS "{\"responseType\":\"ImportSummary\",\"status\":\"SUCCESS\"," \
+    "\"description\":\"Import process completed successfully\"," \
+    "\"importCount\":{\"imported\":5,\"updated\":0,\"ignored\":0,\"deleted\":0}}"
+#define JSON_ERROR "{\"responseType\":\"ImportSummary\",\"status\":\"ERROR\"," \
+    "\"description\":\"Mock import failure\"," \
+    "\"importCount\":{\"imported\":0,\"updated\":0,\"ignored\":5,\"deleted\":0}}"
+
+#define XML_TASK "<?xml version='1.0' encoding='UTF-8'?><webMessage " \
+    "xmlns=\"http://dhis2.org/schema/dxf/2.0\"><status>OK</status>" \
+    "<message>Initiated dataValueImport</message><response id=\"%ld\" " \
+    "jobType=\"DATAVALUE_IMPORT\" relativeNotifierEndpoint=\"" TASKS_PATH "%ld\"/></webMessage>"
+#define JSON_TASK "{\"status\":\"OK\",\"message\":\"Initiated dataValueImport\"," \
+    "\"response\":{\"id\":\"%ld\",\"jobType\":\"DATAVALUE_IMPORT\"," \
+    "\"relativeNotifierEndpoint\":\"" TASKS_PATH "%ld\"}}"
+#define JSON_NOTIFICATION "[{\"level\":\"INFO\",\"category\":\"DATAVALUE_IMPORT\"," \
+    "\"message\":\"%s\",\"completed\":%s}]"
+
+enum latency_kind { LAT_FIXED, LAT_UNIFORM, LAT_EXP, LAT_NORMAL };
+
+static struct {
+    enum latency_kind kind;
+    double a, b; /* milliseconds; meaning depends on kind */
+} latency = {LAT_FIXED, 0, 0};
+
+static int port = 8080;
+static int use_ssl = 0;
+static int num_threads = 16;
+static double http_error_rate = 0.0;   /* fraction answered with 500 */
+static double import_error_rate = 0.0; /* fraction answered with status ERROR */
+static Octstr *xml_success = NULL;
+
+static volatile sig_atomic_t stop = 0;
+static List *client_list;
+static Counter *served, *http_errors, *import_errors, *task_ids;
+static Dict *tasks; /* id -> struct task, until its summary is fetched */
+
+struct task {
+    double done; /* when the import finishes */
+    int fail;
+};
+
+typedef struct {
+    HTTPClient *client;
+    Octstr *url;
+    Octstr *ip;
+    Octstr *body;
+    List *headers;
+    List *cgivars;
+} mock_request_t;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: d2mockserver [-p port] [-t threads] [-l latency] [-e http-error-rate]\n"
+            "                    [-i import-error-rate] [-r response.xml] [-S]\n"
+            "  latency is one of fixed:MS, uniform:MIN:MAX, exp:MEAN or normal:MEAN:SD (milliseconds)\n");
+    exit(EXIT_FAILURE);
+}
+
+static int parse_latency(char *spec)
+{
+    char kind[16];
+    double a = 0, b = 0;
+    int n = sscanf(spec, "%15[^:]:%lf:%lf", kind, &a, &b);
+
+    if (n < 2)
+        return -1;
+    if (strcasecmp(kind, "fixed") == 0)
+        latency.kind = LAT_FIXED;
+    else if (strcasecmp(kind, "uniform") == 0 && n == 3)
+        latency.kind = LAT_UNIFORM;
+    else if (strcasecmp(kind, "exp") == 0)
+        latency.kind = LAT_EXP;
+    else if (strcasecmp(kind, "normal") == 0 && n == 3)
+        latency.kind = LAT_NORMAL;
+    else
+        return -1;
+    latency.a = a;
+    latency.b = b;
+    return 0;
+}
+
+static double uniform01(unsigned int *seed)
+{
+    return (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+}
+
+/* Returns a latency sample in seconds */
+static double sample_latency(unsigned int *seed)
+{
+    double ms;
+
+    switch (latency.kind) {
+        case LAT_UNIFORM:
+            ms = latency.a + (latency.b - latency.a) * uniform01(seed);
+            break;
+        case LAT_EXP:
+            ms = -latency.a * log(uniform01(seed));
+            break;
+        case LAT_NORMAL: /* Box-Muller */
+            ms = latency.a + latency.b *
+                sqrt(-2.0 * log(uniform01(seed))) * cos(2 * M_PI * uniform01(seed));
+            break;
+        case LAT_FIXED:
+        default:
+            ms = latency.a;
+            break;
+    }
+    return ms > 0 ? ms / 1000.0 : 0;
+}
+
+static void task_free(void *t)
+{
+    gw_free(t);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The polls of async imports; always answered in JSON */
+static void task_reply(mock_request_t *m, List *rh)
+{
+    int summary = octstr_search(m->url, octstr_imm(SUMMARIES_PATH), 0) == 0;
+    Octstr *id = octstr_copy(m->url, strlen(summary ? SUMMARIES_PATH : TASKS_PATH), octstr_len(m->url));
+    struct task *t = dict_get(tasks, id);
+    int done = t != NULL && now() >= t->done;
+    Octstr *rbody;
+
+    http_header_add(rh, "Content-Type", "application/json");
+    if (!summary) {
+        rbody = t == NULL ? octstr_create("[]") : octstr_format(JSON_NOTIFICATION,
+                done ? "Import done" : "Importing data values", done ? "true" : "false");
+        http_send_reply(m->client, HTTP_OK, rh, rbody);
+        octstr_destroy(rbody);
+    } else if (!done)
+        http_send_reply(m->client, HTTP_NOT_FOUND, rh, octstr_imm("{}"));
+    else {
+        http_send_reply(m->client, HTTP_OK, rh, octstr_imm(t->fail ? JSON_ERROR : JSON_SUCCESS));
+        dict_remove(tasks, id);
+    }
+    octstr_destroy(id);
+}
+
+static void free_mock_request(mock_request_t *m)
+{
+    octstr_destroy(m->url);
+    octstr_destroy(m->ip);
+    octstr_destroy(m->body);
+    http_destroy_headers(m->headers);
+    http_destroy_cgiargs(m->cgivars);
+    gw_free(m);
+}
+
+static void mock_worker(void *unused)
+{
+    mock_request_t *m;
+    unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)gwthread_self();
+
+    while ((m = gwlist_consume(client_list)) != NULL) {
+        List *rh = http_create_empty_headers();
+        Octstr *rbody, *ctype = http_header_value(m->headers, octstr_imm("Content-Type"));
+        int is_json = ctype && octstr_case_search(ctype, octstr_imm("json"), 0) >= 0;
+        Octstr *async = http_cgi_variable(m->cgivars, "async");
+        int is_async = async != NULL && octstr_str_compare(async, "true") == 0;
+        int is_poll = octstr_search(m->url, octstr_imm(TASK_PATHS), 0) == 0;
+        double delay = sample_latency(&seed);
+
+        if (delay > 0 && !is_async && !is_poll)
+            gwthread_sleep(delay);
+
+        if (is_poll)
+            task_reply(m, rh);
+        else if (octstr_str_compare(m->url, MOCK_PATH) != 0) {
+            http_header_add(rh, "Content-Type", "text/plain");
+            http_send_reply(m->client, HTTP_NOT_FOUND, rh, octstr_imm("Not Found"));
+        } else if (uniform01(&seed) < http_error_rate) {
+            counter_increase(http_errors);
+            http_header_add(rh, "Content-Type", "text/plain");
+            http_send_reply(m->client, HTTP_INTERNAL_SERVER_ERROR, rh, octstr_imm("Mock server error"));
+        } else {
+            int fail = uniform01(&seed) < import_error_rate;
+
+            if (fail)
+                counter_increase(import_errors);
+            if (is_async) {
+                /* the import runs on without us: answer now, with the task to poll */
+                struct task *t = gw_malloc(sizeof *t);
+                long id = (long)counter_increase(task_ids) + 1;
+                Octstr *xid = octstr_format("%ld", id);
+
+                t->done = now() + delay;
+                t->fail = fail;
+                dict_put(tasks, xid, t);
+                octstr_destroy(xid);
+                http_header_add(rh, "Content-Type", is_json ? "application/json" : "application/xml");
+                rbody = octstr_format(is_json ? JSON_TASK : XML_TASK, id, id);
+            } else if (is_json) {
+                http_header_add(rh, "Content-Type", "application/json");
+                rbody = octstr_create(fail ? JSON_ERROR : JSON_SUCCESS);
+            } else {
+                http_header_add(rh, "Content-Type", "application/xml");
+                rbody = fail ? octstr_create(XML_ERROR) : octstr_duplicate(xml_success);
+            }
+            http_send_reply(m->client, HTTP_OK, rh, rbody);
+            octstr_destroy(rbody);
+        }
+        counter_increase(served);
+
+        octstr_destroy(ctype);
+        http_destroy_headers(rh);
+        free_mock_request(m);
+    }
+}
+
+static void report_stats(void *unused)
+{
+    unsigned long last = 0;
+
+    while (!stop) {
+        unsigned long n;
+
+        gwthread_sleep(5.0);
+        n = counter_value(served);
+        fprintf(stdout, "served=%lu (%.1f/s) http_errors=%lu import_errors=%lu queued=%ld\n",
+                n, (n - last) / 5.0, counter_value(http_errors), counter_value(import_errors),
+                gwlist_len(client_list));
+        fflush(stdout);
+        last = n;
+    }
+}
+
+static void quit_now(int unused)
+{
+    stop = 1;
+    http_close_port(port);
+}
+
+int main(int argc, char *argv[])
+{
+    HTTPClient *client;
+    Octstr *ip, *url, *body;
+    List *headers, *cgivars;
+    long stats_th;
+    int c, i;
+
+    gwlib_init();
+
+    while ((c = getopt(argc, argv, "p:t:l:e:i:r:Sh")) != -1) {
+        switch (c) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'l':
+                if (parse_latency(optarg) < 0)
+                    usage();
+                break;
+            case 'e':
+                http_error_rate = atof(optarg);
+                break;
+            case 'i':
+                import_error_rate = atof(optarg);
+                break;
+            case 'r':
+                if ((xml_success = octstr_read_file(optarg)) == NULL)
+                    panic(0, "Failed to read response file %s", optarg);
+                break;
+            case 'S':
+                use_ssl = 1;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (xml_success == NULL)
+        xml_success = octstr_create(XML_SUCCESS);
+    if (num_threads < 1)
+        num_threads = 1;
+
+    log_set_output_level(GW_WARNING);
+    if (http_open_port(port, use_ssl) < 0)
+        panic(0, "d2mockserver: failed to open port %d", port);
+
+    signal(SIGTERM, quit_now);
+    signal(SIGINT, quit_now);
+    signal(SIGPIPE, SIG_IGN);
+
+    served = counter_create();
+    http_errors = counter_create();
+    import_errors = counter_create();
+    task_ids = counter_create();
+    tasks = dict_create(1024, task_free);
+    client_list = gwlist_create();
+    gwlist_add_producer(client_list);
+    for (i = 0; i < num_threads; i++)
+        gwthread_create(mock_worker, NULL);
+    stats_th = gwthread_create(report_stats, NULL);
+
+    fprintf(stdout, "d2mockserver listening on port %d with %d threads\n", port, num_threads);
+    fflush(stdout);
+    while (!stop &&
+            (client = http_accept_request(port, &ip, &url, &headers, &body, &cgivars)) != NULL) {
+        mock_request_t *m = gw_malloc(sizeof *m);
+
+        m->client = client;
+        m->ip = ip;
+        m->url = url;
+        m->body = body;
+        m->headers = headers;
+        m->cgivars = cgivars;
+        gwlist_produce(client_list, m);
+    }
+
+    gwlist_remove_producer(client_list);
+    gwthread_join_every(mock_worker);
+    gwthread_wakeup(stats_th);
+    gwthread_join(stats_th);
+
+    fprintf(stdout, "served=%lu http_errors=%lu import_errors=%lu\n", counter_value(served),
+            counter_value(http_errors), counter_value(import_errors));
+    gwlist_destroy(client_list, NULL);
+    counter_destroy(served);
+    counter_destroy(http_errors);
+    counter_destroy(import_errors);
+    counter_destroy(task_ids);
+    dict_destroy(tasks);
+    octstr_destroy(xml_success);
+    gwlib_shutdown();
+    return 0;
+}
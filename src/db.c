@@ -0,0 +1,294 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  db.c
+ *
+ *    Description:  Database calls on the hot paths. Every hot statement is in the
+ *                  registry below, prepared on each connection when it is made and
+ *                  run by handle, with executions and latency on /stats per statement.
+ *                  A statement and the BEGIN or COMMIT around it go out together in
+ *                  libpq pipeline mode, so the pair costs one round trip instead of
+ *                  two. Each thread counts its round trips so callers can report them
+ *                  per request.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 20:21:37
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <libpq-fe.h>
+
+#include "dispatcher2-config.h"
+#include "db.h"
+#include "stats.h"
+
+#define INSERT_REQUEST "INSERT INTO requests(source, destination, body, ctype, submissionid, week," \
+    "month, year, msisdn, raw_msg, facility, district, report_type, status, body_is_query_param, " \
+    "priority, deadline) "
+#define UPDATE_REQUEST "UPDATE requests SET updated = timeofday()::timestamp, "
+/* For destinations with servers.supersede, a new version of a report cancels the older
+ * ones not yet sent, in the same statement as the insert. Rows being delivered are
+ * locked and skipped: they are sent either way. */
+#define SUPERSEDE_OLDER "), old AS (SELECT o.id, new.id AS newer FROM new " \
+    "JOIN servers s ON s.id = new.destination AND s.supersede " \
+    "JOIN requests o ON o.destination = new.destination AND o.facility = new.facility " \
+    "AND o.report_type = new.report_type AND o.week = new.week AND o.month = new.month " \
+    "AND o.year IS NOT DISTINCT FROM new.year AND o.status IN ('ready', 'pending') AND o.id < new.id " \
+    "WHERE new.facility <> '' AND new.report_type <> '' FOR UPDATE OF o SKIP LOCKED), " \
+    "superseded AS (" UPDATE_REQUEST "status = 'canceled', statuscode = 'SUPERSEDED', " \
+    "errors = 'Superseded by request ' || old.newer FROM old WHERE requests.id = old.id RETURNING 1) " \
+    "SELECT id, (SELECT count(*) FROM superseded) FROM new"
+/* The value of a request's partition key, see partition_columns in request_processor.c */
+#define PARTITION_VALUE "CASE s.partition_key " \
+    "WHEN 'facility' THEN r.facility WHEN 'district' THEN r.district " \
+    "WHEN 'msisdn' THEN r.msisdn WHEN 'report_type' THEN r.report_type " \
+    "WHEN 'source' THEN r.source::text WHEN 'submissionid' THEN r.submissionid::text " \
+    "ELSE '' END"
+/* Ready requests (those matching cond) with their priority, when they are due, the
+ * deadline and the value of their destination's partition key, most urgent and earliest
+ * due first. Due is the deadline, else created. Of the rows sharing a key value only the
+ * oldest is returned, the rest stay here until it is done, and it is as urgent and due
+ * as early as the most urgent of them: the order within a key holds whatever the
+ * priorities, and an urgent row hurries the ones it has to wait for. Keys are grouped by
+ * hashing, so a backlog is read but never sorted. A key with an async import still
+ * running (inprogress) has to wait for its outcome */
+#define FETCH_READY(cond) "SELECT id, destination, priority, extract(epoch FROM due), " \
+    "extract(epoch FROM deadline), pkey FROM (" \
+    "SELECT r.id, r.destination, r.priority, COALESCE(r.deadline, r.created) AS due, r.deadline, " \
+    "'' AS pkey FROM requests r JOIN servers s ON s.id = r.destination " \
+    "WHERE r.status = 'ready' AND s.partition_key = '' " cond \
+    " UNION ALL " \
+    "SELECT h.id, h.destination, k.priority, k.due, h.deadline, k.pkey FROM (" \
+    "SELECT min(id) AS id, min(priority) AS priority, min(due) AS due, pkey FROM (" \
+    "SELECT r.id, r.destination, r.priority, COALESCE(r.deadline, r.created) AS due, r.status, " \
+    "COALESCE(" PARTITION_VALUE ", '') AS pkey FROM requests r JOIN servers s ON s.id = r.destination " \
+    "WHERE r.status IN ('ready', 'inprogress') AND s.partition_key <> '' " cond ") keyed " \
+    "GROUP BY destination, pkey, CASE WHEN pkey = '' THEN id END " \
+    "HAVING bool_and(status = 'ready')) k " \
+    "JOIN requests h ON h.id = k.id" \
+    ") ready ORDER BY priority ASC, due ASC, id ASC "
+/* Async imports whose task is due to be polled, with how long they have been running */
+#define FETCH_IMPORTS "SELECT id, destination, import_task, " \
+    "extract(epoch FROM current_timestamp - import_started) FROM requests " \
+    "WHERE status = 'inprogress' AND import_task <> '' AND import_poll_at <= current_timestamp "
+
+static struct {
+    char *name;
+    int nparams;
+    char *sql;
+} stmts[DB_NUM_STMTS] = {
+    [DB_AUTH_USER] = {"auth_user", 2,
+        "SELECT id FROM users WHERE username = $1 AND crypt($2, password) = password"},
+    [DB_GET_SERVER] = {"get_server", 1, "SELECT id FROM servers WHERE name = $1"},
+    [DB_SAVE_REQUEST] = {"save_request", 17, INSERT_REQUEST
+        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, "
+        "to_timestamp($17::double precision)) RETURNING id"},
+    [DB_SAVE_REQUEST_NAMED] = {"save_request_named", 17, "WITH new AS (" INSERT_REQUEST
+        "VALUES ((SELECT id FROM servers WHERE name = $1), (SELECT id FROM servers WHERE name = $2), "
+        "$3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, "
+        "to_timestamp($17::double precision)) "
+        "RETURNING id, destination, facility, week, month, year, report_type" SUPERSEDE_OLDER},
+    [DB_FIND_SUBMISSION] = {"find_submission", 2,
+        "SELECT id FROM requests WHERE source = (SELECT id FROM servers WHERE name = $1) "
+        "AND submissionid = $2 AND submissionid > 0 ORDER BY id LIMIT 1"},
+    [DB_USER_LIMITS] = {"user_limits", 1,
+        "SELECT max_rate, daily_quota, transaction_limit FROM users WHERE username = $1"},
+    /* Skips the destinations that already have their fill waiting for delivery ($1) */
+    [DB_FETCH_READY] = {"fetch_ready", 2,
+        FETCH_READY("AND r.destination <> ALL($1::INTEGER[]) AND is_allowed_source(r.source, r.destination)")
+        "LIMIT $2"},
+    /* In cluster mode we only claim for the destinations this node owns ($1) */
+    [DB_FETCH_READY_CLUSTER] = {"fetch_ready_cluster", 3,
+        FETCH_READY("AND r.destination = ANY($1::INTEGER[]) AND r.destination <> ALL($2::INTEGER[]) "
+        "AND is_allowed_source(r.source, r.destination)") "LIMIT $3"},
+    /* NOWAIT forces failure if the record is locked. Re-checking the status under the
+     * row lock means a request queued twice (or by two nodes) is only ever sent once. */
+    [DB_CLAIM_REQUEST] = {"claim_request", 1,
+        "SELECT source, destination, body, retries, in_submission_period(destination), ctype, "
+        "body_is_query_param FROM requests WHERE id = $1 AND status = 'ready' FOR UPDATE NOWAIT"},
+    [DB_REQUEST_EXPIRED] = {"request_expired", 1, UPDATE_REQUEST
+        "status = 'expired' WHERE id = $1"},
+    [DB_REQUEST_EMPTY] = {"request_empty", 1, UPDATE_REQUEST
+        "statuscode='ERROR1', errors = 'Empty response from server', status = 'failed' WHERE id = $1"},
+    [DB_REQUEST_UNREACHABLE] = {"request_unreachable", 1, UPDATE_REQUEST
+        "statuscode = 'ERROR2', errors = 'Server possibly unreachable!', status = 'failed' WHERE id = $1"},
+    [DB_REQUEST_SENT] = {"request_sent", 1, UPDATE_REQUEST
+        "statuscode = 'SUCCESS', status = 'completed' WHERE id = $1"},
+    [DB_REQUEST_BAD_XML] = {"request_bad_xml", 1, UPDATE_REQUEST
+        "statuscode = 'ERROR3', errors = 'Response possibly not proper XML', status = 'failed' WHERE id = $1"},
+    [DB_REQUEST_BAD_JSON] = {"request_bad_json", 1, UPDATE_REQUEST
+        "statuscode = 'ERROR4', errors = 'Response was not proper JSON', status = 'failed' WHERE id = $1"},
+    [DB_REQUEST_NO_STATUS] = {"request_no_status", 1, UPDATE_REQUEST
+        "statuscode = 'ERROR5', errors= 'Could not pick status from JSON response',"
+        "status = 'failed' WHERE id = $1"},
+    [DB_REQUEST_NO_DESCRIPTION] = {"request_no_description", 1, UPDATE_REQUEST
+        "statuscode = 'ERROR6', errors = 'No description field in JSON response',"
+        "status = 'failed' WHERE id = $1"},
+    [DB_REQUEST_FAILED] = {"request_failed", 3, UPDATE_REQUEST
+        "statuscode=$2, status = 'failed', errors = $3 WHERE id = $1"},
+    [DB_REQUEST_COMPLETED] = {"request_completed", 3, UPDATE_REQUEST
+        "statuscode=$2, status = 'completed', errors = $3 WHERE id = $1"},
+    /* Async imports stay inprogress until their task has a summary */
+    [DB_REQUEST_IMPORTING] = {"request_importing", 3, UPDATE_REQUEST
+        "statuscode = 'IMPORTING', status = 'inprogress', import_task = $2, "
+        "import_started = current_timestamp, "
+        "import_poll_at = current_timestamp + $3::double precision * interval '1 second' WHERE id = $1"},
+    [DB_FETCH_IMPORTS] = {"fetch_imports", 1, FETCH_IMPORTS
+        "ORDER BY import_poll_at LIMIT $1"},
+    [DB_FETCH_IMPORTS_CLUSTER] = {"fetch_imports_cluster", 2, FETCH_IMPORTS
+        "AND destination = ANY($1::INTEGER[]) ORDER BY import_poll_at LIMIT $2"},
+    [DB_IMPORT_POLLED] = {"import_polled", 2, "UPDATE requests SET "
+        "import_poll_at = current_timestamp + $2::double precision * interval '1 second' "
+        "WHERE id = $1 AND status = 'inprogress'"},
+    [DB_IMPORT_TIMEOUT] = {"import_timeout", 1, UPDATE_REQUEST
+        "statuscode = 'ERROR7', errors = 'Import task did not finish in time', status = 'failed' "
+        "WHERE id = $1"},
+};
+
+static stat_t *st_stmt[DB_NUM_STMTS];
+
+static __thread int roundtrips;
+
+void db_roundtrips_reset(void)
+{
+    roundtrips = 0;
+}
+
+int db_roundtrips(void)
+{
+    return roundtrips;
+}
+
+void db_init(void)
+{
+    char name[64];
+    int i;
+
+    for (i = 0; i < DB_NUM_STMTS; i++) {
+        sprintf(name, "sql.%s", stmts[i].name);
+        st_stmt[i] = stats_timer(name);
+    }
+}
+
+int db_prepare_all(PGconn *c)
+{
+    PGresult *r;
+    int i, ret = 0;
+
+    if (PQstatus(c) != CONNECTION_OK)
+        return -1;
+    for (i = 0; i < DB_NUM_STMTS; i++) {
+        r = PQprepare(c, stmts[i].name, stmts[i].sql, stmts[i].nparams, NULL);
+        if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+            error(0, "db: failed to prepare %s: %s", stmts[i].name, PQresultErrorMessage(r));
+            ret = -1;
+        }
+        PQclear(r);
+    }
+    return ret;
+}
+
+static void record(enum db_stmt s, double t0)
+{
+    if (st_stmt[s])
+        stats_time(st_stmt[s], stats_now() - t0);
+}
+
+static int missing_stmt(PGresult *r)
+{
+    char *state = PQresultErrorField(r, PG_DIAG_SQLSTATE);
+
+    return state && strcmp(state, "26000") == 0; /* invalid_sql_statement_name */
+}
+
+PGresult *db_run(PGconn *c, enum db_stmt s, const char *const *pvals,
+        const int *plens, const int *pfrmt)
+{
+    double t0 = stats_now();
+    PGresult *r;
+
+    roundtrips++;
+    r = PQexecPrepared(c, stmts[s].name, stmts[s].nparams, pvals, plens, pfrmt, 0);
+    if (missing_stmt(r) && PQtransactionStatus(c) == PQTRANS_IDLE) {
+        /* e.g. the connection was reset behind our back */
+        PQclear(r);
+        db_prepare_all(c);
+        roundtrips++;
+        r = PQexecPrepared(c, stmts[s].name, stmts[s].nparams, pvals, plens, pfrmt, 0);
+    }
+    record(s, t0);
+    return r;
+}
+
+/* Send BEGIN before s (commit = 0) or COMMIT after it (commit = 1); returns s's result */
+static PGresult *run_pair(PGconn *c, enum db_stmt s, const char *const *pvals, int commit)
+{
+    double t0 = stats_now();
+    PGresult *r, *ret = NULL;
+    int keep = commit ? 0 : 1; /* position of s */
+#ifdef HAVE_PQENTERPIPELINEMODE
+    int i;
+
+    if (PQenterPipelineMode(c) == 1) {
+        roundtrips++;
+        if (!commit)
+            PQsendQueryParams(c, "BEGIN", 0, NULL, NULL, NULL, NULL, 0);
+        PQsendQueryPrepared(c, stmts[s].name, stmts[s].nparams, pvals, NULL, NULL, 0);
+        if (commit)
+            PQsendQueryParams(c, "COMMIT", 0, NULL, NULL, NULL, NULL, 0);
+        PQpipelineSync(c);
+        /* each statement's results end with a NULL, then comes the sync */
+        for (i = 0; i < 2; i++)
+            while ((r = PQgetResult(c)) != NULL) {
+                if (i == keep && ret == NULL)
+                    ret = r;
+                else
+                    PQclear(r);
+            }
+        while ((r = PQgetResult(c)) != NULL) {
+            int sync = PQresultStatus(r) == PGRES_PIPELINE_SYNC;
+
+            PQclear(r);
+            if (sync)
+                break;
+        }
+        PQexitPipelineMode(c);
+        record(s, t0);
+        return ret;
+    }
+#endif
+    roundtrips += 2;
+    if (!commit)
+        PQclear(PQexec(c, "BEGIN"));
+    ret = PQexecPrepared(c, stmts[s].name, stmts[s].nparams, pvals, NULL, NULL, 0);
+    if (commit)
+        PQclear(PQexec(c, "COMMIT"));
+    record(s, t0);
+    return ret;
+}
+
+PGresult *db_begin_run(PGconn *c, enum db_stmt s, const char *const *pvals)
+{
+    return run_pair(c, s, pvals, 0);
+}
+
+PGresult *db_run_commit(PGconn *c, enum db_stmt s, const char *const *pvals)
+{
+    return run_pair(c, s, pvals, 1);
+}
+
+void db_end(PGconn *c)
+{
+    PGTransactionStatusType ts = PQtransactionStatus(c);
+
+    if (ts == PQTRANS_INTRANS || ts == PQTRANS_INERROR) {
+        roundtrips++;
+        PQclear(PQexec(c, ts == PQTRANS_INTRANS ? "COMMIT" : "ROLLBACK"));
+    }
+}
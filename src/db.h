@@ -0,0 +1,77 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  db.h
+ *
+ *    Description:  Database calls on the hot paths: prepared statement registry and
+ *                  round trip accounting
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 20:14:52
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_DB_H
+#define __DISPATCHER2_DB_H
+
+#include <libpq-fe.h>
+
+/* Handles for the registered statements; the SQL is in db.c */
+enum db_stmt {
+    DB_AUTH_USER,           /* username, password */
+    DB_GET_SERVER,          /* name */
+    DB_SAVE_REQUEST,        /* request_to_params() */
+    DB_SAVE_REQUEST_NAMED,  /* request_to_params() with server names for $1, $2; id, superseded */
+    DB_FIND_SUBMISSION,     /* source name, submissionid */
+    DB_USER_LIMITS,         /* username */
+    DB_FETCH_READY,         /* limit */
+    DB_FETCH_READY_CLUSTER, /* owned servers, limit */
+    DB_CLAIM_REQUEST,       /* id */
+    DB_REQUEST_EXPIRED,     /* id */
+    DB_REQUEST_EMPTY,       /* id */
+    DB_REQUEST_UNREACHABLE, /* id */
+    DB_REQUEST_SENT,        /* id */
+    DB_REQUEST_BAD_XML,     /* id */
+    DB_REQUEST_BAD_JSON,    /* id */
+    DB_REQUEST_NO_STATUS,   /* id */
+    DB_REQUEST_NO_DESCRIPTION, /* id */
+    DB_REQUEST_FAILED,      /* id, statuscode, errors */
+    DB_REQUEST_COMPLETED,   /* id, statuscode, errors */
+    DB_REQUEST_IMPORTING,   /* id, task endpoint, seconds to the first poll */
+    DB_FETCH_IMPORTS,       /* limit */
+    DB_FETCH_IMPORTS_CLUSTER, /* owned servers, limit */
+    DB_IMPORT_POLLED,       /* id, seconds to the next poll */
+    DB_IMPORT_TIMEOUT,      /* id */
+    DB_NUM_STMTS
+};
+
+/* Register the per-statement stats; call once after stats_init() */
+void db_init(void);
+
+/* Prepare every registered statement on a new (or re-established) connection */
+int db_prepare_all(PGconn *c);
+
+/* Run a registered statement (text results), counted as one round trip. Statements
+ * missing on the connection are prepared again and retried. */
+PGresult *db_run(PGconn *c, enum db_stmt s, const char *const *pvals,
+        const int *plens, const int *pfrmt);
+
+/* BEGIN then s; returns s's result. One round trip where libpq has pipeline mode */
+PGresult *db_begin_run(PGconn *c, enum db_stmt s, const char *const *pvals);
+
+/* s then COMMIT; returns s's result. One round trip where libpq has pipeline mode */
+PGresult *db_run_commit(PGconn *c, enum db_stmt s, const char *const *pvals);
+
+/* End a transaction left open: COMMIT, or ROLLBACK if it failed. Free if there is none */
+void db_end(PGconn *c);
+
+/* Round trips made by the calling thread since the last db_roundtrips_reset() */
+void db_roundtrips_reset(void);
+int db_roundtrips(void);
+
+#endif
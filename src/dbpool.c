@@ -0,0 +1,304 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dbpool.c
+ *
+ *    Description:  Connection pools for the ingest, delivery and maintenance threads.
+ *                  Threads take a connection per unit of work instead of owning one
+ *                  for life, so a connection lost to a database restart is replaced
+ *                  on the next take instead of failing that thread's requests forever.
+ *                  A connection idle for db-health-check-interval is pinged before it
+ *                  is handed out. When the database can't be reached, further connects
+ *                  wait out a doubling backoff and callers get NULL straight away.
+ *                  The time spent waiting for a connection is on /stats per pool.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 22:31:05
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#include "dbpool.h"
+#include "db.h"
+#include "stats.h"
+
+#define MIN_BACKOFF 0.5 /* seconds before retrying a database we could not reach */
+#define MAX_BACKOFF 30
+
+struct idle {
+    PGconn *c;
+    double since;
+};
+
+struct pool {
+    const char *name;
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    struct idle *idle; /* most recently used last */
+    int nidle, cap;
+    int size, open; /* open counts connections idle, in use or being made */
+    double retry_at, backoff;
+    stat_t *st_wait, *st_timeouts, *st_failures, *st_reconnects;
+};
+
+static struct pool pools[DB_NUM_POOLS] = {
+    [DB_POOL_INGEST] = {"ingest"},
+    [DB_POOL_DELIVERY] = {"delivery"},
+    [DB_POOL_MAINTENANCE] = {"maintenance"},
+};
+static dispatcher2conf_t pconf;
+
+static int pool_size(enum db_pool which)
+{
+    switch (which) {
+        case DB_POOL_INGEST:
+            return pconf->db_ingest_pool_size > 0 ? pconf->db_ingest_pool_size : pconf->num_threads;
+        case DB_POOL_DELIVERY: /* the workers and the producer */
+            return pconf->db_delivery_pool_size > 0 ? pconf->db_delivery_pool_size : pconf->num_threads + 1;
+        default:
+            return pconf->db_maintenance_pool_size;
+    }
+}
+
+static long open_len(void *arg)
+{
+    struct pool *p = arg;
+    long n;
+
+    pthread_mutex_lock(&p->lock);
+    n = p->open;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+static long idle_len(void *arg)
+{
+    struct pool *p = arg;
+    long n;
+
+    pthread_mutex_lock(&p->lock);
+    n = p->nidle;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+/* Grow the idle stack to the pool size; called with the lock held */
+static void fit(struct pool *p)
+{
+    if (p->size > p->cap) {
+        p->cap = p->size;
+        p->idle = gw_realloc(p->idle, p->cap * sizeof p->idle[0]);
+    }
+}
+
+void dbpool_init(dispatcher2conf_t config)
+{
+    char name[64];
+    int i;
+
+    pconf = config;
+    for (i = 0; i < DB_NUM_POOLS; i++) {
+        struct pool *p = &pools[i];
+
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->freed, NULL);
+        p->idle = NULL;
+        p->nidle = p->cap = p->open = 0;
+        p->size = pool_size(i);
+        fit(p);
+        p->retry_at = 0;
+        p->backoff = MIN_BACKOFF;
+
+        sprintf(name, "db.%s.wait", p->name);
+        p->st_wait = stats_timer(name);
+        sprintf(name, "db.%s.timeouts", p->name);
+        p->st_timeouts = stats_counter(name);
+        sprintf(name, "db.%s.connect_failures", p->name);
+        p->st_failures = stats_counter(name);
+        sprintf(name, "db.%s.reconnects", p->name);
+        p->st_reconnects = stats_counter(name);
+        sprintf(name, "db.%s.open", p->name);
+        stats_gauge(name, open_len, p);
+        sprintf(name, "db.%s.idle", p->name);
+        stats_gauge(name, idle_len, p);
+    }
+}
+
+void dbpool_shutdown(void)
+{
+    int i;
+
+    for (i = 0; i < DB_NUM_POOLS; i++) {
+        struct pool *p = &pools[i];
+
+        pthread_mutex_lock(&p->lock);
+        while (p->nidle > 0)
+            PQfinish(p->idle[--p->nidle].c);
+        if (p->open > 0)
+            warning(0, "dbpool %s: %d connection(s) not given back", p->name, p->open);
+        gw_free(p->idle);
+        p->idle = NULL;
+        p->cap = p->open = 0;
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void dbpool_resize(void)
+{
+    int i;
+
+    for (i = 0; i < DB_NUM_POOLS; i++) {
+        struct pool *p = &pools[i];
+
+        pthread_mutex_lock(&p->lock);
+        if (p->size != pool_size(i))
+            info(0, "dbpool %s: resizing from %d to %d connections", p->name, p->size, pool_size(i));
+        p->size = pool_size(i);
+        fit(p);
+        while (p->nidle > 0 && p->open > p->size) {
+            PQfinish(p->idle[--p->nidle].c);
+            p->open--;
+        }
+        pthread_mutex_unlock(&p->lock);
+        pthread_cond_broadcast(&p->freed);
+    }
+}
+
+static PGconn *pool_connect(struct pool *p)
+{
+    char port_str[32];
+    PGconn *c;
+
+    sprintf(port_str, "%d", pconf->dbport);
+    c = PQsetdbLogin(pconf->dbhost, pconf->dbport > 0 ? port_str : NULL, NULL, NULL,
+            pconf->dbname, pconf->dbuser, pconf->dbpass);
+    if (PQstatus(c) != CONNECTION_OK) {
+        warning(0, "dbpool %s: failed to connect to database: %s", p->name, PQerrorMessage(c));
+        PQfinish(c);
+        return NULL;
+    }
+    db_prepare_all(c);
+    return c;
+}
+
+/* libpq only notices a dead server when a query fails, so ping what sat idle a while */
+static int healthy(PGconn *c, double since)
+{
+    PGresult *r;
+    int ok;
+
+    if (PQstatus(c) != CONNECTION_OK)
+        return 0;
+    if (stats_now() - since < pconf->db_health_check_interval)
+        return 1;
+    r = PQexec(c, "SELECT 1");
+    ok = PQresultStatus(r) == PGRES_TUPLES_OK;
+    PQclear(r);
+    return ok;
+}
+
+/* Wait for a connection to come back, until deadline (a stats_now() time) */
+static int wait_until(struct pool *p, double deadline)
+{
+    struct timeval tv;
+    struct timespec ts;
+    double left = deadline - stats_now();
+
+    if (left <= 0)
+        return ETIMEDOUT;
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + (long)left;
+    ts.tv_nsec = tv.tv_usec * 1000 + (long)((left - (long)left) * 1e9);
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(&p->freed, &p->lock, &ts);
+}
+
+PGconn *dbpool_get(enum db_pool which)
+{
+    struct pool *p = &pools[which];
+    double t0 = stats_now(), since = 0;
+    PGconn *c = NULL;
+    int make = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (p->nidle > 0) {
+            /* the most recently used: busy connections stay warm, the rest age out */
+            c = p->idle[--p->nidle].c;
+            since = p->idle[p->nidle].since;
+            break;
+        } else if (p->open < p->size) {
+            if (stats_now() >= p->retry_at) {
+                p->open++;
+                make = 1;
+            }
+            break; /* database down: don't queue up behind it */
+        } else if (wait_until(p, t0 + pconf->db_pool_wait) == ETIMEDOUT) {
+            stats_incr(p->st_timeouts);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (c != NULL && !healthy(c, since)) {
+        warning(0, "dbpool %s: lost a database connection, reconnecting", p->name);
+        stats_incr(p->st_reconnects);
+        PQfinish(c);
+        c = NULL;
+        pthread_mutex_lock(&p->lock);
+        if (!(make = stats_now() >= p->retry_at))
+            p->open--;
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (make) {
+        c = pool_connect(p);
+        pthread_mutex_lock(&p->lock);
+        if (c == NULL) {
+            p->open--;
+            p->retry_at = stats_now() + p->backoff;
+            p->backoff = p->backoff * 2 < MAX_BACKOFF ? p->backoff * 2 : MAX_BACKOFF;
+            stats_incr(p->st_failures);
+        } else
+            p->backoff = MIN_BACKOFF;
+        pthread_mutex_unlock(&p->lock);
+        if (c == NULL)
+            pthread_cond_signal(&p->freed); /* someone waiting may do better */
+    }
+    stats_time(p->st_wait, stats_now() - t0);
+    return c;
+}
+
+void dbpool_put(enum db_pool which, PGconn *c)
+{
+    struct pool *p = &pools[which];
+
+    if (c == NULL)
+        return;
+    if (PQstatus(c) == CONNECTION_OK && PQtransactionStatus(c) != PQTRANS_IDLE)
+        PQclear(PQexec(c, "ROLLBACK"));
+
+    pthread_mutex_lock(&p->lock);
+    if (PQstatus(c) != CONNECTION_OK || p->open > p->size) {
+        p->open--;
+        pthread_mutex_unlock(&p->lock);
+        PQfinish(c); /* broken or surplus: the next get makes a new one if need be */
+    } else {
+        p->idle[p->nidle].c = c;
+        p->idle[p->nidle].since = stats_now();
+        p->nidle++;
+        pthread_mutex_unlock(&p->lock);
+    }
+    pthread_cond_signal(&p->freed);
+}
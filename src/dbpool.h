@@ -0,0 +1,48 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dbpool.h
+ *
+ *    Description:  Database connections shared by the ingest, delivery and maintenance
+ *                  threads. Connections are checked before they are handed out and
+ *                  re-made, with backoff, when the database goes away.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 22:31:05
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_DBPOOL_H
+#define __DISPATCHER2_DBPOOL_H
+
+#include <libpq-fe.h>
+#include "conf.h"
+
+enum db_pool {
+    DB_POOL_INGEST, /* dispatch_processor: the HTTP handlers */
+    DB_POOL_DELIVERY, /* request processor: producer and workers */
+    DB_POOL_MAINTENANCE, /* usage flushes, server config loads */
+    DB_NUM_POOLS
+};
+
+/* Call once, after db_init() and before any dbpool_get(); registers the /stats entries */
+void dbpool_init(dispatcher2conf_t config);
+void dbpool_shutdown(void);
+
+/* Pick up new pool sizes, e.g. after a config reload. Extra connections are closed
+ * as they come back. */
+void dbpool_resize(void);
+
+/* A healthy connection with the hot statements prepared, or NULL if none is to be had
+ * within db-pool-wait or the database is down. Give it back with dbpool_put(). */
+PGconn *dbpool_get(enum db_pool p);
+
+/* Return a connection; an open transaction is rolled back, a broken one is dropped */
+void dbpool_put(enum db_pool p, PGconn *c);
+
+#endif
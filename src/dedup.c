@@ -0,0 +1,216 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dedup.c
+ *
+ *    Description:  Idempotent ingest. A unique index on requests (source, submissionid)
+ *                  is what guarantees one row per submission; in front of it sits a
+ *                  Bloom filter of the submissions seen, so that the usual, new
+ *                  submission is inserted straight away and only a likely retry costs
+ *                  a lookup. Bits are set with atomic ors: no lock on the way in.
+ *                  The filter is two generations, both asked, of which the newer
+ *                  takes the adds. Once it has had the preload window's worth of
+ *                  time, or of submissions, the older is cleared and takes over, so
+ *                  what is remembered is between one and two windows old.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 23:58:12
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <libpq-fe.h>
+
+#include "dedup.h"
+#include "db.h"
+#include "dbpool.h"
+#include "stats.h"
+
+#define NUM_HASHES 7 /* ~1% false positives at 10 bits per submission */
+#define BITS_PER_SUBMISSION 10
+
+struct generation {
+    uint64_t *bits;
+    long added;
+};
+
+static struct generation gens[2];
+static volatile int cur; /* index of the generation taking adds */
+static uint64_t nbits; /* per generation */
+static long window; /* seconds a generation takes adds for; 0 = until full */
+static time_t started; /* when gens[cur] started taking adds */
+static Mutex *rotate_lock;
+static stat_t *st_lookups, *st_false_positives, *st_rotations;
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Double hashing: the i-th probe is h1 + i * h2 */
+static void probes(int source, int64_t msgid, uint64_t *h1, uint64_t *h2)
+{
+    *h1 = mix((uint64_t)msgid ^ ((uint64_t)source << 40));
+    *h2 = mix(*h1 + 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+static int gen_has(uint64_t *bits, uint64_t h1, uint64_t h2)
+{
+    uint64_t b;
+    int i;
+
+    for (i = 0; i < NUM_HASHES; i++) {
+        b = (h1 + i * h2) % nbits;
+        if ((__atomic_load_n(&bits[b / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (b % 64))) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+int dedup_maybe_seen(int source, int64_t msgid)
+{
+    uint64_t h1, h2;
+
+    if (gens[0].bits == NULL)
+        return 1; /* no filter: always ask the database */
+    probes(source, msgid, &h1, &h2);
+    return gen_has(gens[0].bits, h1, h2) || gen_has(gens[1].bits, h1, h2);
+}
+
+/* The older generation is cleared before it takes the adds: those still going to the
+ * newer one are kept. A submission the clearing hides from a lookup racing with it is
+ * still caught by the unique index. */
+static void rotate(void)
+{
+    int next;
+
+    mutex_lock(rotate_lock);
+    if (gens[cur].added >= (long)(nbits / BITS_PER_SUBMISSION) ||
+            (window > 0 && time(NULL) - __atomic_load_n(&started, __ATOMIC_RELAXED) >= window)) {
+        next = !cur;
+        memset(gens[next].bits, 0, nbits / 8);
+        gens[next].added = 0;
+        __atomic_store_n(&started, time(NULL), __ATOMIC_RELAXED);
+        __atomic_store_n(&cur, next, __ATOMIC_RELEASE);
+        stats_incr(st_rotations);
+    }
+    mutex_unlock(rotate_lock);
+}
+
+void dedup_add(int source, int64_t msgid)
+{
+    uint64_t h1, h2, b, *bits;
+    int i, g;
+
+    if (gens[0].bits == NULL)
+        return;
+    g = __atomic_load_n(&cur, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&gens[g].added, 1, __ATOMIC_RELAXED) >= (long)(nbits / BITS_PER_SUBMISSION) ||
+            (window > 0 && time(NULL) - __atomic_load_n(&started, __ATOMIC_RELAXED) >= window)) {
+        rotate();
+        g = __atomic_load_n(&cur, __ATOMIC_ACQUIRE);
+    }
+    bits = gens[g].bits;
+    probes(source, msgid, &h1, &h2);
+    for (i = 0; i < NUM_HASHES; i++) {
+        b = (h1 + i * h2) % nbits;
+        __atomic_fetch_or(&bits[b / 64], (uint64_t)1 << (b % 64), __ATOMIC_RELAXED);
+    }
+}
+
+int64_t dedup_lookup(PGconn *c, const char *source, int64_t msgid)
+{
+    char tmp[32];
+    const char *pvals[] = {source, tmp};
+    PGresult *r;
+    int64_t id = -1;
+
+    stats_incr(st_lookups);
+    sprintf(tmp, "%lld", (long long)msgid);
+    r = db_run(c, DB_FIND_SUBMISSION, pvals, NULL, NULL);
+    if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0)
+        id = strtoll(PQgetvalue(r, 0, 0), NULL, 10);
+    else
+        stats_incr(st_false_positives);
+    PQclear(r);
+    return id;
+}
+
+/* Rows come one at a time: the window may hold millions of them */
+static void preload(PGconn *c, int days)
+{
+    char tmp[32];
+    const char *pvals[] = {tmp};
+    PGresult *r;
+    long n = 0;
+
+    sprintf(tmp, "%d", days);
+    if (!PQsendQueryParams(c, "SELECT source, submissionid FROM requests WHERE submissionid > 0 "
+                "AND source IS NOT NULL AND created > current_timestamp - $1 * interval '1 day'",
+                1, NULL, pvals, NULL, NULL, 0) || !PQsetSingleRowMode(c)) {
+        warning(0, "dedup: could not load recent submissions: %s", PQerrorMessage(c));
+        return;
+    }
+    while ((r = PQgetResult(c)) != NULL) {
+        if (PQresultStatus(r) == PGRES_SINGLE_TUPLE) {
+            dedup_add(atoi(PQgetvalue(r, 0, 0)), strtoll(PQgetvalue(r, 0, 1), NULL, 10));
+            n++;
+        } else if (PQresultStatus(r) != PGRES_TUPLES_OK)
+            warning(0, "dedup: loading recent submissions: %s", PQresultErrorMessage(r));
+        PQclear(r);
+    }
+    info(0, "dedup: filter loaded with %ld submission(s) from the last %d day(s)", n, days);
+}
+
+void dedup_init(dispatcher2conf_t config)
+{
+    PGconn *c;
+    int i;
+
+    st_lookups = stats_counter("dedup.lookups");
+    st_false_positives = stats_counter("dedup.false_positives");
+    st_rotations = stats_counter("dedup.rotations");
+    if (config->dedup_filter_size <= 0)
+        return;
+    /* each generation gets half, in whole words */
+    nbits = (uint64_t)config->dedup_filter_size / 2 / 8 * 64;
+    if (nbits == 0)
+        nbits = 64;
+    for (i = 0; i < 2; i++) {
+        gens[i].bits = gw_malloc(nbits / 8);
+        memset(gens[i].bits, 0, nbits / 8);
+        gens[i].added = 0;
+    }
+    cur = 0;
+    window = config->dedup_preload_days * 86400L;
+    started = time(NULL);
+    rotate_lock = mutex_create();
+
+    if ((c = dbpool_get(DB_POOL_MAINTENANCE)) == NULL) {
+        /* the unique index still catches retries; the filter fills up as we go */
+        warning(0, "dedup: no database connection, starting with an empty filter");
+        return;
+    }
+    preload(c, config->dedup_preload_days);
+    dbpool_put(DB_POOL_MAINTENANCE, c);
+}
+
+void dedup_shutdown(void)
+{
+    if (gens[0].bits == NULL)
+        return;
+    gw_free(gens[0].bits);
+    gw_free(gens[1].bits);
+    gens[0].bits = gens[1].bits = NULL;
+    mutex_destroy(rotate_lock);
+}
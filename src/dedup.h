@@ -0,0 +1,39 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dedup.h
+ *
+ *    Description:  Recognising a submission (source, msgid) that was queued before,
+ *                  so that retries from sources don't become new requests.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 23:58:12
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_DEDUP_H
+#define __DISPATCHER2_DEDUP_H
+
+#include <stdint.h>
+#include <libpq-fe.h>
+#include "conf.h"
+
+/* Call once, after dbpool_init(): sizes the filter and loads it with the submissions
+ * of the last dedup-preload-days */
+void dedup_init(dispatcher2conf_t config);
+void dedup_shutdown(void);
+
+/* 0 if (source, msgid) was certainly not queued in the last dedup-preload-days (at
+ * least); 1 if it may have been, and dedup_lookup() (or the segment log) has the answer */
+int dedup_maybe_seen(int source, int64_t msgid);
+void dedup_add(int source, int64_t msgid);
+
+/* The id of the request queued for msgid from the source named, or -1 */
+int64_t dedup_lookup(PGconn *c, const char *source, int64_t msgid);
+
+#endif
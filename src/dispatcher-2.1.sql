@@ -16,6 +16,13 @@ CREATE TABLE servers(
     end_submission_period INTEGER NOT NULL DEFAULT 23, -- ending hour for submission period
     xml_response_xpath TEXT NOT NULL DEFAULT '',
     json_response_jsonpath TEXT NOT NULL DEFAULT '',
+    min_concurrency INTEGER NOT NULL DEFAULT 1, -- bounds for the adaptive number of parallel deliveries
+    max_concurrency INTEGER NOT NULL DEFAULT 0, -- 0 = max-concurrent from the config
+    target_latency INTEGER NOT NULL DEFAULT 0, -- ms; concurrency grows while responses are faster, 0 = delivery-target-latency
+    partition_key TEXT NOT NULL DEFAULT '', -- requests column whose values are delivered in order, '' = none
+    supersede BOOLEAN NOT NULL DEFAULT 'f', -- a new version of a report cancels the older ones not yet sent
+    deadline_days INTEGER NOT NULL DEFAULT 0, -- reports are due this many days after their period ends, 0 = no deadline
+    async_import BOOLEAN NOT NULL DEFAULT 'f', -- submit with async=true and poll the import task for the summary
     created timestamptz DEFAULT current_timestamp,
     updated timestamptz DEFAULT current_timestamp
 );
@@ -48,17 +55,35 @@ CREATE TABLE requests(
     facility TEXT NOT NULL DEFAULT '', -- facility owning report
     district TEXT NOT NULL DEFAULT '', -- district
     report_type TEXT NOT NULL DEFAULT '',
+    priority SMALLINT NOT NULL DEFAULT 2, -- 0 critical, 1 high, 2 normal, 3 low
+    deadline timestamptz, -- from the destination's deadline_days at ingest, NULL = none
+    import_task TEXT NOT NULL DEFAULT '', -- async imports: the task endpoint polled while status is inprogress
+    import_started timestamptz,
+    import_poll_at timestamptz,
     created timestamptz DEFAULT current_timestamp,
     updated timestamptz DEFAULT current_timestamp
 );
 
 CREATE INDEX requests_idx1 ON requests(submissionid);
+CREATE UNIQUE INDEX requests_submission_idx ON requests(source, submissionid) WHERE submissionid > 0;
 CREATE INDEX requests_idx2 ON requests(status);
 CREATE INDEX requests_idx3 ON requests(statuscode);
 CREATE INDEX requests_idx4 ON requests(week);
 CREATE INDEX requests_idx5 ON requests(month);
 CREATE INDEX requests_idx6 ON requests(year);
 CREATE INDEX requests_idx7 ON requests(ctype);
+CREATE INDEX requests_due_idx ON requests(priority, COALESCE(deadline, created)) WHERE status = 'ready';
+CREATE INDEX requests_import_idx ON requests(import_poll_at) WHERE status = 'inprogress' AND import_task <> '';
+
+-- the most urgent matching rule sets the priority of requests queued without one
+CREATE TABLE priority_rules (
+    id serial PRIMARY KEY NOT NULL,
+    report_type TEXT NOT NULL DEFAULT '', -- '' = any
+    source INTEGER REFERENCES servers(id), -- NULL = any
+    priority SMALLINT NOT NULL DEFAULT 2, -- 0 critical, 1 high, 2 normal, 3 low
+    created timestamptz DEFAULT current_timestamp,
+    updated timestamptz DEFAULT current_timestamp
+);
 
 INSERT INTO servers (name, username, password, ipaddress, url, auth_method)
     VALUES
@@ -104,7 +129,9 @@ CREATE TABLE users (
     password TEXT NOT NULL, -- blowfish hash of password
     email TEXT,
     user_role  BIGINT NOT NULL REFERENCES user_roles ON DELETE RESTRICT ON UPDATE CASCADE,
-    transaction_limit TEXT DEFAULT '0/'||to_char(NOW(),'yyyymmdd'),
+    transaction_limit TEXT DEFAULT '0/'||to_char(NOW(),'yyyymmdd'), -- requests used/day, kept by dispatcher2d
+    max_rate REAL NOT NULL DEFAULT 0, -- requests per second, 0 = rate-limit from the config
+    daily_quota INTEGER NOT NULL DEFAULT 0, -- requests per day, 0 = daily-quota from the config
     is_active BOOLEAN NOT NULL DEFAULT 't',
     is_system_user BOOLEAN NOT NULL DEFAULT 'f',
     created timestamptz DEFAULT current_timestamp,
@@ -112,6 +139,17 @@ CREATE TABLE users (
 
 );
 
+-- dispatcher2d nodes sharing this database (cluster-mode: true)
+CREATE TABLE IF NOT EXISTS cluster_nodes (
+    id serial PRIMARY KEY NOT NULL,
+    name TEXT NOT NULL UNIQUE, -- node-name from the config file
+    hostname TEXT NOT NULL DEFAULT '',
+    http_port INTEGER NOT NULL DEFAULT 0,
+    pid INTEGER NOT NULL DEFAULT 0,
+    started timestamptz DEFAULT current_timestamp,
+    heartbeat timestamptz DEFAULT current_timestamp
+);
+
 -- FUNCTIONS
 -- Check if source is an allowed "source" for destination server/app dest
 CREATE OR REPLACE FUNCTION is_allowed_source(source integer, dest integer) RETURNS BOOLEAN AS $delim$
@@ -13,6 +13,15 @@
 /* Define to 1 if you have the `gethostname' function. */
 #define HAVE_GETHOSTNAME 1
 
+/* Define to 1 if you have the `http_set_server_timeout' function. */
+#define HAVE_HTTP_SET_SERVER_TIMEOUT 1
+
+/* Define to 1 if res_nsearch() and ns_parserr() are available */
+#define HAVE_RES_NSEARCH 1
+
+/* Define to 1 if you have the `PQenterPipelineMode' function. */
+#define HAVE_PQENTERPIPELINEMODE 1
+
 /* Define to 1 if you have the <inttypes.h> header file. */
 #define HAVE_INTTYPES_H 1
 
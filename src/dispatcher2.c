@@ -25,6 +25,14 @@
 #include "log.h"
 #include "request_processor.h"
 #include "misc.h"
+#include "cluster.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "smssender.h"
+#include "db.h"
+#include "dbpool.h"
+#include "seglog.h"
+#include "dedup.h"
 
 #define DISPATCHER2CONF "/etc/dispatcher2.conf"
 
@@ -33,6 +41,8 @@ static struct option long_options [] = {
     /* {"debug", no_argument, 0, 'd'}, */
     {"help", no_argument, 0, 'h'},
     {"conf", required_argument, 0, 'c'},
+    {"pidfile", required_argument, 0, 'p'},
+    {"takeover", no_argument, 0, 't'},
     {NULL, 0, NULL, 0}
 
 };
@@ -40,12 +50,13 @@ static struct option long_options [] = {
 struct dispatcher2conf config; /*configuration stuff*/
 char conffile[512];
 static int conf_parsed = 0;
+static int takeover = 0; /* take the port over from a running instance */
 
 static char pidfile[128] = "/var/run/dispatcer2.pid";
 
 void usage(int exit_status)
 {
-     fprintf(stdout, "%s [-c config] [-d] | -V | -h \n", PACKAGE);
+     fprintf(stdout, "%s [-c config] [-p pidfile] [-t] [-d] | -V | -h \n", PACKAGE);
 
      gwlib_shutdown();
      exit(exit_status);
@@ -58,7 +69,7 @@ int decode_switches(int argc, char *argv[])
     FILE *f;
 
     while (1) {
-        c = getopt_long(argc, argv, "hdVc:p:", long_options, &option_index);
+        c = getopt_long(argc, argv, "hdVtc:p:", long_options, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -79,6 +90,9 @@ int decode_switches(int argc, char *argv[])
             case 'p':
                strncpy(pidfile, optarg, sizeof pidfile);
                break;
+            case 't':
+               takeover = 1;
+               break;
             case 'h':
             default:
                usage(EXIT_FAILURE);
@@ -89,112 +103,163 @@ int decode_switches(int argc, char *argv[])
 }
 
 static int stop = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t drain_requested = 0;
+static int draining = 0;
+static Counter *inflight; /* requests queued to or being handled by dispatch_processor */
+static int num_dispatchers = 0;
+static struct HTTPData retire_dispatcher; /* queued to make one dispatch_processor exit */
+
+/* Load shedding: Retry-After is how long the backlog takes to clear at the current rate */
+#define MAX_RETRY_AFTER 60
+#define MAX_UNSHED_PENDING 2 /* per route that the full queue doesn't shed, e.g. /stats */
+static Counter *handled; /* requests dispatch_processor has finished */
+static double drain_rate; /* requests/sec, smoothed; updated by housekeeping() */
+
+/* Per-stage metrics: acceptor -> server_req_list -> parse -> handler */
+static stat_t *st_accepted, *st_drained, *st_rejected, *st_shed;
+static stat_t *st_queue_wait, *st_parse, *st_handle, *st_roundtrips;
+static stat_t *st_body_bytes, *st_copied;
+static stat_t *st_connections, *st_handshakes, *st_duplicates, *st_superseded;
+
+/* Keep-alive accounting. gwlib hands back the same HTTPClient for every request on a
+ * persistent connection, so its address identifies the connection while it is open. */
+struct conn_info {
+    long requests;
+    time_t last_seen;
+};
+static Dict *conn_dict; /* "%p" of HTTPClient -> struct conn_info */
+static Mutex *conn_lock;
+static time_t started;
 
 /*URLs and their handlers*/
-typedef const char *(*request_handler_t)(List *rh, struct HTTPData *x, Octstr *rbody, int *status);
-static request_handler_t uri2handler(Octstr *);
 static int supporteduri(Octstr *);
+static int uri2route(Octstr *);
 static void dispatch_processor(void *data);
 static void dispatch_request(struct HTTPData *x);
+static long retry_after(long pending);
+
+/* Per-user rate limit and daily quota, checked in memory. Sets up the 429 if refused */
+static int over_limit(List *rh, struct HTTPData *x, Octstr *user, Octstr *rbody, int *status)
+{
+    Octstr *ba_user = NULL, *ba_pass = NULL;
+    long retry_after;
+    int ret;
+
+    if (ba_credentials(x->reqh, &ba_user, &ba_pass) == 0)
+        user = ba_user;
+    if ((ret = ratelimit_check(x->dbconn, user, &retry_after)) != RATELIMIT_OK) {
+        char buf[32];
+
+        sprintf(buf, "%ld", retry_after);
+        *status = 429; /* Too Many Requests */
+        http_header_add(rh, "Retry-After", buf);
+        octstr_format_append(rbody, "error: ERR004: %s, user=%S",
+                ret == RATELIMIT_QUOTA ? "daily quota used up" : "rate limit exceeded", user);
+        d2log_info("Error: 0004 user=%s over limit, retry after %lds", octstr_get_cstr(user), retry_after);
+    }
+    octstr_destroy(ba_user);
+    octstr_destroy(ba_pass);
+    return ret;
+}
 
 static const char *sendsms(List *rh, struct HTTPData *x, Octstr *rbody, int *status)
 {
-    Octstr *user = http_cgi_variable(x->cgivars, "username");
-    Octstr *pass = http_cgi_variable(x->cgivars, "password");
-    Octstr *from = http_cgi_variable(x->cgivars, "from");
-    Octstr *to = http_cgi_variable(x->cgivars, "to");
-    Octstr *text = http_cgi_variable(x->cgivars, "text");
-    Octstr *furl = NULL, *sms_url = NULL, *resp_body = NULL;
-    int xs = -1; /* status returned after call*/
-
-    List *request_headers;
-    HTTPCaller * caller = http_caller_create();
-    int method = HTTP_METHOD_GET;
+    Octstr *user = cgi_get(x->cgivars, "username");
+    Octstr *pass = cgi_get(x->cgivars, "password");
+    Octstr *from = cgi_get(x->cgivars, "from");
+    Octstr *to = cgi_get(x->cgivars, "to");
+    Octstr *text = cgi_get(x->cgivars, "text");
 
     /*Use Basic Auth or GCI username and password to authenticate request*/
     http_header_add(rh, "Content-Type", "text/plain");
-    if (ba_auth_user(x->dbconn, x->reqh) != 0  &&
+    if (x->dbconn == NULL) { /* checked first: we can't tell a bad password without it */
+        *status = HTTP_INTERNAL_SERVER_ERROR;
+        octstr_append_cstr(rbody, "ERR002: Database not connected.");
+        d2log_info("Error: 0002");
+        return "";
+    } else if (ba_auth_user(x->dbconn, x->reqh) != 0  &&
             auth_user(x->dbconn, user ? octstr_get_cstr(user): "",
                 pass ? octstr_get_cstr(pass): "") != 0) {
         *status = HTTP_UNAUTHORIZED;
         octstr_format_append(rbody, "error: ERR001: auth failed, user=%S", user);
-        info(0, "Error: 0001 auth failed, user=%s", octstr_get_cstr(user));
+        d2log_info("Error: 0001 auth failed, user=%s", octstr_get_cstr(user));
         return "";
-    } else if (x->dbconn == NULL) {
-        *status = HTTP_INTERNAL_SERVER_ERROR;
-        octstr_append_cstr(rbody, "ERR002: Database not connected.");
-        info(0, "Error: 0002");
+    } else if (over_limit(rh, x, user, rbody, status) != RATELIMIT_OK) {
+        return "";
+    } else if (to == NULL || text == NULL) {
+        *status = HTTP_BAD_REQUEST;
+        octstr_append_cstr(rbody, "error: ERR005: to and text are required");
         return "";
     }
 
-    request_headers = http_create_empty_headers();
-    http_header_add(request_headers, "Content-Type", "text/plain; charset=us-ascii");
-    sms_url = octstr_format("%s%stext=%E&to=%E&from=%E",
-            config.sendsmsurl,
-            strchr(config.sendsmsurl, '?') != NULL ? "&" : "?",
-            text, to,
-            (from == NULL) ? octstr_format("%s",config.default_sender) : from);
-    http_start_request(caller, method, sms_url, request_headers, NULL, 1, NULL, NULL);
-
-    http_receive_result_real(caller, &xs, &furl, &request_headers, &resp_body, 1);
-
-    http_caller_destroy(caller);
-    http_destroy_headers(request_headers);
-    octstr_destroy(furl);
-    *status = http_status_class(xs) == HTTP_STATUS_SUCCESSFUL ?  HTTP_OK : xs;
-    if (*status = HTTP_OK) {
-        octstr_format_append(rbody, "Accepted!");
-        info(0, "Successfully called SMS URL [%s]", octstr_get_cstr(sms_url));
-        if(resp_body)
-            octstr_destroy(resp_body);
+    /* The gateway is called from the sender threads, not while we hold a dispatcher */
+    if (smssender_queue(from, to, text) < 0) {
+        char buf[32];
+
+        sprintf(buf, "%ld", retry_after(smssender_len()));
+        *status = HTTP_SERVICE_UNAVAILABLE;
+        http_header_add(rh, "Retry-After", buf);
+        octstr_append_cstr(rbody, "error: ERR006: SMS queue full");
+        return "";
     }
-    octstr_destroy(sms_url);
+    *status = HTTP_ACCEPTED;
+    octstr_append_cstr(rbody, "Accepted!");
 
     return "";
 }
 
 static const char *queue_request(List *rh, struct HTTPData *x, Octstr *rbody, int *status)
 {
-    request_t *req;
-    info(0, "We have called queue_request");
-
-    Octstr *user = http_cgi_variable(x->cgivars, "username");
-    Octstr *pass = http_cgi_variable(x->cgivars, "password");
+    request_t req;
+    int64_t xid = -1;
+    int sid, duplicate = 0;
+    long superseded = 0;
+    char idbuf[32];
+    d2log_info("We have called queue_request");
+
+    Octstr *user = cgi_get(x->cgivars, "username");
+    Octstr *pass = cgi_get(x->cgivars, "password");
     /*
-    Octstr *ctype = http_cgi_variable(x->cgivars, "ctype");
-    Octstr *payload = http_cgi_variable(x->cgivars, "payload");
+    Octstr *ctype = cgi_get(x->cgivars, "ctype");
+    Octstr *payload = cgi_get(x->cgivars, "payload");
     */
     Octstr *ct = NULL;
     Octstr *ctype = http_header_value(x->reqh, octstr_imm("Content-Type"));
 
-    Octstr *source = http_cgi_variable(x->cgivars, "source");
-    Octstr *dest = http_cgi_variable(x->cgivars, "destination");
+    Octstr *source = cgi_get(x->cgivars, "source");
+    Octstr *dest = cgi_get(x->cgivars, "destination");
 
-    Octstr *msgid = http_cgi_variable(x->cgivars, "msgid"); /* id of submission in source */
+    Octstr *msgid = cgi_get(x->cgivars, "msgid"); /* id of submission in source */
 
-    Octstr *week = http_cgi_variable(x->cgivars, "week");
-    Octstr *month = http_cgi_variable(x->cgivars, "month");
-    Octstr *year = http_cgi_variable(x->cgivars, "year");
-    Octstr *is_qparams = http_cgi_variable(x->cgivars, "is_qparams");
-    Octstr *msisdn = http_cgi_variable(x->cgivars, "msisdn");
-    Octstr *raw_msg = http_cgi_variable(x->cgivars, "raw_msg");
-    Octstr *facility = http_cgi_variable(x->cgivars, "facility");
-    Octstr *district = http_cgi_variable(x->cgivars, "district");
-    Octstr *report_type = http_cgi_variable(x->cgivars, "report_type");
+    Octstr *week = cgi_get(x->cgivars, "week");
+    Octstr *month = cgi_get(x->cgivars, "month");
+    Octstr *year = cgi_get(x->cgivars, "year");
+    Octstr *is_qparams = cgi_get(x->cgivars, "is_qparams");
+    Octstr *msisdn = cgi_get(x->cgivars, "msisdn");
+    Octstr *raw_msg = cgi_get(x->cgivars, "raw_msg");
+    Octstr *facility = cgi_get(x->cgivars, "facility");
+    Octstr *district = cgi_get(x->cgivars, "district");
+    Octstr *report_type = cgi_get(x->cgivars, "report_type");
+    Octstr *priority = cgi_get(x->cgivars, "priority");
 
     /*Use Basic Auth or GCI username and password to authenticate request*/
-    if (ba_auth_user(x->dbconn, x->reqh) != 0  &&
+    if (x->dbconn == NULL) { /* checked first: we can't tell a bad password without it */
+        *status = HTTP_INTERNAL_SERVER_ERROR;
+        octstr_append_cstr(rbody, "ERR002: Database not connected.");
+        d2log_info("Error: 0002");
+        goto done;
+    } else if (ba_auth_user(x->dbconn, x->reqh) != 0  &&
             auth_user(x->dbconn, user ? octstr_get_cstr(user): "",
                 pass ? octstr_get_cstr(pass): "") != 0) {
         *status = HTTP_UNAUTHORIZED;
         octstr_format_append(rbody, "error: ERR001: auth failed, user=%S", user);
-        info(0, "Error: 0001 auth failed, user=%s", octstr_get_cstr(user));
-        goto done;
-    } else if (x->dbconn == NULL) {
-        *status = HTTP_INTERNAL_SERVER_ERROR;
-        octstr_append_cstr(rbody, "ERR002: Database not connected.");
-        info(0, "Error: 0002");
+        d2log_info("Error: 0001 auth failed, user=%s", octstr_get_cstr(user));
         goto done;
+    } else if (over_limit(rh, x, user, rbody, status) != RATELIMIT_OK) {
+        octstr_destroy(ctype);
+        http_header_add(rh, "Content-Type", "text/plain");
+        return ""; /* not queued */
     }
 
     if (ctype && octstr_case_search(ctype, octstr_imm("xml"), 0) >= 0) {
@@ -206,74 +271,447 @@ static const char *queue_request(List *rh, struct HTTPData *x, Octstr *rbody, in
         ct = octstr_imm("text");
     }
 
-    info(0, "Creating Request with ctype:%s", octstr_get_cstr(ctype));
-    req = gw_malloc(sizeof *req);
-    memset(req, 0, sizeof *req);
-
-    req->source = get_server(x->dbconn, octstr_get_cstr(source));
-    req->destination = get_server(x->dbconn, octstr_get_cstr(dest));
-    req->month = octstr_duplicate(month);
-    req->week = octstr_duplicate(week);
-    req->msgid = (msgid) ? strtoull(octstr_get_cstr(msgid), NULL, 10) : -1;
-    req->year = (year) ? strtoul(octstr_get_cstr(year), NULL, 10) : 0;
-    req->is_qparams = octstr_duplicate(is_qparams);
-    req->payload = octstr_duplicate(x->body);
-    req->ctype = octstr_duplicate(ct);
-    req->msisdn = octstr_duplicate(msisdn);
-    req->raw_msg = octstr_duplicate(raw_msg);
-    req->facility = octstr_duplicate(facility);
-    req->district = octstr_duplicate(district);
-    req->report_type = octstr_duplicate(report_type);
-
-    if (save_request(x->dbconn, req, &config) < 0) {
+    d2log_info("Creating Request with ctype:%s", octstr_get_cstr(ctype));
+    /* Borrows the body and CGI values from x: nothing is copied before the insert */
+    memset(&req, 0, sizeof req);
+    req.month = month;
+    req.week = week;
+    req.msgid = (msgid) ? strtoull(octstr_get_cstr(msgid), NULL, 10) : -1;
+    req.year = (year) ? strtoul(octstr_get_cstr(year), NULL, 10) : 0;
+    req.is_qparams = is_qparams;
+    req.payload = x->body;
+    req.ctype = ct;
+    req.msisdn = msisdn;
+    req.raw_msg = raw_msg;
+    req.facility = facility;
+    req.district = district;
+    req.report_type = report_type;
+
+    /* A retry of a submission we have: answer with what was queued the first time */
+    sid = server_id_by_name(source);
+    req.source = sid;
+    if ((req.priority = parse_priority(priority)) < 0)
+        req.priority = request_priority(&req);
+    /* fixed at ingest: a later change of deadline_days does not move queued requests */
+    if ((req.destination = server_id_by_name(dest)) > 0)
+        req.deadline = request_deadline(&req);
+    if (req.msgid > 0 && sid > 0 && dedup_maybe_seen(sid, req.msgid) &&
+            ((xid = seglog_find(sid, req.msgid)) > 0 ||
+             (xid = dedup_lookup(x->dbconn, octstr_get_cstr(source), req.msgid)) > 0))
+        duplicate = 1;
+    else if (seglog_routes(dest) && sid > 0 && req.destination > 0 &&
+            req.msgid <= 0 && /* only requests' unique index can tell a retry for sure */
+            !server_supersedes(req.destination) && /* that is done in requests */
+            !server_imports_async(req.destination) && /* so is following the import */
+            server_allows_source(req.destination, req.source) &&
+            seglog_append(&req) >= 0)
+        *status = HTTP_ACCEPTED; /* on disk in the segment log */
+    else if ((xid = save_request_named(x->dbconn, &req, octstr_get_cstr(source), octstr_get_cstr(dest),
+                &config, &duplicate, &superseded)) < 0) {
         *status = HTTP_INTERNAL_SERVER_ERROR;
         octstr_format_append(rbody, "error: E0003: Failed to save request in database");
-        info(0, "Error: 0003");
+        d2log_info("Error: 0003");
+    } else
+        *status = HTTP_ACCEPTED;
+
+    if (duplicate) {
+        *status = HTTP_OK;
+        stats_incr(st_duplicates);
+        d2log_info("Duplicate of request %lld: source=%s msgid=%lld", (long long)xid,
+                octstr_get_cstr(source), (long long)req.msgid);
+    } else if (*status == HTTP_ACCEPTED && req.msgid > 0 && sid > 0)
+        dedup_add(sid, req.msgid);
+    if (superseded > 0) {
+        stats_add(st_superseded, superseded);
+        d2log_info("Request %lld supersedes %ld older version(s)", (long long)xid, superseded);
+    }
+    if (xid > 0 && !seglog_owns(xid)) {
+        sprintf(idbuf, "%lld", (long long)xid);
+        http_header_add(rh, "X-Request-Id", idbuf);
     }
-    *status = HTTP_ACCEPTED;
-    octstr_destroy(ct);
 
 done:
+    octstr_destroy(ctype);
     http_header_add(rh, "Content-Type", "text/plain");
     octstr_format_append(rbody, "Request Queued");
 
     return "";
 }
 
+static const char *stats_request(List *rh, struct HTTPData *x, Octstr *rbody, int *status)
+{
+    Octstr *s;
+
+    http_header_add(rh, "Content-Type", "text/plain");
+    /* Same users as /queue: the figures tell what the system is doing, and by how much */
+    if (x->dbconn == NULL) {
+        *status = HTTP_INTERNAL_SERVER_ERROR;
+        octstr_append_cstr(rbody, "ERR002: Database not connected.");
+        return "";
+    } else if (ba_auth_user(x->dbconn, x->reqh) != 0) {
+        *status = HTTP_UNAUTHORIZED;
+        http_header_add(rh, "WWW-Authenticate", "Basic realm=\"dispatcher2\"");
+        octstr_append_cstr(rbody, "error: ERR001: auth failed");
+        return "";
+    }
+    s = stats_report();
+    octstr_append(rbody, s);
+    octstr_destroy(s);
+    *status = HTTP_OK;
+    return "";
+}
+
+static int no_admission_limit = 0;
+
 static struct {
     char *uri;
     request_handler_t func;
-
+    int *admission_limit; /* most requests pending per route, 0 = no own limit, NULL = not
+                             shed for a full queue, only past MAX_UNSHED_PENDING */
 } uri_funcs[] = {
-    {TEST_URL, NULL},
-    {"/queue", queue_request},
-    {"/sendsms", sendsms}
+    {TEST_URL, NULL, &no_admission_limit},
+    {"/queue", queue_request, &config.queue_admission_limit},
+    {"/sendsms", sendsms, &config.sendsms_admission_limit},
+    {"/stats", stats_request, NULL} /* so we can see what is going on while overloaded */
 };
+static Counter *route_pending[NELEMS(uri_funcs)]; /* accepted but not yet answered */
+static stat_t *st_route_shed[NELEMS(uri_funcs)];
 
+/* Signal handlers only raise flags; housekeeping() does the actual work */
 static void quit_now(int unused)
 {
+     drain_requested = 1;
+}
+
+static void reload_now(int unused)
+{
+     reload_requested = 1;
+}
+
+static List *server_req_list;
+
+static long inflight_count(void *unused)
+{
+     return counter_value(inflight);
+}
+
+static long counter_gauge(void *c)
+{
+     return counter_value(c);
+}
+
+static long drain_rate_gauge(void *unused)
+{
+     return (long)drain_rate;
+}
+
+static long open_connections(void *unused)
+{
+     return dict_key_count(conn_dict);
+}
+
+static long uptime(void *unused)
+{
+     return time(NULL) - started;
+}
+
+static void conn_info_destroy(void *ci)
+{
+     gw_free(ci);
+}
+
+/* Count a request against its connection; returns 1 if it should be the last one */
+static int conn_track(HTTPClient *client)
+{
+     Octstr *key = octstr_format("%p", client);
+     struct conn_info *ci;
+     int last = 0;
+
+     mutex_lock(conn_lock);
+     if ((ci = dict_get(conn_dict, key)) == NULL) {
+          ci = gw_malloc(sizeof *ci);
+          ci->requests = 0;
+          dict_put(conn_dict, key, ci);
+          stats_incr(st_connections);
+          if (config.use_ssl)
+               stats_incr(st_handshakes);
+     }
+     ci->requests++;
+     ci->last_seen = time(NULL);
+     if (config.max_keepalive_requests > 0 && ci->requests >= config.max_keepalive_requests) {
+          dict_remove(conn_dict, key);
+          last = 1;
+     }
+     mutex_unlock(conn_lock);
+     octstr_destroy(key);
+     return last;
+}
+
+/* Forget connections gwlib will have timed out by now */
+static void conn_prune(void)
+{
+     List *keys;
+     Octstr *key;
+     time_t cutoff = time(NULL) - config.keepalive_timeout;
+
+     mutex_lock(conn_lock);
+     keys = dict_keys(conn_dict);
+     while ((key = gwlist_extract_first(keys)) != NULL) {
+          struct conn_info *ci = dict_get(conn_dict, key);
+
+          if (ci && ci->last_seen < cutoff)
+               dict_remove(conn_dict, key);
+          octstr_destroy(key);
+     }
+     mutex_unlock(conn_lock);
+     gwlist_destroy(keys, NULL);
+}
+
+static void register_stats(void)
+{
+     int i;
+
+     st_accepted = stats_counter("ingest.accepted");
+     st_drained = stats_counter("ingest.refused_draining");
+     st_rejected = stats_counter("ingest.rejected");
+     st_queue_wait = stats_timer("ingest.queue_wait");
+     st_parse = stats_timer("ingest.parse");
+     st_handle = stats_timer("ingest.handle");
+     st_roundtrips = stats_sample("ingest.db_roundtrips");
+     st_body_bytes = stats_sample("ingest.body_bytes");
+     st_copied = stats_sample("ingest.bytes_copied");
+     stats_gauge("ingest.queue", stats_list_len, server_req_list);
+     stats_gauge("ingest.inflight", inflight_count, NULL);
+     st_connections = stats_counter("ingest.connections");
+     st_handshakes = stats_counter("ingest.tls_handshakes");
+     st_duplicates = stats_counter("ingest.duplicates");
+     st_superseded = stats_counter("ingest.superseded");
+     stats_gauge("ingest.connections_open", open_connections, NULL);
+     stats_gauge("uptime", uptime, NULL); /* to turn the counters into rates */
+     st_shed = stats_counter("ingest.shed");
+     stats_gauge("ingest.drain_rate", drain_rate_gauge, NULL);
+     for (i = 0; i < NELEMS(uri_funcs); i++) {
+          char name[64];
+
+          if (uri_funcs[i].admission_limit == NULL)
+               continue;
+          sprintf(name, "route.%s.pending", uri_funcs[i].uri + 1);
+          stats_gauge(name, counter_gauge, route_pending[i]);
+          sprintf(name, "route.%s.shed", uri_funcs[i].uri + 1);
+          st_route_shed[i] = stats_counter(name);
+     }
+}
+
+/* Smoothed rate at which dispatch_processor gets through requests */
+static void update_drain_rate(void)
+{
+     static double last;
+     static unsigned long last_handled;
+     double now = stats_now();
+     unsigned long n = counter_value(handled);
+
+     if (now - last < 1)
+          return;
+     if (last > 0)
+          drain_rate = 0.7 * drain_rate + 0.3 * (n - last_handled) / (now - last);
+     last = now;
+     last_handled = n;
+}
+
+static long retry_after(long pending)
+{
+     double rate = drain_rate > 1 ? drain_rate : 1;
+     long secs = (long)(pending / rate) + 1;
+
+     return secs > MAX_RETRY_AFTER ? MAX_RETRY_AFTER : secs;
+}
+
+/* Whether a request for this route would overfill the hand-off queue or the route's
+ * own share of it. Returns the Retry-After to answer with, 0 to admit it. */
+static long over_capacity(int route)
+{
+     long queued = gwlist_len(server_req_list), pending;
+     int limit;
+
+     if (route >= 0 && uri_funcs[route].admission_limit == NULL) {
+          if ((pending = counter_value(route_pending[route])) < MAX_UNSHED_PENDING)
+               return 0;
+          stats_incr(st_route_shed[route]);
+          return retry_after(pending);
+     }
+     if (queued >= config.max_ingest_queue)
+          return retry_after(queued);
+     if (route < 0 || (limit = *uri_funcs[route].admission_limit) <= 0)
+          return 0;
+     if ((pending = counter_value(route_pending[route])) >= limit) {
+          stats_incr(st_route_shed[route]);
+          return retry_after(pending);
+     }
+     return 0;
+}
+
+static void refuse(HTTPClient *client, long retry_after, char *msg)
+{
+     List *xh = http_create_empty_headers();
+     char buf[32];
+
+     sprintf(buf, "%ld", retry_after);
+     http_header_add(xh, "Retry-After", buf);
+     http_header_add(xh, "Connection", "close");
+     http_send_reply(client, HTTP_SERVICE_UNAVAILABLE, xh, octstr_imm(msg));
+     http_destroy_headers(xh);
+}
+
+/* Connection handling only: anything that may be slow happens in dispatch_processor */
+static void acceptor(void *unused)
+{
+    List *rh = NULL, *cgivars = NULL;
+    Octstr *ip = NULL, *url = NULL, *body = NULL;
+    HTTPClient *client = NULL;
+
+    while (!stop && (client = http_accept_request(config.http_port, &ip, &url, &rh, &body, &cgivars)) != NULL)
+    {
+        struct HTTPData *x;
+        int route = uri2route(url);
+        long retry;
+
+        if (draining || (retry = over_capacity(route)) > 0) {
+            if (draining) {
+                /* got in just before the port closed: the retry reaches our successor */
+                refuse(client, 5, "Shutting down");
+                stats_incr(st_drained);
+            } else {
+                refuse(client, retry, "Overloaded, try again later");
+                stats_incr(st_shed);
+            }
+
+            octstr_destroy(body);
+            octstr_destroy(url);
+            octstr_destroy(ip);
+            http_destroy_cgiargs(cgivars);
+            http_destroy_headers(rh);
+            continue;
+        }
+        x = gw_malloc(sizeof *x);
+        memset(x, 0, sizeof *x);
+        x->url = url;
+        x->client = client;
+        x->ip = ip;
+        x->body = body;
+        x->reqh = rh;
+        x->query_args = cgivars;
+        x->accepted = stats_now();
+        x->close_conn = conn_track(client);
+        x->route = route;
+
+        stats_incr(st_accepted);
+        counter_increase(inflight);
+        if (route >= 0)
+            counter_increase(route_pending[route]);
+        gwlist_produce(server_req_list, x);
+    }
+}
+
+static void reload(void)
+{
+     FILE *f;
+     int i;
+
+     warning(0, "SIGHUP received, re-opening logs and reloading %s", conffile);
+     log_reopen();
+     alog_reopen();
+
+     if ((f = fopen(conffile, "r")) == NULL) {
+          error(errno, "Reload: could not open %s, keeping current settings", conffile);
+          return;
+     }
+     if (reload_conf(f, &config) < 0)
+          error(0, "Reload: could not parse %s, keeping current settings", conffile);
+     fclose(f);
+
+     for (i = num_dispatchers; i < config.num_threads; i++)
+          gwthread_create((gwthread_func_t *) dispatch_processor, server_req_list);
+     for (i = config.num_threads; i < num_dispatchers; i++)
+          gwlist_produce(server_req_list, &retire_dispatcher);
+     num_dispatchers = config.num_threads;
+     dbpool_resize();
+     resize_request_processor(config.num_threads);
+}
+
+/* Release the port straight away, so that a successor can bind it while we let what
+ * we have finish */
+static void drain(void)
+{
+     double deadline = time(NULL) + config.drain_timeout;
+
+     draining = 1;
      stop = 1;
      if (config.http_port > 0)
           http_close_port(config.http_port);
+     info(0, "Draining: %lu request(s) in flight, waiting up to %.0fs",
+               counter_value(inflight), config.drain_timeout);
+     while (counter_value(inflight) > 0 && time(NULL) < deadline)
+          gwthread_sleep(0.1);
+     if (counter_value(inflight) > 0)
+          warning(0, "Drain timeout: abandoning %lu request(s)", counter_value(inflight));
 }
 
-static void reopen_logs(int unused)
+static void housekeeping(void *unused)
 {
-     warning(0, "SIGHUP received, catching and re-opening logs");
-     log_reopen();
-     alog_reopen();
+     time_t last_prune = time(NULL);
+
+     while (!stop) {
+          update_drain_rate();
+          if (time(NULL) - last_prune >= 10) {
+               conn_prune();
+               last_prune = time(NULL);
+          }
+          if (drain_requested) {
+               drain();
+               break;
+          }
+          if (reload_requested) {
+               reload_requested = 0;
+               reload();
+          }
+          gwthread_sleep(0.5); /* signal handlers can't wake us, so poll */
+     }
 }
 
-static List *server_req_list;
+/* Keep trying to bind the port until the instance we are replacing releases it, which
+ * it does before draining */
+static int open_port_takeover(void)
+{
+     FILE *f;
+     long oldpid = 0;
+     double deadline = time(NULL) + config.drain_timeout + 5;
+
+     if ((f = fopen(pidfile, "r")) != NULL) {
+          if (fscanf(f, "%ld", &oldpid) != 1)
+               oldpid = 0;
+          fclose(f);
+     }
+     if (oldpid > 0 && oldpid != getpid() && kill(oldpid, SIGUSR1) == 0)
+          info(0, "Takeover: asked process %ld to drain and release port %d", oldpid, config.http_port);
+     else
+          warning(0, "Takeover: no running instance found via %s", pidfile);
+
+     while (http_open_port(config.http_port, config.use_ssl) < 0) {
+          if (time(NULL) > deadline)
+               return -1;
+          gwthread_sleep(0.1);
+     }
+     return 0;
+}
 
+#ifndef DISPATCHER2_BENCH /* d2bench links this file for uri2handler() */
 int main(int argc, char *argv[])
 {
-    List *rh = NULL, *cgivars = NULL;
-    Octstr *ip = NULL, *url = NULL, *body = NULL;
     int i;
-    HTTPClient *client = NULL;
 
     gwlib_init();
+    stats_init();
+    db_init();
 
     printf("Dispatcher2 v%s (Build %s).\n"
             "(c) 2016, GoodCitizen Co. Ltd, All Rights Reserved.\n",
@@ -293,32 +731,56 @@ int main(int argc, char *argv[])
           } else
                usage(-1);
      }
+     d2log_init(&config);
 
 
-    if (http_open_port(config.http_port, config.use_ssl) < 0)
+    /* On takeover the port is only opened once everything else is ready */
+    if (!takeover && http_open_port(config.http_port, config.use_ssl) < 0)
         panic(0,"Dispatcher2 Failed to open port %d: %s!", config.http_port, strerror(errno));
 
-    info(0, "started http port - use-ssl:%d", config.use_ssl);
-
-
     if (dispatcher2_init(config.dbuser, config.dbpass, config.dbname, config.dbhost, config.dbport) < 0)
           panic(0, "Initialisation failed! Perhaps no DB conn?");
 
     server_req_list = gwlist_create();
     gwlist_add_producer(server_req_list);
-
+    inflight = counter_create();
+    handled = counter_create();
+    for (i = 0; i < NELEMS(uri_funcs); i++)
+        route_pending[i] = counter_create();
+    conn_dict = dict_create(1024, conn_info_destroy);
+    conn_lock = mutex_create();
+    started = time(NULL);
+    register_stats();
+
+    dbpool_init(&config);
+    ratelimit_init(&config);
+    start_cluster(&config);
     start_request_processor(&config, server_req_list);
+    dedup_init(&config);
+    if (seglog_init(&config) < 0)
+        error(0, "Segment log not usable, queueing everything in the database");
+    smssender_init(&config);
 
     /*We start processor threads to handle the HTTP request we get*/
     for(i = 0; i < config.num_threads; i++)
         gwthread_create((gwthread_func_t *) dispatch_processor, server_req_list);
+    num_dispatchers = config.num_threads;
 
 
-    signal(SIGHUP, reopen_logs);
+    signal(SIGHUP, reload_now);
     signal(SIGTERM, quit_now);
     signal(SIGINT, quit_now);
+    signal(SIGUSR1, quit_now); /* a new instance is taking over */
     signal(SIGPIPE, SIG_IGN); /* Ignore piping us*/
 
+    if (takeover && open_port_takeover() < 0)
+        panic(0,"Dispatcher2 Failed to take over port %d", config.http_port);
+#ifdef HAVE_HTTP_SET_SERVER_TIMEOUT
+    http_set_server_timeout(config.http_port, config.keepalive_timeout);
+#endif
+    info(0, "started http port - use-ssl:%d keepalive-timeout:%d", config.use_ssl, config.keepalive_timeout);
+    gwthread_create(housekeeping, NULL);
+
 
     /* Deal with PID file issues */
      {
@@ -329,69 +791,71 @@ int main(int argc, char *argv[])
           }
      }
 
-    info(0, "Entering Processing loop");
-    while (!stop && (client = http_accept_request(config.http_port, &ip, &url, &rh, &body, &cgivars)) != NULL)
-    {
-        struct HTTPData *x;
-        List *cgi_ctypes = NULL;
-        int tparse = parse_cgivars(rh, body, &cgivars, &cgi_ctypes);
-
-        info(0,"dispatcher2 Incoming Request [IP = %s] [URI=%s] :: %d",octstr_get_cstr(ip), octstr_get_cstr(url), tparse);
-
-        if (tparse == 0 && url && supporteduri(url)) {
-            x = gw_malloc(sizeof *x);
-            memset(x, 0, sizeof *x);
-            x->url = url;
-            x->client = client;
-            x->ip = ip;
-            x->body = body;
-            x->reqh = rh;
-            x->cgivars = cgivars;
-            x->cgi_ctypes = cgi_ctypes;
-
-            gwlist_produce(server_req_list, x);
-        } else {
-            info(0, "We're gonna close things!");
-            http_close_client(client); /* silently close things. */
-
-            octstr_destroy(body);
-            octstr_destroy(url);
-            octstr_destroy(ip);
-            http_destroy_cgiargs(cgivars);
-            http_destroy_cgiargs(cgi_ctypes);
-            http_destroy_headers(rh);
-        }
-    }
+    info(0, "Entering Processing loop with %d acceptor(s)", config.acceptor_threads);
+    for (i = 0; i < config.acceptor_threads; i++)
+        gwthread_create(acceptor, NULL);
+    gwthread_join_every(acceptor);
 
-    stop_request_processor();
+    stop = 1; /* in case we got here some other way than drain() */
+    gwthread_join_every(housekeeping); /* drain() waits for what is in flight */
 
+    /* The dispatchers look servers up in the request processor's config, so they go first */
     gwlist_remove_producer(server_req_list);
     gwthread_join_every((void *)dispatch_processor);
+    stop_request_processor();
+    stop_cluster();
+    smssender_shutdown();
+    ratelimit_shutdown();
+    seglog_shutdown();
+    dedup_shutdown();
+    dbpool_shutdown();
     info(0, "dispatcher shutdown complete");
 
     gwlist_destroy(server_req_list, NULL);
+    counter_destroy(inflight);
+    counter_destroy(handled);
+    for (i = 0; i < NELEMS(uri_funcs); i++)
+        counter_destroy(route_pending[i]);
+    dict_destroy(conn_dict);
+    mutex_destroy(conn_lock);
+    d2log_shutdown();
+    stats_shutdown();
+
+     /* Quit, but leave the pid file alone if a successor has already written its own */
+     {
+          FILE *f = fopen(pidfile, "r");
+          long pid = 0;
 
+          if (f) {
+               if (fscanf(f, "%ld", &pid) != 1)
+                    pid = 0;
+               fclose(f);
+          }
+          if (pid == getpid())
+               unlink(pidfile);
+     }
 
     gwlib_shutdown();
     xmlCleanupParser();
-     unlink(pidfile); /* Quit */
     return 0;
 }       /* ----------  end of function main  ---------- */
+#endif
 
-static request_handler_t uri2handler(Octstr *uri) {
+static int uri2route(Octstr *uri) {
     int i;
-    for(i = 0; i<NELEMS(uri_funcs); i++)
+    for(i = 0; uri && i<NELEMS(uri_funcs); i++)
         if (octstr_str_case_compare(uri, uri_funcs[i].uri) == 0)
-            return uri_funcs[i].func;
-    return NULL;
+            return i;
+    return -1;
+}
+
+request_handler_t uri2handler(Octstr *uri) {
+    int i = uri2route(uri);
+    return i >= 0 ? uri_funcs[i].func : NULL;
 }
 
 static int supporteduri(Octstr *uri){
-    int i;
-    for(i =0; i<NELEMS(uri_funcs); i++)
-        if (octstr_str_case_compare(uri, uri_funcs[i].uri) == 0)
-            return 1;
-    return 0;
+    return uri2route(uri) >= 0;
 }
 
 static void dispatch_request(struct HTTPData  *x) {
@@ -409,6 +873,8 @@ static void dispatch_request(struct HTTPData  *x) {
     }
 
     http_header_add(rh, "Server", "Dispatcher2");
+    if (x->close_conn)
+        http_header_add(rh, "Connection", "close"); /* max-keepalive-requests reached */
     if (x->client != NULL)
         http_send_reply(x->client, status, rh, rbody);
 
@@ -425,44 +891,70 @@ void free_HTTPData(struct HTTPData *x, int free_enclosed)
 
      if (x->reqh)
           http_destroy_headers(x->reqh);
-     if (x->cgivars)
-          http_destroy_cgiargs(x->cgivars);
-     http_destroy_cgiargs(x->cgi_ctypes);
+     if (x->query_args)
+          http_destroy_cgiargs(x->query_args);
+     cgi_destroy(x->cgivars);
+     cgi_destroy(x->cgi_ctypes);
 
      if (free_enclosed)
           gw_free(x);
 }
 
+/* Done with a request: give back its place in the queue */
+static void release(struct HTTPData *x)
+{
+    if (x->route >= 0)
+        counter_decrease(route_pending[x->route]);
+    counter_increase(handled);
+    counter_decrease(inflight);
+    free_HTTPData(x, 1);
+}
+
 static void dispatch_processor(void *data)
 {
     struct HTTPData *x;
     List *req_list = (List *)data;
-    char port[32];
-    PGconn *c; /*= PQconnectdb(config.db_conninfo);*/
-
-     sprintf(port, "%d", config.dbport);
-     c = PQsetdbLogin(config.dbhost, config.dbport > 0 ? port : NULL, NULL, NULL,
-                      config.dbname, config.dbuser, config.dbpass);
-
-    if (PQstatus(c) != CONNECTION_OK) {
-        error(0, "Failed to connect to database: %s",
-                PQerrorMessage(c));
-        PQfinish(c);
-        c = NULL;
-    }
 
     while ((x = gwlist_consume(req_list)) != NULL) {
-        x->dbconn = c;
-        if (c) {
-            PGresult *r = PQexec(c, "BEGIN;"); /*transactionize*/
-            PQclear(r);
+        double t;
+        int tparse;
+
+        if (x == &retire_dispatcher)
+            break;
+        t = stats_now();
+        stats_time(st_queue_wait, t - x->accepted);
+
+        copied_bytes_reset();
+        x->cgivars = cgi_create();
+        x->cgi_ctypes = cgi_create();
+        cgi_add_list(x->cgivars, x->query_args);
+        x->query_args = NULL;
+        tparse = parse_cgivars(x->reqh, x->body, x->cgivars, x->cgi_ctypes);
+        stats_time(st_parse, stats_now() - t);
+        d2log_info("dispatcher2 Incoming Request [IP = %s] [URI=%s] :: %d",
+                octstr_get_cstr(x->ip), octstr_get_cstr(x->url), tparse);
+
+        if (tparse != 0 || x->url == NULL || !supporteduri(x->url)) {
+            d2log_info("We're gonna close things!");
+            http_close_client(x->client); /* silently close things. */
+            stats_incr(st_rejected);
+            release(x);
+            continue;
         }
+
+        t = stats_now();
+        /* NULL if the database is down: handlers answer ERR002 */
+        x->dbconn = dbpool_get(DB_POOL_INGEST);
+        /* Handlers make single statement changes, so they run in autocommit
+         * rather than paying two more round trips for BEGIN and COMMIT */
+        db_roundtrips_reset();
         dispatch_request(x);
-        if (c) {
-            PGresult *r = PQexec(c, "COMMIT");
-            PQclear(r);
-        }
+        dbpool_put(DB_POOL_INGEST, x->dbconn);
+        x->dbconn = NULL;
+        stats_time(st_handle, stats_now() - t);
+        stats_record(st_roundtrips, db_roundtrips());
+        stats_record(st_body_bytes, x->body ? octstr_len(x->body) : 0);
+        stats_record(st_copied, copied_bytes());
+        release(x);
     }
-    if (c != NULL)
-        PQfinish(c);
 }
@@ -21,18 +21,27 @@
 
 #include "gwlib/gwlib.h"
 #include <libpq-fe.h>
+#include "cgi.h"
 
 struct HTTPData {
     Octstr *url;
     HTTPClient *client;
     Octstr *body;
-    List *cgivars;
-    List *cgi_ctypes;
+    List *query_args; /* as gwlib hands them over; moved into cgivars before parsing */
+    cgi_t *cgivars;
+    cgi_t *cgi_ctypes;
     Octstr *ip;
     List *reqh;
     PGconn *dbconn;
+    double accepted; /* stats_now() when the acceptor queued it */
+    int close_conn; /* last request we take on this connection */
+    int route; /* index into the handler table, -1 if the URL has none */
 };
 
+/*URLs and their handlers*/
+typedef const char *(*request_handler_t)(List *rh, struct HTTPData *x, Octstr *rbody, int *status);
+
+request_handler_t uri2handler(Octstr *uri);
 void free_HTTPData(struct HTTPData *x, int free_enclosed);
 void usage(int exit_status);
 int decode_switches(int argc, char *argv[]);
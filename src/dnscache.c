@@ -0,0 +1,254 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dnscache.c
+ *
+ *    Description:  Shared cache of destination host addresses. Entries live for the
+ *                  DNS TTL (read with res_nsearch where available, else a fixed TTL
+ *                  over getaddrinfo). Once expired they are still served while one
+ *                  background thread refreshes them; if the refresh fails the old
+ *                  addresses stay in use for up to DNSCACHE_MAX_STALE.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 16:10:27
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include "dispatcher2-config.h"
+#include <gwlib/gwlib.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_RES_NSEARCH
+#include <arpa/nameser.h>
+#include <resolv.h>
+#endif
+
+#include "dnscache.h"
+#include "stats.h"
+
+#define DNSCACHE_DEFAULT_TTL 60 /* when the resolver doesn't tell us */
+#define DNSCACHE_MIN_TTL 5
+#define DNSCACHE_MAX_TTL 3600
+#define DNSCACHE_MAX_STALE 3600 /* past expiry, while refreshes keep failing */
+
+struct dnsentry {
+    struct sockaddr_storage addrs[DNSCACHE_MAX_ADDRS];
+    int n;
+    time_t expires;
+    int refreshing;
+};
+
+static Dict *cache; /* host -> struct dnsentry */
+static Mutex *cache_lock;
+static List *refresh_list; /* of Octstr host */
+static long refresh_th = -1;
+
+static stat_t *st_hits, *st_stale, *st_misses, *st_failures, *st_resolve;
+
+#ifdef HAVE_RES_NSEARCH
+/* Append the A or AAAA answers for host; *ttl is lowered to the smallest TTL seen */
+static void query(const char *host, int type, struct sockaddr_storage *addrs, int *n, long *ttl)
+{
+    struct __res_state rs;
+    unsigned char ans[4096];
+    ns_msg msg;
+    ns_rr rr;
+    int len, i, count;
+
+    memset(&rs, 0, sizeof rs);
+    if (res_ninit(&rs) != 0)
+        return;
+    len = res_nsearch(&rs, host, ns_c_in, type, ans, sizeof ans);
+    res_nclose(&rs);
+    if (len < 0 || ns_initparse(ans, len, &msg) < 0)
+        return;
+
+    count = ns_msg_count(msg, ns_s_an);
+    for (i = 0; i < count && *n < DNSCACHE_MAX_ADDRS; i++) {
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+            break;
+        if (*ttl < 0 || ns_rr_ttl(rr) < *ttl)
+            *ttl = ns_rr_ttl(rr); /* CNAMEs in the chain count too */
+
+        if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[*n];
+
+            memset(sin, 0, sizeof *sin);
+            sin->sin_family = AF_INET;
+            memcpy(&sin->sin_addr, ns_rr_rdata(rr), 4);
+            (*n)++;
+        } else if (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addrs[*n];
+
+            memset(sin6, 0, sizeof *sin6);
+            sin6->sin6_family = AF_INET6;
+            memcpy(&sin6->sin6_addr, ns_rr_rdata(rr), 16);
+            (*n)++;
+        }
+    }
+}
+#endif
+
+/* Blocking resolution; returns the number of addresses and sets *ttl */
+static int resolve(Octstr *host, struct sockaddr_storage *addrs, long *ttl)
+{
+    struct addrinfo hints, *res, *ai;
+    int n = 0;
+    double t0 = stats_now();
+
+    *ttl = -1;
+#ifdef HAVE_RES_NSEARCH
+    query(octstr_get_cstr(host), ns_t_a, addrs, &n, ttl);
+    query(octstr_get_cstr(host), ns_t_aaaa, addrs, &n, ttl);
+#endif
+    if (n == 0) {
+        /* /etc/hosts, or no TTL-aware resolver */
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(octstr_get_cstr(host), NULL, &hints, &res) == 0) {
+            for (ai = res; ai != NULL && n < DNSCACHE_MAX_ADDRS; ai = ai->ai_next)
+                if (ai->ai_addrlen <= sizeof addrs[0])
+                    memcpy(&addrs[n++], ai->ai_addr, ai->ai_addrlen);
+            freeaddrinfo(res);
+        }
+        *ttl = DNSCACHE_DEFAULT_TTL;
+    }
+    stats_time(st_resolve, stats_now() - t0);
+
+    if (*ttl < DNSCACHE_MIN_TTL)
+        *ttl = DNSCACHE_MIN_TTL;
+    else if (*ttl > DNSCACHE_MAX_TTL)
+        *ttl = DNSCACHE_MAX_TTL;
+    if (n == 0) {
+        stats_incr(st_failures);
+        warning(0, "dnscache: could not resolve %s", octstr_get_cstr(host));
+    }
+    return n;
+}
+
+/* Store a fresh result; a failed refresh keeps the old addresses */
+static void store(Octstr *host, struct sockaddr_storage *addrs, int n, long ttl)
+{
+    struct dnsentry *e;
+
+    mutex_lock(cache_lock);
+    if ((e = dict_get(cache, host)) == NULL && n > 0) {
+        e = gw_malloc(sizeof *e);
+        memset(e, 0, sizeof *e);
+        dict_put(cache, host, e);
+    }
+    if (e) {
+        if (n > 0) {
+            memcpy(e->addrs, addrs, n * sizeof addrs[0]);
+            e->n = n;
+            e->expires = time(NULL) + ttl;
+        }
+        e->refreshing = 0;
+    }
+    mutex_unlock(cache_lock);
+}
+
+static void refresher(void *unused)
+{
+    Octstr *host;
+    struct sockaddr_storage addrs[DNSCACHE_MAX_ADDRS];
+    long ttl;
+    int n;
+
+    while ((host = gwlist_consume(refresh_list)) != NULL) {
+        n = resolve(host, addrs, &ttl);
+        store(host, addrs, n, ttl);
+        octstr_destroy(host);
+    }
+}
+
+static void entry_destroy(void *e)
+{
+    gw_free(e);
+}
+
+void dnscache_init(void)
+{
+    cache = dict_create(31, entry_destroy);
+    cache_lock = mutex_create();
+    refresh_list = gwlist_create();
+    gwlist_add_producer(refresh_list);
+
+    st_hits = stats_counter("dns.hits");
+    st_stale = stats_counter("dns.stale_hits");
+    st_misses = stats_counter("dns.misses");
+    st_failures = stats_counter("dns.failures");
+    st_resolve = stats_timer("dns.resolve");
+
+    refresh_th = gwthread_create(refresher, NULL);
+}
+
+void dnscache_shutdown(void)
+{
+    if (refresh_th < 0)
+        return;
+    gwlist_remove_producer(refresh_list);
+    gwthread_join(refresh_th);
+    refresh_th = -1;
+    gwlist_destroy(refresh_list, octstr_destroy_item);
+    dict_destroy(cache);
+    mutex_destroy(cache_lock);
+}
+
+int dnscache_lookup(Octstr *host, struct sockaddr_storage *addrs, int max)
+{
+    struct sockaddr_storage tmp[DNSCACHE_MAX_ADDRS];
+    struct sockaddr_in *sin = (struct sockaddr_in *)addrs;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addrs;
+    struct dnsentry *e;
+    time_t now = time(NULL);
+    long ttl;
+    int n = 0;
+
+    if (max < 1)
+        return 0;
+    /* Literal addresses need no lookup */
+    memset(addrs, 0, sizeof addrs[0]);
+    if (inet_pton(AF_INET, octstr_get_cstr(host), &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        return 1;
+    } else if (inet_pton(AF_INET6, octstr_get_cstr(host), &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        return 1;
+    }
+
+    mutex_lock(cache_lock);
+    if ((e = dict_get(cache, host)) != NULL && now < e->expires + DNSCACHE_MAX_STALE) {
+        n = e->n < max ? e->n : max;
+        memcpy(addrs, e->addrs, n * sizeof addrs[0]);
+        if (now < e->expires)
+            stats_incr(st_hits);
+        else {
+            stats_incr(st_stale);
+            if (!e->refreshing) {
+                e->refreshing = 1;
+                gwlist_produce(refresh_list, octstr_duplicate(host));
+            }
+        }
+    }
+    mutex_unlock(cache_lock);
+    if (n > 0)
+        return n;
+
+    /* Nothing usable yet: this caller has to wait */
+    stats_incr(st_misses);
+    if ((n = resolve(host, tmp, &ttl)) == 0)
+        return 0;
+    store(host, tmp, n, ttl);
+    if (n > max)
+        n = max;
+    memcpy(addrs, tmp, n * sizeof addrs[0]);
+    return n;
+}
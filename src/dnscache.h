@@ -0,0 +1,34 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dnscache.h
+ *
+ *    Description:  Shared cache of destination host addresses
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 16:04:52
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_DNSCACHE_H
+#define __DISPATCHER2_DNSCACHE_H
+
+#include <gwlib/gwlib.h>
+#include <sys/socket.h>
+
+#define DNSCACHE_MAX_ADDRS 8
+
+void dnscache_init(void);
+void dnscache_shutdown(void);
+
+/* Fill addrs (port left 0) with the addresses of host and return how many, 0 if it
+ * can't be resolved. Expired entries are still returned while a background refresh
+ * runs, so a slow or failing resolver doesn't hold up deliveries. */
+int dnscache_lookup(Octstr *host, struct sockaddr_storage *addrs, int max);
+
+#endif
@@ -3,7 +3,7 @@
  *
  *       Filename:  log.c
  *
- *    Description:
+ *    Description:  Asynchronous logging for the hot paths, see log.h
  *
  *        Version:  1.0
  *        Created:  07/05/2016 17:18:43
@@ -21,8 +21,11 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <pthread.h>
 #include "log.h"
 #include "conf.h"
+#include "stats.h"
 
 int print_debug_messages = 1;
 
@@ -55,3 +58,177 @@ void dispatcher2log(int prio, char *fmt, ...)
     }
 }
 #endif
+
+#define RING_SLOTS 256 /* records per thread */
+#define RECORD_LEN 480
+
+struct record {
+    int level;
+    char msg[RECORD_LEN];
+};
+
+struct ring {
+    struct record r[RING_SLOTS];
+    unsigned long head; /* written only by the owning thread */
+    unsigned long tail; /* written only by the writer */
+    long thread;
+    int free; /* owner has exited; the next new thread takes it over */
+    struct ring *next;
+};
+
+volatile int d2log_level = GW_INFO;
+
+static dispatcher2conf_t lconf;
+static struct ring *rings; /* only ever grows; pushed at the front */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct ring *mine;
+static long writer_th = -1;
+static volatile int lstop = 0;
+static stat_t *st_dropped;
+
+static void ring_release(void *r)
+{
+    __atomic_store_n(&((struct ring *)r)->free, 1, __ATOMIC_RELEASE);
+}
+
+/* This thread's ring: once per thread we take the lock to find or make one */
+static struct ring *my_ring(void)
+{
+    struct ring *r;
+
+    if (mine != NULL)
+        return mine;
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next)
+        if (__atomic_load_n(&r->free, __ATOMIC_ACQUIRE))
+            break;
+    if (r == NULL) {
+        r = gw_malloc(sizeof *r);
+        memset(r, 0, sizeof *r);
+        r->next = rings;
+        __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    }
+    r->free = 0;
+    r->thread = gwthread_self();
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, r);
+    return mine = r;
+}
+
+static void emit(int level, long thread, const char *msg)
+{
+    switch (level) {
+        case GW_DEBUG:
+            debug("dispatcher2", 0, "(%ld) %s", thread, msg);
+            break;
+        case GW_INFO:
+            info(0, "(%ld) %s", thread, msg);
+            break;
+        case GW_WARNING:
+            warning(0, "(%ld) %s", thread, msg);
+            break;
+        default:
+            error(0, "(%ld) %s", thread, msg);
+            break;
+    }
+}
+
+void d2log_record(int level, const char *fmt, ...)
+{
+    struct ring *r;
+    struct record *rec;
+    unsigned long h;
+    va_list ap;
+    int n;
+
+    if (writer_th < 0) {
+        char msg[RECORD_LEN];
+
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof msg, fmt, ap);
+        va_end(ap);
+        emit(level, gwthread_self(), msg);
+        return;
+    }
+    r = my_ring();
+    h = r->head;
+    if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SLOTS) {
+        stats_incr(st_dropped);
+        return;
+    }
+    rec = &r->r[h % RING_SLOTS];
+    rec->level = level;
+    va_start(ap, fmt);
+    n = vsnprintf(rec->msg, sizeof rec->msg, fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof rec->msg)
+        strcpy(rec->msg + sizeof rec->msg - 4, "...");
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+void d2log_body(const char *label, Octstr *body)
+{
+    long len, n;
+
+    if (!d2log_enabled(GW_DEBUG) || lconf == NULL || lconf->log_body_bytes <= 0 || body == NULL)
+        return;
+    len = octstr_len(body);
+    n = len < lconf->log_body_bytes ? len : lconf->log_body_bytes;
+    d2log_record(GW_DEBUG, "%s (%ld bytes): %.*s%s", label, len, (int)n,
+            octstr_get_cstr(body), n < len ? "..." : "");
+}
+
+/* Write out everything buffered; returns how many records that was */
+static long drain(void)
+{
+    struct ring *r;
+    long n = 0;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        unsigned long t = r->tail, h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        for (; t != h; t++, n++) {
+            struct record *rec = &r->r[t % RING_SLOTS];
+
+            emit(rec->level, r->thread, rec->msg);
+        }
+        __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static void writer(void *unused)
+{
+    while (!lstop)
+        if (drain() == 0)
+            gwthread_sleep(0.05);
+    drain();
+}
+
+void d2log_set_level(int level)
+{
+    d2log_level = level;
+}
+
+void d2log_init(dispatcher2conf_t config)
+{
+    lconf = config;
+    d2log_level = config->loglevel;
+    st_dropped = stats_counter("log.dropped");
+    pthread_key_create(&ring_key, ring_release);
+    lstop = 0;
+    writer_th = gwthread_create(writer, NULL);
+}
+
+void d2log_shutdown(void)
+{
+    long th = writer_th;
+
+    if (th < 0)
+        return;
+    writer_th = -1; /* from here on, callers write synchronously */
+    lstop = 1;
+    gwthread_wakeup(th);
+    gwthread_join(th);
+}
@@ -3,7 +3,12 @@
  *
  *       Filename:  log.h
  *
- *    Description:
+ *    Description:  Logging for the hot paths. d2log_info() and friends check the level
+ *                  before formatting anything, format into the calling thread's own
+ *                  ring buffer without taking a lock, and a writer thread passes the
+ *                  records on to gwlib's log. Records that don't fit are counted in
+ *                  log.dropped rather than waited for. Warnings and errors still go
+ *                  straight to gwlib so that they are written even if we die next.
  *
  *        Version:  1.0
  *        Created:  07/05/2016 17:17:00
@@ -19,7 +24,27 @@
 #define __HAVE_DISPATCHER2LOG_H__
 
 #include <syslog.h>
+#include "gwlib/gwlib.h"
+#include "conf.h"
 
+extern volatile int d2log_level; /* an enum output_level; lower is chattier */
+
+#define d2log_enabled(level) ((level) >= d2log_level)
+#define d2log(level, ...) \
+    do { if (d2log_enabled(level)) d2log_record(level, __VA_ARGS__); } while (0)
+#define d2log_debug(...) d2log(GW_DEBUG, __VA_ARGS__)
+#define d2log_info(...) d2log(GW_INFO, __VA_ARGS__)
+
+/* Starts the writer thread; until then records are written synchronously */
+void d2log_init(dispatcher2conf_t config);
+/* Writes out what is buffered and stops the writer */
+void d2log_shutdown(void);
+void d2log_set_level(int level);
+
+void d2log_record(int level, const char *fmt, ...) PRINTFLIKE(2,3);
+
+/* Logs at most log-body-bytes of a request or response body, at debug level only */
+void d2log_body(const char *label, Octstr *body);
 
 extern int print_debug_messages;
 #if 0
@@ -17,8 +17,23 @@
  */
 #include <ctype.h>
 #include "misc.h"
+#include "log.h"
+#include "db.h"
+#include "dedup.h"
 #include "gwlib/mime.h"
 
+static __thread long copied;
+
+void copied_bytes_reset(void)
+{
+    copied = 0;
+}
+
+long copied_bytes(void)
+{
+    return copied;
+}
+
 int dispatcher2_init(char *dbuser, char *dbpass, char *dbname, char *host, int port)
 {
      PGconn *c;
@@ -61,8 +76,7 @@ int auth_user(PGconn *c, char *user, char *pass)
     PGresult *r;
     const char *pvals[] = {user, pass};
 
-    r = PQexecParams(c, "SELECT id FROM users WHERE username = $1 AND "
-            "crypt($2, password) = password", 2, NULL, pvals, NULL, NULL, 0);
+    r = db_run(c, DB_AUTH_USER, pvals, NULL, NULL);
     if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0 ) {
         ret = 0;
     } else
@@ -71,79 +85,114 @@ int auth_user(PGconn *c, char *user, char *pass)
     return ret;
 }
 
-int ba_auth_user(PGconn *c, List *rh){
+/* Pulls username and password out of a Basic Authorization header, in one pass over it */
+int ba_credentials(List *rh, Octstr **user, Octstr **pass)
+{
     int ret = -1;
     Octstr *p;
-    List *q = NULL, *logins = NULL;
-    p = http_header_value(rh, octstr_imm("Authorization"));
+    const char *s, *end, *colon;
+    char buf[256], *out;
+    long n;
 
-    info(0, "The auth header is: %s", octstr_get_cstr(p));
+    *user = *pass = NULL;
+    p = http_header_value(rh, octstr_imm("Authorization"));
     if (!p)
         return -1;
-    q = octstr_split_words(p);
-    if (q != NULL && gwlist_len(q) == 2) {
-        Octstr *u = gwlist_get(q, 1);
-        if (u) {
-            octstr_base64_to_binary(u);
-            logins = octstr_split(u, octstr_imm(":"));
-            /* info(0, "The logins are %s", octstr_get_cstr(u));*/
-            if (logins && gwlist_len(logins) == 2) {
-                ret = auth_user(c, octstr_get_cstr(gwlist_get(logins, 0)),
-                        octstr_get_cstr(gwlist_get(logins, 1)));
-            }
+    s = octstr_get_cstr(p);
+    end = s + octstr_len(p);
+    while (s < end && isspace((unsigned char)*s))
+        s++;
+    while (end > s && isspace((unsigned char)end[-1]))
+        end--;
+    if (end - s > 6 && strncasecmp(s, "Basic", 5) == 0 && isspace((unsigned char)s[5])) {
+        for (s += 6; s < end && isspace((unsigned char)*s); s++)
+            ;
+        out = 3 * (end - s) / 4 + 1 <= sizeof buf ? buf : gw_malloc(3 * (end - s) / 4 + 1);
+        /* the password may itself contain ':', the user-id may not */
+        if ((n = cgi_base64_decode(s, end - s, out)) > 0 && (colon = memchr(out, ':', n)) != NULL) {
+            *user = octstr_create_from_data(out, colon - out);
+            *pass = octstr_create_from_data(colon + 1, n - (colon - out) - 1);
+            ret = 0;
         }
-        octstr_destroy(u);
-        gwlist_destroy(q, NULL);
-        gwlist_destroy(logins, NULL);
+        if (out != buf)
+            gw_free(out);
     }
+    octstr_destroy(p);
     return ret;
 }
 
-int64_t save_request(PGconn *c, request_t *req, dispatcher2conf_t config)
-{
-    char buf1[128];
-    char buf2[128];
-    char buf3[128];
-    char buf4[128];
-
-    const char *pvals[16];
-    int plens[16] = {0};
-    int pfrmt[16] = {0};
-    int64_t xid = -1;
-
-    sprintf(buf1, "%d", req->source);
-    sprintf(buf2, "%d", req->destination);
-    pvals[0] = buf1;
-    pvals[1] = buf2;
-
-    pvals[2] = req->payload ? octstr_get_cstr(req->payload) : "";
-    pfrmt[2] = 1;
-    plens[2] = octstr_len(req->payload);
+int ba_auth_user(PGconn *c, List *rh){
+    int ret = -1;
+    Octstr *user, *pass;
 
-    pvals[3] = req->ctype ? octstr_get_cstr(req->ctype) : "";
+    if (ba_credentials(rh, &user, &pass) == 0) {
+        d2log_info("The auth header is for user: %s", octstr_get_cstr(user));
+        ret = auth_user(c, octstr_get_cstr(user), octstr_get_cstr(pass));
+    }
+    octstr_destroy(user);
+    octstr_destroy(pass);
+    return ret;
+}
 
-    sprintf(buf3, "%ld", req->msgid);
-    pvals[4] = buf3;
+/* Marshals a request into INSERT parameters. Returns the parameter count. */
+int request_to_params(request_t *req, dispatcher2conf_t config, struct request_params *p)
+{
+    memset(p->plens, 0, sizeof p->plens);
+    memset(p->pfrmt, 0, sizeof p->pfrmt);
+
+    sprintf(p->buf[0], "%d", req->source);
+    sprintf(p->buf[1], "%d", req->destination);
+    p->pvals[0] = p->buf[0];
+    p->pvals[1] = p->buf[1];
+
+    p->pvals[2] = req->payload ? octstr_get_cstr(req->payload) : "";
+    p->pfrmt[2] = 1;
+    p->plens[2] = req->payload ? octstr_len(req->payload) : 0;
+
+    p->pvals[3] = req->ctype ? octstr_get_cstr(req->ctype) : "";
+
+    sprintf(p->buf[2], "%ld", req->msgid);
+    p->pvals[4] = p->buf[2];
+
+    p->pvals[5] = req->week ? octstr_get_cstr(req->week) : "";
+    p->pvals[6] = req->month ? octstr_get_cstr(req->month) : "";
+
+    sprintf(p->buf[3], "%d", req->year);
+    p->pvals[7] = p->buf[3];
+    p->pvals[8] = req->msisdn ? octstr_get_cstr(req->msisdn) : "";
+    p->pvals[9] = req->raw_msg ? octstr_get_cstr(req->raw_msg) : "";
+    p->pvals[10] = req->facility ? octstr_get_cstr(req->facility) : "";
+    p->pvals[11] = req->district ? octstr_get_cstr(req->district) : "";
+    p->pvals[12] = req->report_type ? octstr_get_cstr(req->report_type) : "";
+    p->pvals[13] = config->default_queue_status[0] ? config->default_queue_status : "ready";
+    p->pvals[14] = req->is_qparams ? octstr_get_cstr(req->is_qparams) : "f";
+    sprintf(p->buf[4], "%d", req->priority);
+    p->pvals[15] = p->buf[4];
+    sprintf(p->buf[5], "%.0f", req->deadline);
+    p->pvals[16] = req->deadline > 0 ? p->buf[5] : NULL;
+
+    return 17;
+}
 
-    pvals[5] = req->week ? octstr_get_cstr(req->week) : "";
-    pvals[6] = req->month ? octstr_get_cstr(req->month) : "";
+static long params_len(struct request_params *p, int n)
+{
+    long len = 0;
+    int i;
 
-    sprintf(buf4, "%d", req->year);
-    pvals[7] = buf4;
-    pvals[8] = req->msisdn ? octstr_get_cstr(req->msisdn) : "";
-    pvals[9] = req->raw_msg ? octstr_get_cstr(req->raw_msg) : "";
-    pvals[10] = req->facility ? octstr_get_cstr(req->facility) : "";
-    pvals[11] = req->district ? octstr_get_cstr(req->district) : "";
-    pvals[12] = req->report_type ? octstr_get_cstr(req->report_type) : "";
-    pvals[13] = config->default_queue_status ? config->default_queue_status : "ready";
-    pvals[14] = req->is_qparams ? octstr_get_cstr(req->is_qparams) : "f";
+    for (i = 0; i < n; i++)
+        len += p->pfrmt[i] ? p->plens[i] : strlen(p->pvals[i]);
+    return len;
+}
 
+int64_t save_request(PGconn *c, request_t *req, dispatcher2conf_t config)
+{
+    struct request_params p;
+    int64_t xid = -1;
     PGresult *r;
-    r = PQexecParams(c,
-            "INSERT INTO requests(source, destination, body, ctype, submissionid, week,"
-            "month, year, msisdn, raw_msg, facility, district, report_type, status, body_is_query_param) "
-            "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15) RETURNING id",
-            15, NULL, pvals, plens, pfrmt, 0);
+
+    request_to_params(req, config, &p);
+    copied += params_len(&p, 17); /* libpq builds the whole message before sending it */
+    r = db_run(c, DB_SAVE_REQUEST, p.pvals, p.plens, p.pfrmt);
 
     if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) < 1) {
         error(0, "save_reuest: %s", PQresultErrorMessage(r));
@@ -155,14 +204,46 @@ int64_t save_request(PGconn *c, request_t *req, dispatcher2conf_t config)
     return xid;
 }
 
+/* save_request() with the source and destination servers given by name, looked up
+ * in the same statement rather than with two get_server() calls first */
+int64_t save_request_named(PGconn *c, request_t *req, char *source, char *dest,
+        dispatcher2conf_t config, int *duplicate, long *superseded)
+{
+    struct request_params p;
+    int64_t xid = -1;
+    PGresult *r;
+    char *state;
+
+    request_to_params(req, config, &p);
+    p.pvals[0] = source ? source : "";
+    p.pvals[1] = dest ? dest : "";
+    copied += params_len(&p, 17);
+    r = db_run(c, DB_SAVE_REQUEST_NAMED, p.pvals, p.plens, p.pfrmt);
+
+    *duplicate = 0;
+    *superseded = 0;
+    if ((state = PQresultErrorField(r, PG_DIAG_SQLSTATE)) && strcmp(state, "23505") == 0) {
+        /* unique_violation: requests_submission_idx, this msgid is queued already */
+        *duplicate = 1;
+        xid = dedup_lookup(c, p.pvals[0], req->msgid);
+    } else if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) < 1) {
+        error(0, "save_request: %s", PQresultErrorMessage(r));
+    } else {
+        char *s = PQgetvalue(r, 0,0);
+        xid = s && s[0] ? strtoull(s, NULL, 10) : -1;
+        *superseded = atol(PQgetvalue(r, 0, 1));
+    }
+    PQclear(r);
+    return xid;
+}
+
 int get_server(PGconn *c, char *name)
 {
     int ret = -1;
     PGresult *r;
     const char *pvals[] = {name};
 
-    r = PQexecParams(c, "SELECT id FROM servers WHERE name = $1",
-            1, NULL, pvals, NULL, NULL, 0);
+    r = db_run(c, DB_GET_SERVER, pvals, NULL, NULL);
     if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0) {
         ret = strtoul(PQgetvalue(r, 0, 0), NULL, 10);
     }
@@ -171,60 +252,28 @@ int get_server(PGconn *c, char *name)
 }
 
 int parse_cgivars(List *request_headers, Octstr *request_body,
-        List **cgivars, List **cgivar_ctypes)
+        cgi_t *cgivars, cgi_t *cgivar_ctypes)
 {
     Octstr *ctype = NULL, *charset = NULL;
     int ret = 0;
-    info(0, "request_body = %s", octstr_get_cstr(request_body));
+    d2log_body("request_body", request_body);
     if (request_body == NULL ||
             octstr_len(request_body) == 0 || cgivars == NULL)
         return 0; /* Nothing to do, this is a normal GET request. */
 
     http_header_get_content_type(request_headers, &ctype, &charset);
 
-    if (*cgivars == NULL)
-        *cgivars = gwlist_create();
-
-    if (*cgivar_ctypes == NULL)
-        *cgivar_ctypes = gwlist_create();
-
     if (!ctype) {
         warning(0, "dispatcher2: Parse CGI Vars: Missing Content Type!");
         ret = -1;
         goto done;
     }
-    info(0, "Our content-type is %s", octstr_get_cstr(ctype));
+    d2log_info("Our content-type is %s", octstr_get_cstr(ctype));
 
     if (octstr_case_compare(ctype, octstr_imm("application/x-www-form-urlencoded")) == 0) {
         /* This is a normal POST form */
-        List *l = octstr_split(request_body, octstr_imm("&"));
-        Octstr *v;
-
-        while ((v = gwlist_extract_first(l)) != NULL) {
-            List *r = octstr_split(v, octstr_imm("="));
-
-            if (gwlist_len(r) == 0)
-                warning(0, "dispatcher2: Parse CGI Vars: Missing CGI var name/value in POST data: %s",
-                        octstr_get_cstr(request_body));
-            else {
-                HTTPCGIVar *x = gw_malloc(sizeof *x);
-                x->name =  gwlist_extract_first(r);
-                x->value = gwlist_extract_first(r);
-                if (!x->value)
-                    x->value = octstr_create("");
-
-                octstr_strip_blanks(x->name);
-                octstr_strip_blanks(x->value);
-
-                octstr_url_decode(x->name);
-                octstr_url_decode(x->value);
-
-                gwlist_append(*cgivars, x);
-            }
-            octstr_destroy(v);
-            gwlist_destroy(r, octstr_destroy_item);
-        }
-        gwlist_destroy(l, NULL);
+        cgi_parse_urlencoded(cgivars, request_body);
+        copied += octstr_len(request_body);
     } else if (octstr_case_compare(ctype, octstr_imm("multipart/form-data")) == 0) {
         /* multi-part form data */
         MIMEEntity *m = mime_http_to_entity(request_headers, request_body);
@@ -248,25 +297,20 @@ int parse_cgivars(List *request_headers, Octstr *request_body,
             Octstr *name = http_get_header_parameter(cd, octstr_imm("name"));
 
             if (name) {
-                HTTPCGIVar *x = gw_malloc(sizeof *x);
-
                 /* Strip quotes */
                 if (octstr_get_char(name, 0) == '"') {
                     octstr_delete(name, 0, 1);
                     octstr_truncate(name, octstr_len(name) - 1);
                 }
 
-                x->name = octstr_duplicate(name);
-                x->value = octstr_duplicate(body);
-
-                gwlist_append(*cgivars, x);
+                /* hand over the part rather than copying it again */
+                copied += octstr_len(body); /* mime_entity_body() copies the part */
+                cgi_add(cgivars, octstr_get_cstr(name), octstr_len(name), body);
+                body = NULL;
 
                 if (ct) { /* If the content type is set, use it. */
-                    x = gw_malloc(sizeof *x);
-                    x->name = octstr_duplicate(name);
-                    x->value = octstr_duplicate(ct);
-
-                    gwlist_append(*cgivar_ctypes, x);
+                    cgi_add(cgivar_ctypes, octstr_get_cstr(name), octstr_len(name), ct);
+                    ct = NULL;
                 }
                 octstr_destroy(name);
             }
@@ -281,7 +325,7 @@ int parse_cgivars(List *request_headers, Octstr *request_body,
 
     } else {
         /* else it is nothing that we know about, so simply go away... */
-        info(0, "Unknown content-type: %s", octstr_get_cstr(ctype));
+        d2log_info("Unknown content-type: %s", octstr_get_cstr(ctype));
         ret = 0; /*XXX make it -1 */
     }
 done:
@@ -22,9 +22,11 @@
 #include "gwlib/gwlib.h"
 #include "conf.h"
 #include "dispatcher2-config.h"
+#include "cgi.h"
 
 #include <libpq-fe.h>
 
+/* The Octstrs are borrowed, e.g. from the HTTP request being handled, not owned */
 typedef struct request_t {
     int64_t dbid;
 
@@ -43,9 +45,19 @@ typedef struct request_t {
     Octstr *facility;
     Octstr *district;
     Octstr *report_type;
+    int priority; /* PRIORITY_* */
+    double deadline; /* epoch seconds, 0 = none */
 
 } request_t;
 
+/* INSERT parameters for a request; pvals point into buf or the request itself */
+struct request_params {
+    const char *pvals[17];
+    int plens[17];
+    int pfrmt[17];
+    char buf[6][32];
+};
+
 int dispatcher2_init(char *dbuser, char *dbpass, char *dbname, char *host, int port);
 
 char *strip_space(char x[]);
@@ -54,11 +66,27 @@ int auth_user(PGconn *c, char *user, char *pass);
 
 int ba_auth_user(PGconn *c, List *rh); /* Basic Auth */
 
+int ba_credentials(List *rh, Octstr **user, Octstr **pass);
+
+int request_to_params(request_t *req, dispatcher2conf_t config, struct request_params *p);
+
 int64_t save_request(PGconn *c, request_t *req, dispatcher2conf_t config);
 
+/* Sets *duplicate, and returns the id of the request already queued, if the source
+ * sent this msgid before. *superseded is how many older versions of the report this
+ * one replaced (servers.supersede) */
+int64_t save_request_named(PGconn *c, request_t *req, char *source, char *dest,
+        dispatcher2conf_t config, int *duplicate, long *superseded);
+
 int get_server(PGconn *c, char *name);
 
+/* Adds form fields from a POST body (urlencoded or multipart) to cgivars, and the
+ * content types of multipart fields to cgivar_ctypes */
 int parse_cgivars(List *request_headers, Octstr *request_body,
-        List **cgivars, List **cgivar_ctypes);
+        cgi_t *cgivars, cgi_t *cgivar_ctypes);
+
+/* Payload bytes copied by the calling thread since copied_bytes_reset(), for /stats */
+void copied_bytes_reset(void);
+long copied_bytes(void);
 
 #endif
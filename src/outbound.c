@@ -0,0 +1,648 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  outbound.c
+ *
+ *    Description:  HTTP(S) client for deliveries to destination servers. Each
+ *                  destination gets its own TLS context, built once with the client
+ *                  certificate and key, keeps the last TLS session for resumption and
+ *                  a few idle keep-alive connections. Like gwlib's client as we used it,
+ *                  one redirect is followed (possibly to another host or to https).
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 15:20:31
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include "dispatcher2-config.h"
+#include <gwlib/gwlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_LIBSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "outbound.h"
+#include "dnscache.h"
+#include "stats.h"
+
+#define OUTBOUND_TIMEOUT 60 /* seconds, for connect, send and receive */
+#define OUTBOUND_IDLE_MAX 8 /* idle connections kept per destination */
+#define OUTBOUND_IDLE_TIMEOUT 30 /* don't reuse connections idle longer than this */
+#define OUTBOUND_MAX_REDIRECTS 1
+
+#if defined(HAVE_LIBSSL) && OPENSSL_VERSION_NUMBER < 0x10100000L
+#define TLS_client_method SSLv23_client_method
+#endif
+
+struct obconn {
+    int fd;
+#ifdef HAVE_LIBSSL
+    SSL *ssl;
+#endif
+    time_t last_used;
+    int reused;
+};
+
+struct outbound {
+    Octstr *host;
+    int port;
+    int ssl;
+    Octstr *certkey; /* for a client built to follow a redirect */
+    Mutex *lock; /* idle and session */
+    List *idle; /* of struct obconn, most recently used last */
+#ifdef HAVE_LIBSSL
+    SSL_CTX *ctx;
+    SSL_SESSION *session; /* latest one the server gave us */
+#endif
+};
+
+static stat_t *st_connect, *st_handshake, *st_request;
+static stat_t *st_full, *st_resumed, *st_reused, *st_failed;
+
+void outbound_init(void)
+{
+    st_connect = stats_timer("outbound.connect");
+    st_handshake = stats_timer("outbound.tls_handshake");
+    st_request = stats_timer("outbound.request"); /* excludes connect and handshake */
+    st_full = stats_counter("outbound.tls_full_handshakes");
+    st_resumed = stats_counter("outbound.tls_resumed");
+    st_reused = stats_counter("outbound.connections_reused");
+    st_failed = stats_counter("outbound.failed");
+}
+
+/* Split http[s]://host[:port][/path][?query], host possibly an [IPv6 address]. path
+ * always starts with '/' */
+static int parse_url(Octstr *url, Octstr **host, int *port, Octstr **path, int *ssl)
+{
+    long hstart, pstart, q, colon, rb;
+    Octstr *hostport;
+
+    if (octstr_case_search(url, octstr_imm("https://"), 0) == 0) {
+        *ssl = 1;
+        hstart = 8;
+    } else if (octstr_case_search(url, octstr_imm("http://"), 0) == 0) {
+        *ssl = 0;
+        hstart = 7;
+    } else
+        return -1;
+
+    if ((pstart = octstr_search_char(url, '/', hstart)) < 0)
+        pstart = octstr_len(url);
+    if ((q = octstr_search_char(url, '?', hstart)) >= 0 && q < pstart)
+        pstart = q;
+    if (pstart == hstart)
+        return -1;
+
+    hostport = octstr_copy(url, hstart, pstart - hstart);
+    if (octstr_get_char(hostport, 0) == '[') {
+        if ((rb = octstr_search_char(hostport, ']', 0)) < 0) {
+            octstr_destroy(hostport);
+            return -1;
+        }
+        *host = octstr_copy(hostport, 1, rb - 1);
+        colon = octstr_get_char(hostport, rb + 1) == ':' ? rb + 1 : -1;
+    } else {
+        colon = octstr_search_char(hostport, ':', 0);
+        *host = octstr_copy(hostport, 0, colon >= 0 ? colon : octstr_len(hostport));
+    }
+    *port = colon >= 0 ? atoi(octstr_get_cstr(hostport) + colon + 1) : (*ssl ? 443 : 80);
+    octstr_destroy(hostport);
+
+    *path = octstr_copy(url, pstart, octstr_len(url) - pstart);
+    if (octstr_get_char(*path, 0) != '/')
+        octstr_insert(*path, octstr_imm("/"), 0);
+    return 0;
+}
+
+static void ob_close(struct obconn *c)
+{
+#ifdef HAVE_LIBSSL
+    if (c->ssl) {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+    }
+#endif
+    close(c->fd);
+    gw_free(c);
+}
+
+#ifdef HAVE_LIBSSL
+static int new_session(SSL *ssl, SSL_SESSION *sess)
+{
+    outbound_t *o = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    mutex_lock(o->lock);
+    if (o->session)
+        SSL_SESSION_free(o->session);
+    o->session = sess;
+    mutex_unlock(o->lock);
+    return 1; /* we keep the reference */
+}
+
+static int ob_handshake(outbound_t *o, struct obconn *c)
+{
+    double t0 = stats_now();
+
+    c->ssl = SSL_new(o->ctx);
+    SSL_set_fd(c->ssl, c->fd);
+    SSL_set_tlsext_host_name(c->ssl, octstr_get_cstr(o->host));
+    mutex_lock(o->lock);
+    if (o->session)
+        SSL_set_session(c->ssl, o->session);
+    mutex_unlock(o->lock);
+
+    if (SSL_connect(c->ssl) != 1) {
+        error(0, "outbound: TLS handshake with %s failed: %s", octstr_get_cstr(o->host),
+                ERR_error_string(ERR_get_error(), NULL));
+        ERR_clear_error();
+        return -1;
+    }
+    stats_time(st_handshake, stats_now() - t0);
+    stats_incr(SSL_session_reused(c->ssl) ? st_resumed : st_full);
+    return 0;
+}
+#endif
+
+static struct obconn *ob_connect(outbound_t *o)
+{
+    struct sockaddr_storage addrs[DNSCACHE_MAX_ADDRS];
+    struct timeval tv = {OUTBOUND_TIMEOUT, 0};
+    struct obconn *c;
+    int i, n, fd = -1, one = 1;
+    double t0;
+
+    if ((n = dnscache_lookup(o->host, addrs, DNSCACHE_MAX_ADDRS)) == 0) {
+        error(0, "outbound: cannot resolve %s", octstr_get_cstr(o->host));
+        return NULL;
+    }
+    t0 = stats_now();
+    for (i = 0; i < n; i++) {
+        socklen_t len;
+
+        if (addrs[i].ss_family == AF_INET) {
+            ((struct sockaddr_in *)&addrs[i])->sin_port = htons(o->port);
+            len = sizeof (struct sockaddr_in);
+        } else {
+            ((struct sockaddr_in6 *)&addrs[i])->sin6_port = htons(o->port);
+            len = sizeof (struct sockaddr_in6);
+        }
+        if ((fd = socket(addrs[i].ss_family, SOCK_STREAM, 0)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        if (connect(fd, (struct sockaddr *)&addrs[i], len) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        error(errno, "outbound: cannot connect to %s:%d", octstr_get_cstr(o->host), o->port);
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    stats_time(st_connect, stats_now() - t0);
+
+    c = gw_malloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->fd = fd;
+#ifdef HAVE_LIBSSL
+    if (o->ssl && ob_handshake(o, c) < 0) {
+        ob_close(c);
+        return NULL;
+    }
+#endif
+    return c;
+}
+
+/* Whether an idle connection still looks usable: the server has neither closed it nor
+ * sent anything (e.g. a TLS close_notify) since its last response */
+static int ob_alive(struct obconn *c)
+{
+    char ch;
+    long n = recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* An idle connection if there is a fresh one, else a new one */
+static struct obconn *ob_get(outbound_t *o)
+{
+    struct obconn *c = NULL;
+    time_t now = time(NULL);
+    long n;
+
+    mutex_lock(o->lock);
+    while ((n = gwlist_len(o->idle)) > 0) {
+        c = gwlist_get(o->idle, n - 1);
+        gwlist_delete(o->idle, n - 1, 1);
+        if (now - c->last_used < OUTBOUND_IDLE_TIMEOUT && ob_alive(c))
+            break;
+        ob_close(c);
+        c = NULL;
+    }
+    mutex_unlock(o->lock);
+
+    if (c) {
+        c->reused = 1;
+        stats_incr(st_reused);
+        return c;
+    }
+    return ob_connect(o);
+}
+
+static void ob_put(outbound_t *o, struct obconn *c)
+{
+    c->last_used = time(NULL);
+    mutex_lock(o->lock);
+    if (gwlist_len(o->idle) < OUTBOUND_IDLE_MAX) {
+        gwlist_append(o->idle, c);
+        c = NULL;
+    }
+    mutex_unlock(o->lock);
+    if (c)
+        ob_close(c);
+}
+
+/* Returns how much of data was sent: all of it unless the connection failed */
+static long ob_write(struct obconn *c, Octstr *data)
+{
+    const char *buf = octstr_get_cstr(data);
+    long n, done = 0, len = octstr_len(data);
+
+    while (done < len) {
+#ifdef HAVE_LIBSSL
+        if (c->ssl)
+            n = SSL_write(c->ssl, buf + done, len - done);
+        else
+#endif
+            n = send(c->fd, buf + done, len - done, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* Append whatever is available to in; returns bytes read, 0 on EOF, < 0 on error */
+static long ob_fill(struct obconn *c, Octstr *in)
+{
+    char buf[16 * 1024];
+    long n;
+
+#ifdef HAVE_LIBSSL
+    if (c->ssl)
+        n = SSL_read(c->ssl, buf, sizeof buf);
+    else
+#endif
+        n = recv(c->fd, buf, sizeof buf, 0);
+    if (n > 0)
+        octstr_append_data(in, buf, n);
+    return n;
+}
+
+/* Read one response, skipping any interim (1xx) ones. Returns the status, -1 on a
+ * broken response or -2 if the connection closed before anything came back. *keep is
+ * set if c can be reused; *location is the Location header, if there was one. */
+static int read_response(struct obconn *c, Octstr **body, Octstr **location, int *keep)
+{
+    Octstr *in = octstr_create(""), *hdrs, *line;
+    List *lines;
+    long hend, clen, n;
+    int status, minor = 1, chunked, conn_close;
+
+    *keep = 0;
+    *body = NULL;
+    *location = NULL;
+    do {
+        status = -1;
+        clen = -1;
+        chunked = conn_close = 0;
+        octstr_destroy(*location);
+        *location = NULL;
+        while ((hend = octstr_search(in, octstr_imm("\r\n\r\n"), 0)) < 0)
+            if ((n = ob_fill(c, in)) <= 0) {
+                status = octstr_len(in) == 0 ? -2 : -1;
+                goto done;
+            }
+
+        hdrs = octstr_copy(in, 0, hend);
+        octstr_delete(in, 0, hend + 4);
+        lines = octstr_split(hdrs, octstr_imm("\r\n"));
+        octstr_destroy(hdrs);
+        if ((line = gwlist_extract_first(lines)) == NULL ||
+                sscanf(octstr_get_cstr(line), "HTTP/1.%d %d", &minor, &status) != 2)
+            status = -1;
+        octstr_destroy(line);
+        while ((line = gwlist_extract_first(lines)) != NULL) {
+            long colon = octstr_search_char(line, ':', 0);
+
+            if (colon > 0) {
+                Octstr *name = octstr_copy(line, 0, colon);
+                Octstr *value = octstr_copy(line, colon + 1, octstr_len(line));
+
+                octstr_strip_blanks(name);
+                octstr_strip_blanks(value);
+                if (octstr_str_case_compare(name, "Content-Length") == 0)
+                    clen = strtol(octstr_get_cstr(value), NULL, 10);
+                else if (octstr_str_case_compare(name, "Transfer-Encoding") == 0)
+                    chunked = octstr_case_search(value, octstr_imm("chunked"), 0) >= 0;
+                else if (octstr_str_case_compare(name, "Connection") == 0)
+                    conn_close = octstr_case_search(value, octstr_imm("close"), 0) >= 0;
+                else if (octstr_str_case_compare(name, "Location") == 0 && *location == NULL) {
+                    *location = value;
+                    value = NULL;
+                }
+                octstr_destroy(name);
+                octstr_destroy(value);
+            }
+            octstr_destroy(line);
+        }
+        gwlist_destroy(lines, NULL);
+    } while (status >= 100 && status < 200 && status != 101); /* 100 Continue, 103 ... */
+    if (status < 0)
+        goto done;
+    if (status == 204 || status == 304 || status == 101)
+        clen = 0;
+
+    *body = octstr_create("");
+    if (chunked) {
+        for (;;) {
+            long eol, size;
+
+            while ((eol = octstr_search(in, octstr_imm("\r\n"), 0)) < 0)
+                if (ob_fill(c, in) <= 0)
+                    goto broken;
+            size = strtol(octstr_get_cstr(in), NULL, 16);
+            octstr_delete(in, 0, eol + 2);
+            if (size == 0)
+                break;
+            while (octstr_len(in) < size + 2)
+                if (ob_fill(c, in) <= 0)
+                    goto broken;
+            octstr_append_data(*body, octstr_get_cstr(in), size);
+            octstr_delete(in, 0, size + 2);
+        }
+        /* trailers, up to the empty line */
+        while (octstr_search(in, octstr_imm("\r\n"), 0) != 0) {
+            long eol = octstr_search(in, octstr_imm("\r\n"), 0);
+
+            if (eol > 0)
+                octstr_delete(in, 0, eol + 2);
+            else if (ob_fill(c, in) <= 0)
+                goto broken;
+        }
+    } else if (clen >= 0) {
+        while (octstr_len(in) < clen)
+            if (ob_fill(c, in) <= 0)
+                goto broken;
+        octstr_append_data(*body, octstr_get_cstr(in), clen);
+    } else {
+        /* delimited by the server closing the connection */
+        while ((n = ob_fill(c, in)) > 0)
+            ;
+        octstr_append(*body, in);
+        conn_close = 1;
+    }
+    *keep = !conn_close && minor >= 1;
+    goto done;
+
+broken:
+    octstr_destroy(*body);
+    *body = NULL;
+    status = -1;
+done:
+    if (status < 0) {
+        octstr_destroy(*location);
+        *location = NULL;
+    }
+    octstr_destroy(in);
+    return status;
+}
+
+outbound_t *outbound_create(Octstr *url, Octstr *ssl_client_certkey_file)
+{
+    outbound_t *o;
+    Octstr *path;
+
+    o = gw_malloc(sizeof *o);
+    memset(o, 0, sizeof *o);
+    if (url == NULL || parse_url(url, &o->host, &o->port, &path, &o->ssl) < 0) {
+        gw_free(o);
+        return NULL;
+    }
+    octstr_destroy(path);
+    o->lock = mutex_create();
+    o->idle = gwlist_create();
+    o->certkey = ssl_client_certkey_file ? octstr_duplicate(ssl_client_certkey_file) : NULL;
+
+    if (o->ssl) {
+#ifdef HAVE_LIBSSL
+        o->ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_app_data(o->ctx, o);
+        /* we hold the session ourselves; the new-session callback also catches TLS 1.3 tickets */
+        SSL_CTX_set_session_cache_mode(o->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(o->ctx, new_session);
+        SSL_CTX_set_verify(o->ctx, SSL_VERIFY_NONE, NULL); /* as gwlib's client */
+
+        if (ssl_client_certkey_file && octstr_len(ssl_client_certkey_file) > 0) {
+            char *f = octstr_get_cstr(ssl_client_certkey_file);
+
+            if (SSL_CTX_use_certificate_chain_file(o->ctx, f) != 1 ||
+                    SSL_CTX_use_PrivateKey_file(o->ctx, f, SSL_FILETYPE_PEM) != 1 ||
+                    SSL_CTX_check_private_key(o->ctx) != 1) {
+                error(0, "outbound: cannot load client certificate/key from %s: %s", f,
+                        ERR_error_string(ERR_get_error(), NULL));
+                ERR_clear_error();
+                outbound_destroy(o);
+                return NULL;
+            }
+        }
+#else
+        outbound_destroy(o);
+        return NULL;
+#endif
+    }
+    return o;
+}
+
+void outbound_destroy(outbound_t *o)
+{
+    struct obconn *c;
+
+    if (o == NULL)
+        return;
+    while ((c = gwlist_extract_first(o->idle)) != NULL)
+        ob_close(c);
+    gwlist_destroy(o->idle, NULL);
+#ifdef HAVE_LIBSSL
+    if (o->session)
+        SSL_SESSION_free(o->session);
+    if (o->ctx)
+        SSL_CTX_free(o->ctx);
+#endif
+    mutex_destroy(o->lock);
+    octstr_destroy(o->host);
+    octstr_destroy(o->certkey);
+    gw_free(o);
+}
+
+/* host[:port] as it goes in a Host header or URL */
+static Octstr *authority(outbound_t *o)
+{
+    Octstr *a = octstr_format(octstr_search_char(o->host, ':', 0) >= 0 ? "[%S]" : "%S", o->host);
+
+    if (o->port != (o->ssl ? 443 : 80))
+        octstr_format_append(a, ":%d", o->port);
+    return a;
+}
+
+/* Where a Location header points, made absolute against the url it answered */
+static Octstr *redirect_url(outbound_t *o, Octstr *url, Octstr *location)
+{
+    Octstr *a, *next;
+    long q, slash;
+
+    if (octstr_case_search(location, octstr_imm("http://"), 0) == 0 ||
+            octstr_case_search(location, octstr_imm("https://"), 0) == 0)
+        return octstr_duplicate(location);
+    a = authority(o);
+    if (octstr_get_char(location, 0) == '/')
+        next = octstr_format("%s://%S%S", o->ssl ? "https" : "http", a, location);
+    else {
+        /* relative to the directory of url's path */
+        if ((q = octstr_search_char(url, '?', 0)) < 0)
+            q = octstr_len(url);
+        for (slash = q - 1; slash > 0 && octstr_get_char(url, slash) != '/'; slash--)
+            ;
+        if (slash <= (o->ssl ? 7 : 6)) /* just past "scheme:/" : no path */
+            next = octstr_format("%s://%S/%S", o->ssl ? "https" : "http", a, location);
+        else {
+            next = octstr_copy(url, 0, slash + 1);
+            octstr_append(next, location);
+        }
+    }
+    octstr_destroy(a);
+    return next;
+}
+
+static Octstr *request(outbound_t *o, int method, Octstr *url, List *headers,
+        Octstr *body, int *status, int *written, int redirects)
+{
+    Octstr *host, *path, *req, *rbody = NULL, *location = NULL, *a;
+    struct obconn *c;
+    int port, ssl, keep, attempt;
+    long i, sent;
+    double t0;
+
+    *status = -1;
+    if (parse_url(url, &host, &port, &path, &ssl) < 0) {
+        error(0, "outbound: cannot parse url %s", octstr_get_cstr(url));
+        stats_incr(st_failed);
+        return NULL;
+    }
+    octstr_destroy(host);
+
+    a = authority(o);
+    req = octstr_format("%s %S HTTP/1.1\r\nHost: %S", method == HTTP_METHOD_GET ? "GET" : "POST",
+            path, a);
+    octstr_destroy(a);
+    octstr_append_cstr(req, "\r\nUser-Agent: Dispatcher2/" VERSION "\r\n");
+    for (i = 0; i < gwlist_len(headers); i++)
+        octstr_format_append(req, "%S\r\n", gwlist_get(headers, i));
+    if (body || method != HTTP_METHOD_GET)
+        octstr_format_append(req, "Content-Length: %ld\r\n", body ? octstr_len(body) : 0L);
+    octstr_append_cstr(req, "\r\n");
+    if (body)
+        octstr_append(req, body);
+    octstr_destroy(path);
+
+    /* A kept-alive connection may have been closed by the server in the meantime. Going
+     * again on a new one is only safe if the server can't have acted on the request: a
+     * POST that was sent may have been imported even though no answer came back (RFC 7230
+     * 6.3.1), so only a GET, or a request none of which got out, is retried. */
+    for (attempt = 0; attempt < 2; attempt++) {
+        if ((c = ob_get(o)) == NULL)
+            break;
+        t0 = stats_now();
+        if ((sent = ob_write(c, req)) > 0)
+            *written = 1;
+        if (sent < octstr_len(req))
+            *status = -2;
+        else
+            *status = read_response(c, &rbody, &location, &keep);
+        if (*status >= 0) {
+            stats_time(st_request, stats_now() - t0);
+            if (keep)
+                ob_put(o, c);
+            else
+                ob_close(c);
+            break;
+        }
+        i = c->reused && *status == -2 && (sent == 0 || method == HTTP_METHOD_GET);
+        ob_close(c);
+        if (!i)
+            break;
+    }
+    octstr_destroy(req);
+    if (*status < 0) {
+        *status = -1;
+        stats_incr(st_failed);
+    }
+
+    /* The redirect answered the request, so nothing was done yet: go again at the new
+     * location, with the same method and body except after a 303 */
+    if (location != NULL && redirects > 0 && (*status == 301 || *status == 302 ||
+                *status == 303 || *status == 307 || *status == 308)) {
+        Octstr *next = redirect_url(o, url, location);
+        outbound_t *to = o;
+
+        if (parse_url(next, &host, &port, &path, &ssl) == 0) {
+            if (ssl != o->ssl || port != o->port || octstr_case_compare(host, o->host) != 0)
+                to = outbound_create(next, o->certkey);
+            octstr_destroy(host);
+            octstr_destroy(path);
+        } else
+            to = NULL;
+        if (to != NULL) {
+            debug("dispatcher2", 0, "outbound: following %d to %s", *status, octstr_get_cstr(next));
+            if (*status == 303) {
+                method = HTTP_METHOD_GET;
+                body = NULL;
+            }
+            octstr_destroy(rbody);
+            rbody = request(to, method, next, headers, body, status, written, redirects - 1);
+            if (to != o)
+                outbound_destroy(to);
+        } else
+            warning(0, "outbound: cannot follow %d to %s", *status, octstr_get_cstr(location));
+        octstr_destroy(next);
+    }
+    octstr_destroy(location);
+    return rbody;
+}
+
+Octstr *outbound_request(outbound_t *o, int method, Octstr *url, List *headers,
+        Octstr *body, int *status)
+{
+    int written;
+
+    return outbound_request_real(o, method, url, headers, body, status, &written);
+}
+
+Octstr *outbound_request_real(outbound_t *o, int method, Octstr *url, List *headers,
+        Octstr *body, int *status, int *written)
+{
+    *written = 0;
+    return request(o, method, url, headers, body, status, written, OUTBOUND_MAX_REDIRECTS);
+}
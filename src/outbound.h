@@ -0,0 +1,46 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  outbound.h
+ *
+ *    Description:  HTTP(S) client for deliveries to destination servers. One per
+ *                  destination: TLS context, session and idle connections are kept
+ *                  across requests.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 15:12:08
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_OUTBOUND_H
+#define __DISPATCHER2_OUTBOUND_H
+
+#include <gwlib/gwlib.h>
+
+typedef struct outbound outbound_t;
+
+/* Call once before any outbound_create(); registers the /stats entries */
+void outbound_init(void);
+
+/* NULL if the url can't be parsed or the TLS context can't be built (e.g. a bad
+ * certkey file); callers then fall back to gwlib's client */
+outbound_t *outbound_create(Octstr *url, Octstr *ssl_client_certkey_file);
+void outbound_destroy(outbound_t *o);
+
+/* Send a request to url, which must be on the destination's host. Returns the response
+ * body (possibly empty) and sets *status, or returns NULL with *status = -1 if the
+ * request could not be made. A redirect is followed once, as gwlib's client does; 1xx
+ * interim responses are skipped. */
+Octstr *outbound_request(outbound_t *o, int method, Octstr *url, List *headers,
+        Octstr *body, int *status);
+/* The same, also setting *written if any of the request reached the server. A request
+ * that failed with *written == 0 was never seen there and can safely be made again. */
+Octstr *outbound_request_real(outbound_t *o, int method, Octstr *url, List *headers,
+        Octstr *body, int *status, int *written);
+
+#endif
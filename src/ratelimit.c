@@ -0,0 +1,268 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ratelimit.c
+ *
+ *    Description:  Per-user token buckets (users.max_rate, else rate-limit from the
+ *                  config) and daily quotas (users.daily_quota, else daily-quota),
+ *                  checked in memory. Usage is added to users.transaction_limit
+ *                  ('count/yyyymmdd') by a background thread, and limits and the
+ *                  count (which in a cluster includes the other nodes') re-read.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 16:58:44
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <libpq-fe.h>
+
+#include "ratelimit.h"
+#include "stats.h"
+#include "db.h"
+#include "dbpool.h"
+
+struct bucket {
+    double rate; /* tokens per second, 0 = unlimited */
+    double burst;
+    double tokens;
+    double last; /* stats_now() of the last refill */
+    long quota; /* per day, 0 = unlimited */
+    long used; /* today */
+    char day[16]; /* yyyymmdd that used belongs to */
+    long unsaved; /* of used, what isn't in transaction_limit yet */
+};
+
+static dispatcher2conf_t rconf;
+static Dict *buckets; /* username -> struct bucket */
+static Mutex *buckets_lock;
+static volatile int rstop = 0;
+static long flush_th = -1;
+
+static stat_t *st_limited, *st_over_quota;
+
+static void today(char *buf, size_t len)
+{
+    struct tm tm = gw_localtime(time(NULL));
+
+    strftime(buf, len, "%Y%m%d", &tm);
+}
+
+/* Set a bucket's limits from a users row: max_rate, daily_quota */
+static void set_limits(struct bucket *b, const char *max_rate, const char *daily_quota)
+{
+    double rate = max_rate && max_rate[0] ? atof(max_rate) : 0;
+    long quota = daily_quota && daily_quota[0] ? atol(daily_quota) : 0;
+
+    b->rate = rate > 0 ? rate : rconf->rate_limit;
+    b->burst = rconf->rate_burst > 0 ? rconf->rate_burst : (b->rate > 1 ? b->rate : 1);
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->quota = quota > 0 ? quota : rconf->daily_quota;
+}
+
+static struct bucket *load_bucket(PGconn *c, Octstr *user)
+{
+    const char *pvals[] = {octstr_get_cstr(user)};
+    struct bucket *b = gw_malloc(sizeof *b);
+    PGresult *r;
+    char *tl, *slash;
+
+    memset(b, 0, sizeof *b);
+    today(b->day, sizeof b->day);
+    r = db_run(c, DB_USER_LIMITS, pvals, NULL, NULL);
+    if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0) {
+        set_limits(b, PQgetvalue(r, 0, 0), PQgetvalue(r, 0, 1));
+        /* carry on from today's count in transaction_limit */
+        tl = PQgetvalue(r, 0, 2);
+        if (tl && (slash = strchr(tl, '/')) != NULL && strcmp(slash + 1, b->day) == 0)
+            b->used = atol(tl);
+    } else
+        set_limits(b, NULL, NULL);
+    PQclear(r);
+
+    b->tokens = b->burst;
+    b->last = stats_now();
+    return b;
+}
+
+int ratelimit_check(PGconn *c, Octstr *user, long *retry_after)
+{
+    struct bucket *b;
+    char day[16];
+    double now = stats_now();
+    int ret = RATELIMIT_OK;
+
+    *retry_after = 0;
+    if (user == NULL || octstr_len(user) == 0)
+        return RATELIMIT_OK;
+
+    mutex_lock(buckets_lock);
+    if ((b = dict_get(buckets, user)) == NULL) {
+        struct bucket *nb;
+
+        /* not holding the lock over the query: other users needn't wait for it */
+        mutex_unlock(buckets_lock);
+        if (c == NULL)
+            return RATELIMIT_OK;
+        nb = load_bucket(c, user);
+        mutex_lock(buckets_lock);
+        if ((b = dict_get(buckets, user)) == NULL) {
+            dict_put(buckets, user, nb);
+            b = nb;
+        } else
+            gw_free(nb); /* another request of this user's loaded it meanwhile */
+    }
+
+    today(day, sizeof day);
+    if (strcmp(day, b->day) != 0) {
+        strcpy(b->day, day);
+        b->used = 0;
+        b->unsaved = 0;
+    }
+
+    if (b->rate > 0) {
+        b->tokens += (now - b->last) * b->rate;
+        if (b->tokens > b->burst)
+            b->tokens = b->burst;
+    }
+    b->last = now;
+
+    if (b->quota > 0 && b->used >= b->quota) {
+        struct tm tm = gw_localtime(time(NULL));
+
+        ret = RATELIMIT_QUOTA;
+        *retry_after = 86400 - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+        stats_incr(st_over_quota);
+    } else if (b->rate > 0 && b->tokens < 1) {
+        ret = RATELIMIT_RATE;
+        *retry_after = (long)((1 - b->tokens) / b->rate) + 1;
+        stats_incr(st_limited);
+    } else {
+        if (b->rate > 0)
+            b->tokens -= 1;
+        b->used++;
+        b->unsaved++;
+    }
+    mutex_unlock(buckets_lock);
+    return ret;
+}
+
+/* Write back usage and pick up limit changes made in the users table. Only what was
+ * used since the last flush is added, so nodes sharing the table don't overwrite each
+ * other's counts, and each picks up the total. */
+static void flush_usage(PGconn *c)
+{
+    List *keys;
+    Octstr *user;
+
+    mutex_lock(buckets_lock);
+    keys = dict_keys(buckets);
+    mutex_unlock(buckets_lock);
+
+    while ((user = gwlist_extract_first(keys)) != NULL) {
+        struct bucket *b;
+        char delta[32], day[16], *tl, *slash;
+        long unsaved = 0;
+        const char *pvals[] = {octstr_get_cstr(user), delta, day};
+        PGresult *r;
+
+        mutex_lock(buckets_lock);
+        if ((b = dict_get(buckets, user)) != NULL) {
+            unsaved = b->unsaved;
+            b->unsaved = 0;
+            strcpy(day, b->day);
+        }
+        mutex_unlock(buckets_lock);
+        if (b == NULL) {
+            octstr_destroy(user);
+            continue;
+        }
+
+        if (unsaved > 0) {
+            sprintf(delta, "%ld", unsaved);
+            r = PQexecParams(c, "UPDATE users SET transaction_limit = "
+                    "(CASE WHEN transaction_limit ~ ('^[0-9]+/' || $3 || '$') "
+                    "THEN split_part(transaction_limit, '/', 1)::bigint + $2::bigint "
+                    "ELSE $2::bigint END) || '/' || $3 WHERE username = $1",
+                    3, NULL, pvals, NULL, NULL, 0);
+            if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+                warning(0, "ratelimit: could not save usage for %s: %s", octstr_get_cstr(user),
+                        PQresultErrorMessage(r));
+                /* try again next time, unless the day is over */
+                mutex_lock(buckets_lock);
+                if ((b = dict_get(buckets, user)) != NULL && strcmp(b->day, day) == 0)
+                    b->unsaved += unsaved;
+                mutex_unlock(buckets_lock);
+            }
+            PQclear(r);
+        }
+
+        r = PQexecParams(c, "SELECT max_rate, daily_quota, transaction_limit FROM users "
+                "WHERE username = $1", 1, NULL, pvals, NULL, NULL, 0);
+        if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0) {
+            mutex_lock(buckets_lock);
+            if ((b = dict_get(buckets, user)) != NULL) {
+                set_limits(b, PQgetvalue(r, 0, 0), PQgetvalue(r, 0, 1));
+                /* the saved count, which has every node's share, plus what we haven't saved */
+                tl = PQgetvalue(r, 0, 2);
+                if (tl && (slash = strchr(tl, '/')) != NULL && strcmp(slash + 1, b->day) == 0)
+                    b->used = atol(tl) + b->unsaved;
+            }
+            mutex_unlock(buckets_lock);
+        }
+        PQclear(r);
+        octstr_destroy(user);
+    }
+    gwlist_destroy(keys, NULL);
+}
+
+static void flusher(void *unused)
+{
+    PGconn *c;
+
+    for (;;) {
+        int last = rstop;
+
+        if ((c = dbpool_get(DB_POOL_MAINTENANCE)) != NULL)
+            flush_usage(c);
+        else
+            warning(0, "ratelimit: no database connection, usage not saved");
+        dbpool_put(DB_POOL_MAINTENANCE, c);
+        if (last)
+            break; /* one last flush on the way out */
+        gwthread_sleep(rconf->usage_flush_interval);
+    }
+}
+
+static void bucket_destroy(void *b)
+{
+    gw_free(b);
+}
+
+void ratelimit_init(dispatcher2conf_t config)
+{
+    rconf = config;
+    buckets = dict_create(101, bucket_destroy);
+    buckets_lock = mutex_create();
+    st_limited = stats_counter("ingest.rate_limited");
+    st_over_quota = stats_counter("ingest.over_quota");
+    flush_th = gwthread_create(flusher, NULL);
+}
+
+void ratelimit_shutdown(void)
+{
+    if (flush_th < 0)
+        return;
+    rstop = 1;
+    gwthread_wakeup(flush_th);
+    gwthread_join(flush_th);
+    flush_th = -1;
+    dict_destroy(buckets);
+    mutex_destroy(buckets_lock);
+}
@@ -0,0 +1,36 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ratelimit.h
+ *
+ *    Description:  Per-user request rate limits and daily quotas for the ingest path
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 16:52:10
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_RATELIMIT_H
+#define __DISPATCHER2_RATELIMIT_H
+
+#include <libpq-fe.h>
+#include "conf.h"
+
+/* ratelimit_check() results */
+#define RATELIMIT_OK 0
+#define RATELIMIT_RATE 1 /* token bucket empty */
+#define RATELIMIT_QUOTA 2 /* daily quota used up */
+
+void ratelimit_init(dispatcher2conf_t config);
+void ratelimit_shutdown(void);
+
+/* Take one request off user's allowance. c is only used the first time a user is seen,
+ * to load their limits and today's usage. When refused, *retry_after is set in seconds. */
+int ratelimit_check(PGconn *c, Octstr *user, long *retry_after);
+
+#endif
@@ -29,11 +29,19 @@
 #include <jansson.h>
 
 #include "request_processor.h"
+#include "cluster.h"
+#include "stats.h"
+#include "log.h"
+#include "dnscache.h"
+#include "scheduler.h"
+#include "db.h"
+#include "dbpool.h"
+#include "seglog.h"
 
 static dispatcher2conf_t dispatcher2conf;
 static List *srvlist;
 
-static xmlChar *findvalue(xmlDocPtr doc, xmlChar *xpath, int add_namespace){
+xmlChar *findvalue(xmlDocPtr doc, xmlChar *xpath, int add_namespace){
     xmlNodeSetPtr nodeset;
     xmlChar *value = NULL;
     xmlXPathContextPtr context;
@@ -41,12 +49,12 @@ static xmlChar *findvalue(xmlDocPtr doc, xmlChar *xpath, int add_namespace){
     int i;
 
     if(!doc){
-        info(0, "Null Doc for %s", xpath);
+        d2log_info("Null Doc for %s", xpath);
         return NULL;
     }
     context = xmlXPathNewContext(doc);
     if(!context){
-        info(0, "Null context for %s", xpath);
+        d2log_info("Null context for %s", xpath);
         return NULL;
     }
 
@@ -54,18 +62,18 @@ static xmlChar *findvalue(xmlDocPtr doc, xmlChar *xpath, int add_namespace){
         xmlChar *prefix = (xmlChar *) "xmlns";
         xmlChar *href = (xmlChar *) "http://dhis2.org/schema/dxf/2.0";
         if (xmlXPathRegisterNs(context, prefix, href) != 0){
-            info(0, "Unable to register NS:%s", prefix);
+            d2log_info("Unable to register NS:%s", prefix);
             return NULL;
         }
     }
     result = xmlXPathEvalExpression(xpath, context);
     if(!result){
-        info(0, "Null result for %s", xpath);
+        d2log_info("Null result for %s", xpath);
         return NULL;
     }
     if(xmlXPathNodeSetIsEmpty(result->nodesetval)){
         xmlXPathFreeObject(result);
-        info(0, "xmlXPathNodeSetIsEmpty for %s", xpath);
+        d2log_info("xmlXPathNodeSetIsEmpty for %s", xpath);
         return NULL;
     }
     nodeset = result->nodesetval;
@@ -81,21 +89,54 @@ static xmlChar *findvalue(xmlDocPtr doc, xmlChar *xpath, int add_namespace){
     return value;
 }
 
-#define REQUEST_SQL "SELECT id FROM requests WHERE status = 'ready' AND is_allowed_source(source, destination) ORDER BY created ASC LIMIT 10000"
-
-static void init_request_processor_sql(PGconn *c)
+/* Picks status and description out of a JSON import summary */
+int parse_json_response(Octstr *resp, char *st, size_t stlen, char *descr, size_t dlen)
 {
-    PGresult *r;
-    if (PQstatus(c) != CONNECTION_OK)
-        return;
+    json_t *root, *status, *description;
+    json_error_t error;
 
-    r = PQprepare(c, "REQUEST_SQL", REQUEST_SQL, 0, NULL);
-    PQclear(r);
+    root = json_loads(octstr_get_cstr(resp), 0, &error);
+    if (!root)
+        return JSON_RESPONSE_INVALID;
+
+    status = json_object_get(root, "status");
+    if (!json_is_string(status)) {
+        d2log_info("Failed to parse JSON reposne: (status).");
+        json_decref(root);
+        return JSON_RESPONSE_NO_STATUS;
+    }
+    snprintf(st, stlen, "%s", json_string_value(status));
+
+    description = json_object_get(root, "description");
+    if (!json_is_string(description)) {
+        d2log_info("Failed to parse JSON reposne: (description).");
+        json_decref(root);
+        return JSON_RESPONSE_NO_DESCRIPTION;
+    }
+    snprintf(descr, dlen, "%s", json_string_value(description));
+    json_decref(root);
+
+    return JSON_RESPONSE_OK;
 }
 
-static List *req_list; /* Of Request id */
 static Dict *req_dict; /* For keeping list short*/
 static Dict *server_dict;
+static Dict *server_ids; /* name -> server_id, for requests that skip the database */
+static int num_async_servers; /* with async_import: the import poller runs if any */
+
+/* priority_rules: the most urgent matching rule sets a request's priority */
+struct priority_rule {
+    Octstr *report_type; /* empty = any */
+    int source; /* 0 = any */
+    int priority;
+};
+static struct priority_rule *priority_rules;
+static long num_priority_rules;
+
+/* requests columns servers.partition_key may name; FETCH_READY in db.c must agree */
+static const char *partition_columns[] = {
+    "facility", "district", "msisdn", "report_type", "source", "submissionid"
+};
 
 void free_serverconf(serverconf_t *d)
 {
@@ -109,6 +150,9 @@ void free_serverconf(serverconf_t *d)
     octstr_destroy(d->auth_method);
     octstr_destroy(d->http_method);
     octstr_destroy(d->ssl_client_certkey_file);
+    octstr_destroy(d->allowed_sources);
+    octstr_destroy(d->async_url);
+    outbound_destroy(d->client);
     gw_free(d);
 }
 
@@ -120,13 +164,14 @@ static void load_serverconf_dict(PGconn *c)
     if (!c)
         return;
     server_dict = dict_create(17, (void *)free_serverconf);
+    server_ids = dict_create(17, NULL);
 
     sprintf(buf, "SELECT * FROM servers");
 
     r = PQexec(c, buf);
     n = (PQresultStatus(r) == PGRES_TUPLES_OK) ? PQntuples(r) : 0;
     for (i=0; i<n; i++) {
-        info(0, "We got here XXX!");
+        d2log_info("We got here XXX!");
         serverconf_t *server = gw_malloc(sizeof *server);
         server->server_id = (s = PQgetvalue(r, i, PQfnumber(r, "id"))) != NULL ? strtoul(s, NULL, 10) : 0;
         Octstr *xkey = octstr_format("%s", s);
@@ -145,17 +190,258 @@ static void load_serverconf_dict(PGconn *c)
                     PQfnumber(r, "start_submission_period"))) != NULL ? strtoul(s, NULL, 10) : 0;
         server->end_submission_period = (s = PQgetvalue(r, i,
                     PQfnumber(r, "end_submission_period"))) != NULL ? strtoul(s, NULL, 10) : 0;
+        server->min_concurrency = (s = PQgetvalue(r, i, PQfnumber(r, "min_concurrency"))) != NULL ? atoi(s) : 0;
+        server->max_concurrency = (s = PQgetvalue(r, i, PQfnumber(r, "max_concurrency"))) != NULL ? atoi(s) : 0;
+        server->target_latency = (s = PQgetvalue(r, i, PQfnumber(r, "target_latency"))) != NULL ? atoi(s) : 0;
+        server->supersede = (s = PQgetvalue(r, i, PQfnumber(r, "supersede"))) != NULL && strcmp(s, "t") == 0;
+        server->deadline_days = (s = PQgetvalue(r, i, PQfnumber(r, "deadline_days"))) != NULL ? atoi(s) : 0;
+        server->async_import = (s = PQgetvalue(r, i, PQfnumber(r, "async_import"))) != NULL && strcmp(s, "t") == 0;
+        server->async_url = NULL;
+        if (server->async_import) {
+            server->async_url = octstr_format("%S%sasync=true", server->url,
+                    octstr_search_char(server->url, '?', 0) >= 0 ? "&" : "?");
+            num_async_servers++;
+        }
+        server->partition_key = 0;
+        if ((s = PQgetvalue(r, i, PQfnumber(r, "partition_key"))) != NULL && s[0]) {
+            int k;
+
+            for (k = 0; k < NELEMS(partition_columns); k++)
+                if (strcmp(s, partition_columns[k]) == 0)
+                    server->partition_key = k + 1;
+            if (server->partition_key == 0)
+                warning(0, "Server %s: unknown partition_key '%s', delivering unordered",
+                        PQgetvalue(r, i, PQfnumber(r, "name")), s);
+        }
+        sched_configure(server->server_id, server->min_concurrency, server->max_concurrency,
+                server->target_latency / 1000.0);
+        /* TLS context (and client cert/key) built once here, not per request */
+        server->client = outbound_create(server->url,
+                server->use_ssl ? server->ssl_client_certkey_file : NULL);
+        server->allowed_sources = NULL;
 
         dict_put(server_dict, xkey, server);
+        dict_put(server_ids, server->name, (void *)(long)server->server_id);
         octstr_destroy(xkey);
     }
     PQclear(r);
+
+    /* what is_allowed_source() checks, for requests that never reach the database */
+    r = PQexec(c, "SELECT server_id, allowed_sources FROM server_allowed_sources");
+    n = (PQresultStatus(r) == PGRES_TUPLES_OK) ? PQntuples(r) : 0;
+    for (i = 0; i < n; i++) {
+        Octstr *xkey = octstr_create(PQgetvalue(r, i, 0));
+        serverconf_t *server = dict_get(server_dict, xkey);
+
+        if (server && !server->allowed_sources)
+            server->allowed_sources = octstr_format(",%s,", PQgetvalue(r, i, 1));
+        octstr_destroy(xkey);
+    }
+    PQclear(r);
+
+    r = PQexec(c, "SELECT report_type, COALESCE(source, 0), priority FROM priority_rules");
+    n = (PQresultStatus(r) == PGRES_TUPLES_OK) ? PQntuples(r) : 0;
+    priority_rules = gw_malloc((n + 1) * sizeof priority_rules[0]);
+    for (i = 0; i < n; i++) {
+        priority_rules[i].report_type = octstr_create(PQgetvalue(r, i, 0));
+        priority_rules[i].source = atoi(PQgetvalue(r, i, 1));
+        priority_rules[i].priority = atoi(PQgetvalue(r, i, 2));
+    }
+    num_priority_rules = n;
+    PQclear(r);
     return;
 }
 
-/* Post XML to server using basic auth and return response */
+int request_priority(request_t *req)
+{
+    int p = PRIORITY_NORMAL;
+    long i;
+
+    for (i = 0; i < num_priority_rules; i++) {
+        struct priority_rule *x = &priority_rules[i];
+
+        if (x->priority < p && (x->source == 0 || x->source == req->source) &&
+                (octstr_len(x->report_type) == 0 ||
+                 (req->report_type && octstr_compare(x->report_type, req->report_type) == 0)))
+            p = x->priority < 0 ? PRIORITY_CRITICAL : x->priority;
+    }
+    return p;
+}
+
+int parse_priority(Octstr *s)
+{
+    const char *names[] = PRIORITY_NAMES;
+    int i;
+
+    if (s == NULL || octstr_len(s) == 0)
+        return -1;
+    if (isdigit(octstr_get_char(s, 0)))
+        return (i = atoi(octstr_get_cstr(s))) < NUM_PRIORITIES ? i : PRIORITY_LOW;
+    for (i = 0; i < NUM_PRIORITIES; i++)
+        if (octstr_str_case_compare(s, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+int server_id_by_name(Octstr *name)
+{
+    long id = name && server_ids ? (long)dict_get(server_ids, name) : 0;
+
+    return id > 0 ? id : -1;
+}
+
+int server_allows_source(int dest, int source)
+{
+    Octstr *xkey = octstr_format("%d", dest), *needle = octstr_format("%d", source);
+    serverconf_t *server = dict_get(server_dict, xkey);
+    int ret = 0;
+    long i;
+
+    if (server && server->allowed_sources) {
+        /* allowed_sources is the array as text, e.g. ",{1,2,3}," */
+        for (i = 0; (i = octstr_search(server->allowed_sources, needle, i)) >= 0; i++)
+            if (!isdigit(octstr_get_char(server->allowed_sources, i - 1)) &&
+                    !isdigit(octstr_get_char(server->allowed_sources, i + octstr_len(needle)))) {
+                ret = 1;
+                break;
+            }
+    }
+    octstr_destroy(needle);
+    octstr_destroy(xkey);
+    return ret;
+}
+
+uint64_t partition_hash(const char *value, long len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    long i;
+
+    if (value == NULL || len <= 0)
+        return 0; /* no value: unordered */
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)value[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+uint64_t request_partition_key(request_t *req)
+{
+    Octstr *xkey = octstr_format("%d", req->destination), *v = NULL;
+    serverconf_t *server = dict_get(server_dict, xkey);
+    char num[32];
+
+    octstr_destroy(xkey);
+    if (server == NULL || server->partition_key == 0)
+        return 0;
+    switch (server->partition_key - 1) {
+        case 0: v = req->facility; break;
+        case 1: v = req->district; break;
+        case 2: v = req->msisdn; break;
+        case 3: v = req->report_type; break;
+        case 4:
+            sprintf(num, "%d", req->source);
+            return partition_hash(num, strlen(num));
+        case 5:
+            sprintf(num, "%lld", (long long)req->msgid);
+            return partition_hash(num, strlen(num));
+    }
+    return v ? partition_hash(octstr_get_cstr(v), octstr_len(v)) : 0;
+}
+
+/* The number in a period field, e.g. 33 in "W33" or "2016W33"; *year is set if it
+ * starts with one. -1 if there is none. */
+static int period_number(Octstr *s, int *year)
+{
+    long i, n = s ? octstr_len(s) : 0, start = 0;
+
+    while (start < n && !isdigit(octstr_get_char(s, start)))
+        start++;
+    for (i = start; i < n && isdigit(octstr_get_char(s, i)); i++)
+        ;
+    if (i - start == 4 && i < n) { /* "2016W33", "2016-08" */
+        *year = atoi(octstr_get_cstr(s) + start);
+        for (start = i; start < n && !isdigit(octstr_get_char(s, start)); start++)
+            ;
+    } else if (i - start == 6) { /* "201608" */
+        *year = atoi(octstr_get_cstr(s) + start) / 100;
+        return atoi(octstr_get_cstr(s) + start + 4);
+    }
+    return start < n ? atoi(octstr_get_cstr(s) + start) : -1;
+}
+
+double request_deadline(request_t *req)
+{
+    Octstr *xkey = octstr_format("%d", req->destination);
+    serverconf_t *server = dict_get(server_dict, xkey);
+    struct tm tm;
+    int year = req->year, n;
+
+    octstr_destroy(xkey);
+    if (server == NULL || server->deadline_days <= 0)
+        return 0;
+    memset(&tm, 0, sizeof tm);
+    tm.tm_isdst = -1;
+    if ((n = period_number(req->week, &year)) >= 1 && n <= 53 && year > 0) {
+        /* ISO week n ends on its Sunday; week 1 is the one with 4 January in it */
+        struct tm jan4 = {0};
+
+        jan4.tm_year = year - 1900;
+        jan4.tm_mday = 4;
+        jan4.tm_isdst = -1;
+        mktime(&jan4); /* for tm_wday */
+        tm.tm_year = year - 1900;
+        tm.tm_mday = 4 - (jan4.tm_wday + 6) % 7 + n * 7; /* the Monday after */
+    } else if ((n = period_number(req->month, &year)) >= 1 && n <= 12 && year > 0) {
+        tm.tm_year = year - 1900;
+        tm.tm_mon = n; /* the first of the month after */
+        tm.tm_mday = 1;
+    } else if (year > 0) {
+        tm.tm_year = year + 1 - 1900;
+        tm.tm_mday = 1;
+    } else
+        return 0;
+    tm.tm_mday += server->deadline_days;
+    return (double)mktime(&tm); /* mktime() normalises the day */
+}
+
+int server_supersedes(int dest)
+{
+    Octstr *xkey = octstr_format("%d", dest);
+    serverconf_t *server = dict_get(server_dict, xkey);
+
+    octstr_destroy(xkey);
+    return server ? server->supersede : 0;
+}
+
+int server_imports_async(int dest)
+{
+    Octstr *xkey = octstr_format("%d", dest);
+    serverconf_t *server = dict_get(server_dict, xkey);
+
+    octstr_destroy(xkey);
+    return server ? server->async_import : 0;
+}
+
+/* Whether a destination's own submission period (servers table) includes now */
+static int in_submission_period(serverconf_t *dest)
+{
+    struct tm tm = gw_localtime(time(NULL));
+
+    return tm.tm_hour >= dest->start_submission_period && tm.tm_hour <= dest->end_submission_period;
+}
+
+/* Record the outcome of a delivery: in requests, or in the segment log for requests
+ * that were queued there */
+static void finish(PGconn *c, int64_t rid, enum db_stmt s, const char *const *pvals)
+{
+    if (seglog_owns(rid))
+        seglog_complete(rid, s, pvals[1], pvals[2]);
+    else
+        PQclear(db_run_commit(c, s, pvals));
+}
+
+/* Post XML to url on server dest using basic auth and return response */
 static Octstr *post_payload_to_server(Octstr *data, Octstr *ctype,
-        serverconf_t *dest, int body_is_query_param) {
+        serverconf_t *dest, Octstr *url, int body_is_query_param, int *http_status) {
     HTTPCaller *caller;
 
     List *request_headers;
@@ -174,34 +460,50 @@ static Octstr *post_payload_to_server(Octstr *data, Octstr *ctype,
         http_header_add(request_headers, "Content-Type", "application/xml");
 
     http_add_basic_auth(request_headers, dest->username, dest->password);
-    /* XXX Add SSL stuff here */
+    if (dest->client != NULL) {
+        if (body_is_query_param == 0) {
+            rbody = outbound_request(dest->client, method, url, request_headers, data, &status);
+        } else {
+            if ((i = octstr_search_char(url, '?', 0)) > 0) {
+                xurl = octstr_format("%S%S", url, data);
+            } else{
+                xurl = octstr_format("%S?%S", url, data);
+            }
+            rbody = outbound_request(dest->client, method, xurl, request_headers, NULL, &status);
+        }
+        http_destroy_headers(request_headers);
+        octstr_destroy(xurl);
+        *http_status = status;
+        return rbody; /* NULL if status == -1 */
+    }
+
     caller = http_caller_create();
     if (dest->use_ssl && (octstr_compare(dest->ssl_client_certkey_file, octstr_imm("")) != 0)){
-        info(0, "Using HTTPS client to post data: certkey_file:%s!",
+        d2log_info("Using HTTPS client to post data: certkey_file:%s!",
                 octstr_get_cstr(dest->ssl_client_certkey_file));
         if (body_is_query_param == 0) {
-            http_start_request(caller, method, dest->url, request_headers, data, 1, NULL,
+            http_start_request(caller, method, url, request_headers, data, 1, NULL,
                 dest->ssl_client_certkey_file);
         } else {
             /* append body to url nicely and make call */
-            if ((i = octstr_search_char(dest->url, '?', 0)) > 0) {
-                xurl = octstr_format("%S%S", dest->url, data);
+            if ((i = octstr_search_char(url, '?', 0)) > 0) {
+                xurl = octstr_format("%S%S", url, data);
             } else{
-                xurl = octstr_format("%S?%S", dest->url, data);
+                xurl = octstr_format("%S?%S", url, data);
             }
             http_start_request(caller, method, xurl, request_headers, NULL, 1, NULL,
                     dest->ssl_client_certkey_file);
         }
     } else {
-        info(0, "Using normal HTTP client to post data!");
+        d2log_info("Using normal HTTP client to post data!");
         if (body_is_query_param == 0) {
-            http_start_request(caller, method, dest->url, request_headers, data, 1, NULL, NULL);
+            http_start_request(caller, method, url, request_headers, data, 1, NULL, NULL);
         } else {
             /* append body to url nicely and make call */
-            if ((i = octstr_search_char(dest->url, '?', 0)) > 0) {
-                xurl = octstr_format("%S%S", dest->url, data);
+            if ((i = octstr_search_char(url, '?', 0)) > 0) {
+                xurl = octstr_format("%S%S", url, data);
             } else{
-                xurl = octstr_format("%S?%S", dest->url, data);
+                xurl = octstr_format("%S?%S", url, data);
             }
             http_start_request(caller, method, xurl, request_headers, NULL, 1, NULL, NULL);
         }
@@ -214,6 +516,7 @@ static Octstr *post_payload_to_server(Octstr *data, Octstr *ctype,
     octstr_destroy(xurl);
     /*  octstr_destroy(rbody); */
 
+    *http_status = status;
     if (status == -1){
         if(rbody) octstr_destroy(rbody);
         return NULL;
@@ -221,94 +524,238 @@ static Octstr *post_payload_to_server(Octstr *data, Octstr *ctype,
     return rbody;
 }
 
-static void do_request(PGconn *c, int64_t rid) {
-    char tmp[64] = {0}, *cmd, *x, buf[256] = {0}, st[64] = {0};
+/* GET url on server dest as JSON, for the task polls of async imports */
+static Octstr *get_from_server(serverconf_t *dest, Octstr *url, int *http_status)
+{
+    HTTPCaller *caller;
+    List *headers = gwlist_create();
+    Octstr *furl = NULL, *rbody = NULL;
+    int status = -1;
+
+    http_header_add(headers, "Accept", "application/json");
+    http_add_basic_auth(headers, dest->username, dest->password);
+    if (dest->client != NULL)
+        rbody = outbound_request(dest->client, HTTP_METHOD_GET, url, headers, NULL, &status);
+    else {
+        caller = http_caller_create();
+        http_start_request(caller, HTTP_METHOD_GET, url, headers, NULL, 1, NULL,
+                dest->use_ssl && octstr_len(dest->ssl_client_certkey_file) > 0 ?
+                dest->ssl_client_certkey_file : NULL);
+        http_destroy_headers(headers);
+        headers = NULL;
+        http_receive_result_real(caller, &status, &furl, &headers, &rbody, 1);
+        http_caller_destroy(caller);
+        octstr_destroy(furl);
+    }
+    http_destroy_headers(headers);
+    *http_status = status;
+    if (status == -1) {
+        octstr_destroy(rbody);
+        return NULL;
+    }
+    return rbody;
+}
+
+/* url for a path from the root of server dest, e.g. an import task: whatever comes
+ * before /api/ in its url, else its scheme and host */
+static Octstr *server_url(serverconf_t *dest, const char *path)
+{
+    long i = octstr_search(dest->url, octstr_imm("/api/"), 0);
+    Octstr *url;
+
+    if (i < 0 && (i = octstr_search(dest->url, octstr_imm("://"), 0)) >= 0)
+        i = octstr_search_char(dest->url, '/', i + 3);
+    url = octstr_copy(dest->url, 0, i < 0 ? octstr_len(dest->url) : i);
+    octstr_append_cstr(url, path);
+    return url;
+}
+
+/* The task endpoint in DHIS2's answer to an async import, e.g.
+ * /api/system/tasks/DATAVALUE_IMPORT/<id>. -1 if there is none: it imported already */
+static int find_import_task(Octstr *resp, Octstr *ctype, char *task, size_t len)
+{
+    int found = 0;
+
+    if (ctype && octstr_case_search(ctype, octstr_imm("xml"), 0) >= 0) {
+        xmlDocPtr doc = xmlParseMemory(octstr_get_cstr(resp), octstr_len(resp));
+        xmlChar *s = doc ? findvalue(doc, (xmlChar *)"//xmlns:response/@relativeNotifierEndpoint", 1) : NULL;
+
+        if ((found = s != NULL && s[0] == '/'))
+            snprintf(task, len, "%s", s);
+        if (s)
+            xmlFree(s);
+        if (doc)
+            xmlFreeDoc(doc);
+    } else {
+        json_error_t error;
+        json_t *root = json_loads(octstr_get_cstr(resp), 0, &error), *ep;
+
+        if (root == NULL)
+            return -1;
+        ep = json_object_get(json_object_get(root, "response"), "relativeNotifierEndpoint");
+        if ((found = json_is_string(ep) && json_string_value(ep)[0] == '/'))
+            snprintf(task, len, "%s", json_string_value(ep));
+        json_decref(root);
+    }
+    return found ? 0 : -1;
+}
+
+/* Whether an import task's notifications say it has completed */
+static int task_completed(Octstr *resp)
+{
+    json_error_t error;
+    json_t *root = json_loads(octstr_get_cstr(resp), 0, &error);
+    size_t i;
+    int done = 0;
+
+    for (i = 0; root && i < json_array_size(root); i++)
+        if (json_is_true(json_object_get(json_array_get(root, i), "completed")))
+            done = 1;
+    if (root)
+        json_decref(root);
+    return done;
+}
+
+/* How a JSON import summary is recorded, with status and description in st and descr */
+static enum db_stmt json_outcome(Octstr *resp, char *st, size_t stlen, char *descr, size_t dlen)
+{
+    switch (parse_json_response(resp, st, stlen, descr, dlen)) {
+        case JSON_RESPONSE_INVALID:
+            return DB_REQUEST_BAD_JSON;
+        case JSON_RESPONSE_NO_STATUS:
+            return DB_REQUEST_NO_STATUS;
+        case JSON_RESPONSE_NO_DESCRIPTION:
+            return DB_REQUEST_NO_DESCRIPTION;
+        default:
+            return strcasecmp(st, "ERROR") == 0 ? DB_REQUEST_FAILED : DB_REQUEST_COMPLETED;
+    }
+}
+
+static stat_t *st_imports, *st_import_polls, *st_import_timeouts, *st_import_time;
+
+/* Deliver one request. Returns the destination's HTTP status, -1 if it could not be
+ * reached or 0 if nothing was sent; *latency is the time taken by the destination. */
+static int do_request(PGconn *c, int64_t rid, double *latency) {
+    char tmp[64] = {0}, *x, buf[256] = {0}, st[64] = {0};
     PGresult *r;
-    int retries, serverid, source, body_is_query_param = 0;
-    Octstr *data;
-    Octstr *ctype;
+    int retries, serverid, source, body_is_query_param = 0, http_status = 0, async;
+    Octstr *data = NULL;
+    Octstr *ctype = NULL;
     const char *pvals[] = {tmp, st, buf};
-    Octstr *resp, *xkey;
+    Octstr *resp = NULL, *xkey = NULL;
+    serverconf_t *dest;
     xmlDocPtr doc;
     xmlChar *s, *im, *ig, *up;
-    json_t *root, *status, *descr;
-    json_error_t error;
-    const char *status_text, *description;
 
     sprintf(tmp, "%ld", rid);
 
-    /* NOWAIT forces failure if the record is locked. Also we do not process if not yet time.*/
-    cmd = "SELECT source, destination, body, retries, in_submission_period(destination), ctype, "
-        " body_is_query_param FROM requests WHERE id = $1 FOR UPDATE NOWAIT";
-
-    r = PQexecParams(c, cmd, 1, NULL, pvals, NULL, NULL, 0);
-    if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) <= 0) {
-        /*skip this one*/
-        PQclear(r);
-        return;
-    }
+    if (seglog_owns(rid)) {
+        request_t req;
+        serverconf_t *server;
+
+        if (seglog_claim(rid, &req) < 0)
+            goto done; /* nothing sent */
+        serverid = req.destination;
+        retries = 0; /* a failed delivery is final, as in requests */
+        data = req.payload;
+        ctype = req.ctype;
+        body_is_query_param = strchr("tTyY1", octstr_get_char(req.is_qparams, 0)) != NULL &&
+            octstr_len(req.is_qparams) > 0;
+        req.payload = req.ctype = NULL; /* ours now */
+        seglog_request_free(&req);
+        if (octstr_len(data) == 0) {
+            octstr_destroy(data);
+            data = NULL;
+        }
+        if (octstr_len(ctype) == 0) {
+            octstr_destroy(ctype);
+            ctype = NULL;
+        }
 
-    if ((x = PQgetvalue(r, 0, 4)) && (strcmp(x, "f") == 0)) {
-        /* We're out of submission period */
-        info(0, "Destination Server Out of Submission Period");
-        return;
-    }
-    source = (x = PQgetvalue(r, 0, 0)) != NULL ? atoi(x) : -1;
-    serverid = (x = PQgetvalue(r, 0, 1)) != NULL ? atoi(x) : -1;
-    retries = (x = PQgetvalue(r, 0, 3)) != NULL ? atoi(x) : -1;
-    x = PQgetvalue(r, 0, 5);
-    ctype = (x && x[0]) ? octstr_create(x): NULL;
-    x = PQgetvalue(r, 0, 2);
-    data = (x && x[0]) ? octstr_create(x) : NULL; /* POST XML or JSON */
-    if ((x = PQgetvalue(r, 0, 6)) && (strcmp(x, "t") == 0))
-        body_is_query_param = 1;
+        xkey = octstr_format("%d", serverid);
+        server = dict_get(server_dict, xkey);
+        if (server && !in_submission_period(server)) {
+            d2log_info("Destination Server Out of Submission Period");
+            goto done; /* nothing sent */
+        }
+    } else {
+        /* Locks the row; we do not process if not yet time */
+        r = db_begin_run(c, DB_CLAIM_REQUEST, pvals);
+        if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) <= 0) {
+            /*skip this one*/
+            PQclear(r);
+            goto done; /* nothing sent */
+        }
 
+        if ((x = PQgetvalue(r, 0, 4)) && (strcmp(x, "f") == 0)) {
+            /* We're out of submission period */
+            d2log_info("Destination Server Out of Submission Period");
+            PQclear(r);
+            goto done; /* nothing sent */
+        }
+        source = (x = PQgetvalue(r, 0, 0)) != NULL ? atoi(x) : -1;
+        serverid = (x = PQgetvalue(r, 0, 1)) != NULL ? atoi(x) : -1;
+        if (!cluster_owns(serverid)) {
+            /* Ownership moved to another node since this was queued */
+            PQclear(r);
+            goto done; /* nothing sent */
+        }
+        retries = (x = PQgetvalue(r, 0, 3)) != NULL ? atoi(x) : -1;
+        x = PQgetvalue(r, 0, 5);
+        ctype = (x && x[0]) ? octstr_create(x): NULL;
+        x = PQgetvalue(r, 0, 2);
+        data = (x && x[0]) ? octstr_create(x) : NULL; /* POST XML or JSON */
+        if ((x = PQgetvalue(r, 0, 6)) && (strcmp(x, "t") == 0))
+            body_is_query_param = 1;
 
-    PQclear(r);
-    info(0, "Post Data %s", octstr_get_cstr(data));
+        PQclear(r);
+        xkey = octstr_format("%d", serverid);
+    }
+    d2log_body("Post Data", data);
 
     if (retries > dispatcher2conf->max_retries) {
-        r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "status = 'expired' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-        PQclear(r);
-        return;
+        finish(c, rid, DB_REQUEST_EXPIRED, pvals);
+        goto done; /* nothing sent */
     }
 
     if (!data){
-        r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode='ERROR1', errors = 'Empty response from server', "
-                "status = 'failed' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-        PQclear(r);
+        finish(c, rid, DB_REQUEST_EMPTY, pvals);
         /* Mark this one as failed*/
-        return;
+        goto done; /* nothing sent */
     }
 
-    xkey = octstr_format("%d", serverid);
-    serverconf_t *dest = dict_get(server_dict, xkey);
+    dest = dict_get(server_dict, xkey);
     if (!dest){
-        info(0, "Failed to get server conf for server: %d", serverid);
-        return;
+        d2log_info("Failed to get server conf for server: %d", serverid);
+        goto done; /* nothing sent */
     }
 
-    resp = post_payload_to_server(data, ctype, dest, body_is_query_param);
+    /* the segment log only records final outcomes: its requests import synchronously */
+    async = dest->async_import && !seglog_owns(rid);
+    http_status = -1;
+    *latency = stats_now();
+    resp = post_payload_to_server(data, ctype, dest, async ? dest->async_url : dest->url,
+            body_is_query_param, &http_status);
+    *latency = stats_now() - *latency;
 
     if (!resp) {
-        r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode = 'ERROR2', errors = 'Server possibly unreachable!', "
-                "status = 'failed' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-        PQclear(r);
-        return;
+        finish(c, rid, DB_REQUEST_UNREACHABLE, pvals);
+        goto done;
+    }
+    d2log_body("Response Data", resp);
+    if (async && find_import_task(resp, ctype, buf, sizeof buf) == 0) {
+        /* the import runs on; import_poller() records its summary */
+        char delay[32];
+        const char *ivals[] = {tmp, buf, delay};
+
+        sprintf(delay, "%g", dispatcher2conf->import_poll_interval);
+        PQclear(db_run_commit(c, DB_REQUEST_IMPORTING, ivals));
+        stats_incr(st_imports);
+        goto done;
     }
-    info(0, "Response Data %s", octstr_get_cstr(resp));
     if (!dest->parse_responses){
-        r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode = 'SUCCESS', status = 'completed' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-        PQclear(r);
-        return;
+        finish(c, rid, DB_REQUEST_SENT, pvals);
+        goto done;
     }
 
     if (ctype && octstr_case_search(ctype, octstr_imm("xml"), 0) >= 0) {
@@ -316,14 +763,9 @@ static void do_request(PGconn *c, int64_t rid) {
         doc = xmlParseMemory(octstr_get_cstr(resp), octstr_len(resp));
 
         if (!doc) {
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                    "statuscode = 'ERROR3', errors = 'Response possibly not proper XML', "
-                    "status = 'failed' WHERE id = $1",
-                    1, NULL, pvals, NULL, NULL, 0);
-            PQclear(r);
-            return;
+            finish(c, rid, DB_REQUEST_BAD_XML, pvals);
+            goto done;
         }
-
         s = findvalue(doc, (xmlChar *)"//xmlns:status", 1); /* third arg is 0 if no namespace required*/
         im = findvalue(doc, (xmlChar *)"//xmlns:importCount[1]/@imported", 1);
         ig = findvalue(doc, (xmlChar *)"//xmlns:importCount[1]/@ignored", 1);
@@ -337,87 +779,66 @@ static void do_request(PGconn *c, int64_t rid) {
         if(up) xmlFree(up);
 
         if (strcasestr(st, "ERROR")) {
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode=$2, status = 'failed', errors = $3 WHERE id = $1",
-                3, NULL, pvals, NULL, NULL, 0);
+            finish(c, rid, DB_REQUEST_FAILED, pvals);
         } else {
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode=$2, status = 'completed', statuscode='SUCCESS', errors = $3 WHERE id = $1",
-                3, NULL, pvals, NULL, NULL, 0);
+            finish(c, rid, DB_REQUEST_COMPLETED, pvals);
 
         }
-        PQclear(r);
 
         if(doc)
             xmlFreeDoc(doc);
     } else if (ctype && octstr_case_search(ctype, octstr_imm("json"), 0) >= 0) {
         /* Let's parse the JSON response */
-        root = json_loads(octstr_get_cstr(resp), 0, &error);
-        if (!root) {
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode = 'ERROR4', errors = 'Response was not proper JSON', "
-                "status = 'failed' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-            PQclear(r);
-            goto done;
-        }
-        status = json_object_get(root, "status");
-        if (!json_is_string(status)) {
-            info(0, "Failed to parse JSON reposne: (status).");
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode = 'ERROR5', errors= 'Could not pick status from JSON response',"
-                "status = 'failed' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-            PQclear(r);
-            json_decref(root);
-            goto done;
-        }
-        status_text = json_string_value(status);
-        sprintf(st, "%s", status_text);
-
-        descr = json_object_get(root, "description");
-        if (!json_is_string(descr)) {
-            info(0, "Failed to parse JSON reposne: (description).");
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode = 'ERROR6', errors = 'No description field in JSON response',"
-                "status = 'failed' WHERE id = $1",
-                1, NULL, pvals, NULL, NULL, 0);
-            PQclear(r);
-            json_decref(root);
-            goto done;
-        }
-        description = json_string_value(descr);
-        sprintf(buf, "%s", description);
-
-        if (strcasecmp(status_text, "ERROR") == 0) {
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode=$2, status = 'failed', errors = $3 WHERE id = $1",
-                3, NULL, pvals, NULL, NULL, 0);
-        } else {
-            r = PQexecParams(c, "UPDATE requests SET updated = timeofday()::timestamp, "
-                "statuscode=$2, status = 'completed', errors = $3 WHERE id = $1",
-                3, NULL, pvals, NULL, NULL, 0);
-
-        }
-        PQclear(r);
-
+        finish(c, rid, json_outcome(resp, st, sizeof st, buf, sizeof buf), pvals);
     }
 done:
     octstr_destroy(resp);
     octstr_destroy(xkey);
+    octstr_destroy(data);
+    octstr_destroy(ctype);
+    return http_status;
+}
+
+static int qstop = 0;
+static Mutex *workers_lock;
+static int num_workers;
+static stat_t *st_delivery, *st_roundtrips;
+
+static long delivery_queue_len(void *unused)
+{
+    return sched_len();
 }
 
-static void request_run(PGconn *c) {
-    int64_t *rid;
+/* Let the producer load a job again, unless it got an outcome meanwhile */
+static void forget(job_t *j)
+{
+    Octstr *xkey = octstr_format("Request-%ld", j->rid);
+
+    if (seglog_owns(j->rid))
+        seglog_release(j->rid);
+    dict_remove(req_dict, xkey);
+    octstr_destroy(xkey);
+}
+
+/* Nothing was sent for j: it is loaded again later, and so is whatever waits behind
+ * it under the same partition key, lest that overtake it */
+static void put_back(job_t *j)
+{
+    forget(j);
+    sched_drop_key(j, forget);
+    sched_done(j, 0, 0);
+}
+
+static void request_run(void *unused) {
+    job_t *j;
+    PGconn *c;
     dispatcher2conf_t config = dispatcher2conf;
 
     if (srvlist != NULL)
         gwlist_add_producer(srvlist);
-    while((rid = gwlist_consume(req_list)) != NULL) {
-        PGresult *r;
-        char tmp[64];
-        Octstr *xkey;
-        int64_t xid = *rid;
+    while(!qstop && (j = sched_next()) != NULL) {
+        int status;
+        double t0, latency = 0;
 
         time_t t = time(NULL);
         struct tm tm = gw_localtime(t);
@@ -425,73 +846,85 @@ static void request_run(PGconn *c) {
         if (!(tm.tm_hour >= config->start_submission_period
                     && tm.tm_hour <= config->end_submission_period)){
             /* warning(0, "We're out of submission period"); */
+            /* let the producer pick it up again next period */
+            put_back(j);
             gwthread_sleep(config->request_process_interval);
             continue; /* we're outide submission period so stay silent*/
         }
 
-        /* heal connection if bad*/
-        r = PQexec(c, "BEGIN");
-        PQclear(r);
-
-        sprintf(tmp, "%ld", xid);
-        xkey = octstr_format("Request-%s", tmp);
-        info(0, "Gonna call do_request");
-        do_request(c, xid);
-
-        r = PQexec(c, "COMMIT");
-        PQclear(r);
+        if (seglog_owns(j->rid))
+            c = NULL; /* in the segment log: no database until it is mirrored */
+        else if ((c = dbpool_get(DB_POOL_DELIVERY)) == NULL) {
+            /* database down or busy: the producer hands it out again once it is back */
+            put_back(j);
+            gwthread_sleep(config->request_process_interval);
+            continue;
+        }
 
-        gw_free(rid);
-        dict_remove(req_dict, xkey);
-        octstr_destroy(xkey);
+        d2log_debug("Gonna call do_request");
+        t0 = stats_now();
+        db_roundtrips_reset();
+        status = do_request(c, j->rid, &latency);
+        if (c != NULL) {
+            db_end(c); /* if do_request() had nothing to write */
+            dbpool_put(DB_POOL_DELIVERY, c);
+        }
+        stats_time(st_delivery, stats_now() - t0);
+        stats_record(st_roundtrips, db_roundtrips());
+
+        if (status == 0)
+            put_back(j);
+        else {
+            forget(j);
+            sched_done(j, status, latency);
+        }
     }
-    PQfinish(c);
+    mutex_lock(workers_lock);
+    num_workers--;
+    mutex_unlock(workers_lock);
     if (srvlist != NULL)
         gwlist_remove_producer(srvlist);
 
 }
 
-static int qstop = 0;
+static int start_request_worker(dispatcher2conf_t config)
+{
+    mutex_lock(workers_lock);
+    num_workers++;
+    mutex_unlock(workers_lock);
+    gwthread_create(request_run, NULL);
+    return 0;
+}
 
-#define HIGH_WATER_MARK 100000
 #define MAX_QLEN 100000
-static void run_request_processor(PGconn *c)
+static void run_request_processor(void *unused)
 {
     /* Start worker threads
      * Produce jobs in the server_req_list
      * */
     int i, num_threads;
-    char port_str[32];
     dispatcher2conf_t config = dispatcher2conf;
 
-    sprintf(port_str, "%d", config->dbport);
-
     info(0, "Request processor starting up...");
 
     req_dict = dict_create(config->num_threads * MAX_QLEN + 1, NULL);
-    req_list = gwlist_create();
-    gwlist_add_producer(req_list);
+    st_delivery = stats_timer("delivery.request");
+    st_roundtrips = stats_sample("delivery.db_roundtrips");
+    stats_gauge("delivery.queue", delivery_queue_len, NULL);
 
-    for (i = num_threads = 0; i<config->num_threads; i++) {
-        PGconn *conn = PQsetdbLogin(config->dbhost, config->dbport > 0 ? port_str : NULL, NULL, NULL,
-                    config->dbname, config->dbuser, config->dbpass);
-
-        if (PQstatus(conn) != CONNECTION_OK) {
-            error(0, "request_processor: Failed to connect to database: %s",
-		     PQerrorMessage(conn));
-	        PQfinish(conn);
-        } else {
-            gwthread_create((void *)request_run, conn);
+    for (i = num_threads = 0; i<config->num_threads; i++)
+        if (start_request_worker(config) == 0)
             num_threads++;
-        }
-    }
 
     if (num_threads == 0)
         goto finish;
 
     do {
+        PGconn *c;
         PGresult *r;
+        Octstr *full;
         long i, n;
+        char room[32];
         time_t t = time(NULL);
         struct tm tm = gw_localtime(t);
 
@@ -504,97 +937,231 @@ static void run_request_processor(PGconn *c)
         }
 
         gwthread_sleep(config->request_process_interval);
-        if ((n = gwlist_len(req_list)) > 0)
-            info(0, "We got here ###############%ld\n", gwlist_len(req_list));
+        if ((n = sched_len()) > 0)
+            d2log_debug("We got here ###############%ld", n);
 
         if (qstop)
             break;
-        else if ((n = gwlist_len(req_list)) > HIGH_WATER_MARK) {
+        /* the segment log first: it needs no database */
+        seglog_feed(config->max_delivery_queue - sched_len());
+        if ((n = sched_len()) >= config->max_delivery_queue) {
             warning(0, "Request processor: Too many (%ld) pending batches, will wait a little", n);
             continue;
         }
+        /* only load what fits, the rest waits in the database */
+        sprintf(room, "%ld", config->max_delivery_queue - n);
 
-        if (PQstatus(c) != CONNECTION_OK) {
-            /* Die...for real*/
-            panic(0, "Request processor: Failed to connect to database: %s",
-                    PQerrorMessage(c));
-            PQfinish(c);
-
-            c = PQsetdbLogin(config->dbhost, config->dbport > 0 ? port_str : NULL, NULL, NULL,
-                    config->dbname, config->dbuser, config->dbpass);
-            init_request_processor_sql(c);
-            goto loop;
+        if ((c = dbpool_get(DB_POOL_DELIVERY)) == NULL) {
+            warning(0, "Request processor: no database connection, will try again");
+            continue;
         }
         /*XXX lets populate server_dict here
         load_serverconf_dict(c);
         */
 
-        r = PQexecPrepared(c, "REQUEST_SQL", 0, NULL, NULL, NULL, 0);
+        /* nor more for a destination than its own share, so one backlog can't fill it */
+        full = sched_full(config->max_destination_queue);
+        if (cluster_enabled()) {
+            Octstr *owned = cluster_owned_servers();
+            const char *pvals[] = {octstr_get_cstr(owned), octstr_get_cstr(full), room};
+
+            r = db_run(c, DB_FETCH_READY_CLUSTER, pvals, NULL, NULL);
+            octstr_destroy(owned);
+        } else {
+            const char *pvals[] = {octstr_get_cstr(full), room};
+
+            r = db_run(c, DB_FETCH_READY, pvals, NULL, NULL);
+        }
+        octstr_destroy(full);
         n = PQresultStatus(r) == PGRES_TUPLES_OK ? PQntuples(r) : 0;
         if (n > 0)
-            info(0, "Got %ld Ready requests to add to request-list", n);
+            d2log_info("Got %ld Ready requests to add to request-list", n);
         for (i=0; i<n; i++) {
             char *y = PQgetvalue(r, i, 0);
             Octstr *xkey = octstr_format("Request-%s", y);
             if (dict_put_once(req_dict, xkey, (void*)1) == 1) { /* Item not in queue waiting*/
-                int64_t rid;
-                rid = y && isdigit(y[0]) ? strtoul(y, NULL, 10) : 0;
-
-                int64_t *x = gw_malloc(sizeof *x);
-                *x = rid;
-
-                gwlist_produce(req_list, x);
-                octstr_destroy(xkey);
+                char *k = PQgetvalue(r, i, 5);
+                job_t job;
+
+                job.rid = y && isdigit(y[0]) ? strtoul(y, NULL, 10) : 0;
+                job.dest = atoi(PQgetvalue(r, i, 1));
+                job.priority = atoi(PQgetvalue(r, i, 2));
+                job.due = atof(PQgetvalue(r, i, 3));
+                job.deadline = atof(PQgetvalue(r, i, 4)); /* "" if none: 0 */
+                job.key = partition_hash(k, k ? strlen(k) : 0);
+                sched_add(&job);
             }
+            octstr_destroy(xkey);
         }
         PQclear(r);
-    loop:
-        (void)0;
+        dbpool_put(DB_POOL_DELIVERY, c);
     } while (qstop == 0);
 
 finish:
-    PQfinish(c);
-    gwlist_remove_producer(req_list);
+    sched_stop();
     gwthread_join_every((void *)request_run);
-    gwlist_destroy(req_list, NULL);
     info(0, "Request processor exited!!!");
     dict_destroy(req_dict);
 }
 
-static long rthread_th = -1;
+#define IMPORT_POLL_BATCH 100
+#define MAX_IMPORT_POLL_DELAY 300 /* seconds */
+
+/* Poll an async import that has been running age seconds. Once its task has completed
+ * the summary is recorded as for a synchronous import; until then it is looked at
+ * again after as long as it has been running, within bounds */
+static void poll_import(int64_t rid, int serverid, const char *task, double age)
+{
+    char tmp[64], st[64] = {0}, buf[256] = {0};
+    const char *pvals[] = {tmp, st, buf};
+    Octstr *xkey = octstr_format("%d", serverid), *url, *resp;
+    serverconf_t *dest = dict_get(server_dict, xkey);
+    enum db_stmt s = DB_IMPORT_POLLED;
+    int http_status;
+    PGconn *c;
+
+    octstr_destroy(xkey);
+    sprintf(tmp, "%lld", (long long)rid);
+    if (age > dispatcher2conf->import_timeout)
+        s = DB_IMPORT_TIMEOUT;
+    else if (dest != NULL) {
+        stats_incr(st_import_polls);
+        url = server_url(dest, task);
+        resp = get_from_server(dest, url, &http_status);
+        if (resp && http_status == HTTP_OK && task_completed(resp)) {
+            octstr_destroy(resp);
+            octstr_replace(url, octstr_imm("/system/tasks/"), octstr_imm("/system/taskSummaries/"));
+            resp = get_from_server(dest, url, &http_status);
+            if (resp && http_status == HTTP_OK) {
+                d2log_body("Import Summary", resp);
+                s = json_outcome(resp, st, sizeof st, buf, sizeof buf);
+            }
+        }
+        octstr_destroy(resp);
+        octstr_destroy(url);
+    }
+
+    if (s == DB_IMPORT_POLLED) {
+        if (age < dispatcher2conf->import_poll_interval)
+            age = dispatcher2conf->import_poll_interval;
+        sprintf(st, "%g", age < MAX_IMPORT_POLL_DELAY ? age : MAX_IMPORT_POLL_DELAY);
+    } else if (s == DB_IMPORT_TIMEOUT) {
+        warning(0, "Request %lld: import task %s did not finish in time", (long long)rid, task);
+        stats_incr(st_import_timeouts);
+    } else
+        stats_time(st_import_time, age);
+    if ((c = dbpool_get(DB_POOL_MAINTENANCE)) == NULL)
+        return; /* polled again next time */
+    PQclear(db_run(c, s, pvals, NULL, NULL)); /* DB_IMPORT_POLLED: st is the delay */
+    dbpool_put(DB_POOL_MAINTENANCE, c);
+}
+
+/* Follows the imports of servers with async_import, in place of the workers that
+ * would otherwise wait for them to finish */
+static void import_poller(void *unused)
+{
+    dispatcher2conf_t config = dispatcher2conf;
+
+    info(0, "Import poller starting up...");
+    while (!qstop) {
+        PGconn *c;
+        PGresult *r;
+        char limit[32];
+        long i, n;
+
+        gwthread_sleep(config->import_poll_interval);
+        if (qstop || (c = dbpool_get(DB_POOL_MAINTENANCE)) == NULL)
+            continue;
+        sprintf(limit, "%d", IMPORT_POLL_BATCH);
+        if (cluster_enabled()) {
+            Octstr *owned = cluster_owned_servers();
+            const char *pvals[] = {octstr_get_cstr(owned), limit};
+
+            r = db_run(c, DB_FETCH_IMPORTS_CLUSTER, pvals, NULL, NULL);
+            octstr_destroy(owned);
+        } else {
+            const char *pvals[] = {limit};
+
+            r = db_run(c, DB_FETCH_IMPORTS, pvals, NULL, NULL);
+        }
+        dbpool_put(DB_POOL_MAINTENANCE, c); /* not held while we wait on the servers */
+
+        n = PQresultStatus(r) == PGRES_TUPLES_OK ? PQntuples(r) : 0;
+        for (i = 0; i < n && !qstop; i++)
+            poll_import(strtoll(PQgetvalue(r, i, 0), NULL, 10), atoi(PQgetvalue(r, i, 1)),
+                    PQgetvalue(r, i, 2), atof(PQgetvalue(r, i, 3)));
+        PQclear(r);
+    }
+    info(0, "Import poller exited");
+}
+
+static long rthread_th = -1, import_th = -1;
 void start_request_processor(dispatcher2conf_t config, List *server_req_list)
 {
     PGconn *c;
-    char port_str[32];
     dispatcher2conf = config;
 
-    sprintf(port_str, "%d", config->dbport);
-
-    c = PQsetdbLogin(config->dbhost, config->dbport > 0 ? port_str : NULL, NULL, NULL,
-            config->dbname, config->dbuser, config->dbpass);
-    if (PQstatus(c) != CONNECTION_OK) {
-        error(0, "Request processor: Failed to connect to database: %s",
-		PQerrorMessage(c));
+    if ((c = dbpool_get(DB_POOL_MAINTENANCE)) == NULL) {
+        error(0, "Request processor: Failed to connect to database");
         return;
     }
+    dnscache_init();
+    outbound_init();
+    sched_init(config);
     load_serverconf_dict(c);
-
-    init_request_processor_sql(c);
+    dbpool_put(DB_POOL_MAINTENANCE, c);
 
     srvlist = server_req_list;
-    rthread_th = gwthread_create((void *) run_request_processor, c);
+    workers_lock = mutex_create();
+    st_imports = stats_counter("import.submitted");
+    st_import_polls = stats_counter("import.polls");
+    st_import_timeouts = stats_counter("import.timeouts");
+    st_import_time = stats_timer("import.duration");
+    rthread_th = gwthread_create(run_request_processor, NULL);
+    if (num_async_servers > 0)
+        import_th = gwthread_create(import_poller, NULL);
 }
 
-void stop_request_processor(void)
+/* Grow or shrink the delivery workers, e.g. after a config reload.
+ * Workers only leave between requests, so nothing in flight is cut short. */
+void resize_request_processor(int n)
 {
+    int i, cur;
 
+    if (rthread_th < 0 || qstop)
+        return;
+    mutex_lock(workers_lock);
+    cur = num_workers;
+    mutex_unlock(workers_lock);
+
+    if (n > cur)
+        for (i = cur; i < n; i++)
+            start_request_worker(dispatcher2conf);
+    else if (n < cur)
+        sched_retire(cur - n);
+    if (n != cur)
+        info(0, "Request processor: resizing from %d to %d workers", cur, n);
+}
+
+void stop_request_processor(void)
+{
+     if (rthread_th < 0)
+         return;
+     /* Workers finish the request they are on and leave; the producer joins them */
      qstop = 1;
-     dict_destroy(server_dict);
-     gwthread_sleep(2); /* Give them some time */
      gwthread_wakeup(rthread_th);
-
-     gwthread_sleep(2); /* Give them some time */
      gwthread_join(rthread_th);
+     rthread_th = -1;
+     if (import_th >= 0) {
+         /* imports still running are picked up again after a restart */
+         gwthread_wakeup(import_th);
+         gwthread_join(import_th);
+         import_th = -1;
+     }
 
+     dict_destroy(server_dict);
+     sched_shutdown();
+     dnscache_shutdown();
+     mutex_destroy(workers_lock);
      info(0, "Request processor shutdown complete");
 }
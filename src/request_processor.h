@@ -21,6 +21,8 @@
 #include "dispatcher2.h"
 #include "misc.h"
 #include "conf.h"
+#include "outbound.h"
+#include <libxml/parser.h>
 
 typedef struct serverconf_t {
     int server_id;
@@ -36,9 +38,51 @@ typedef struct serverconf_t {
     Octstr *ssl_client_certkey_file;
     int start_submission_period;
     int end_submission_period;
+    int min_concurrency; /* bounds for the adaptive per-destination limit */
+    int max_concurrency;
+    int target_latency; /* ms */
+    int supersede; /* a new version of a report cancels older ones not yet sent */
+    int deadline_days; /* after the end of the reporting period; 0 = no deadlines */
+    int partition_key; /* 1 + index into the requests columns it may name, 0 = none */
+    int async_import; /* submit with async=true and poll the import task for the summary */
+    Octstr *async_url; /* url with async=true, NULL unless async_import */
+    outbound_t *client; /* NULL if the url isn't usable: gwlib's client is used */
+    Octstr *allowed_sources; /* server_allowed_sources.allowed_sources as text */
 } serverconf_t;
 
+/* parse_json_response() results */
+#define JSON_RESPONSE_OK 0
+#define JSON_RESPONSE_INVALID 4
+#define JSON_RESPONSE_NO_STATUS 5
+#define JSON_RESPONSE_NO_DESCRIPTION 6
+
+xmlChar *findvalue(xmlDocPtr doc, xmlChar *xpath, int add_namespace);
+int parse_json_response(Octstr *resp, char *st, size_t stlen, char *descr, size_t dlen);
+
 void start_request_processor(dispatcher2conf_t conf, List *server_req_list);
 void stop_request_processor(void);
+void resize_request_processor(int num_threads);
 void free_serverconf(serverconf_t *d);
+
+/* From the servers loaded at startup: a server's id by name (-1 if unknown), and
+ * whether it accepts requests from source, as is_allowed_source() would say */
+int server_id_by_name(Octstr *name);
+int server_allows_source(int dest, int source);
+int server_supersedes(int dest);
+int server_imports_async(int dest);
+
+/* The scheduler key for a request, from its destination's partition_key: a hash of the
+ * column's value as text, 0 (unordered) if there is no key or the value is empty */
+uint64_t partition_hash(const char *value, long len);
+uint64_t request_partition_key(request_t *req);
+
+/* A request's priority from priority_rules (source and report_type set), and the
+ * priority a client asked for by name or number (-1 if none or unknown) */
+int request_priority(request_t *req);
+int parse_priority(Octstr *s);
+
+/* When a request (destination, week, month and year set) is due at its destination:
+ * deadline_days after the end of its reporting period, in epoch seconds; 0 if the
+ * destination has no deadlines or the period can't be made out */
+double request_deadline(request_t *req);
 #endif
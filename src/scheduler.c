@@ -0,0 +1,493 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  scheduler.c
+ *
+ *    Description:  Delivery scheduler. Requests wait in one FIFO per destination and
+ *                  workers take them round-robin across destinations, never running
+ *                  more at once for a destination than its current limit.
+ *
+ *                  Each destination has a FIFO per priority class. Critical jobs go
+ *                  first whenever one can run; the other classes share workers by
+ *                  priority-weights, stride style: each pick advances the class's
+ *                  pass by 1/weight and the runnable class with the lowest pass is
+ *                  served next. A class that was empty rejoins at the current pass
+ *                  instead of catching up on the time it was idle.
+ *
+ *                  Within a class jobs are kept in order of due: their deadline
+ *                  (servers.deadline_days after the end of the reporting period) or,
+ *                  without one, when they were queued, so that a report close to its
+ *                  deadline overtakes a backlog of newer ones. Deliveries completed
+ *                  after their deadline are counted per destination.
+ *
+ *                  Only one job per partition key is queued or in flight at a time;
+ *                  the others are held aside, in the order they came, until it is
+ *                  done. Each key is thus delivered strictly in order, across classes
+ *                  too, while different keys run in parallel, and a key's backlog
+ *                  never stands between the workers and other keys' jobs. Keys are
+ *                  hashes: a collision only serialises two keys, it never reorders one.
+ *
+ *                  The limit is tuned AIMD style: it grows by about one per round
+ *                  trip while deliveries succeed within the target latency and the
+ *                  limit is actually in use, and is cut by 30% (at most once per
+ *                  target latency) on timeouts, connection failures, 429s and 5xx.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 17:44:36
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+#include "stats.h"
+
+#define AIMD_DECREASE 0.7
+
+struct destq {
+    int id;
+    List *jobs[NUM_PRIORITIES]; /* of job_t, by due; all may start */
+    List *held; /* of job_t whose key is busy, in the order added */
+    int inflight;
+    uint64_t *busy; /* keys with a job queued or in flight */
+    int nbusy, busy_cap;
+    double limit;
+    int min, max;
+    double target; /* seconds */
+    double last_decrease;
+    stat_t *st_increases, *st_decreases, *st_key_waits, *st_missed;
+};
+
+static dispatcher2conf_t sconf;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static List *dests; /* of struct destq */
+static long rr; /* where the next round-robin pass starts */
+static long queued;
+static long class_queued[NUM_PRIORITIES];
+static double pass[NUM_PRIORITIES], vtime; /* stride scheduling between classes */
+static const char *class_names[] = PRIORITY_NAMES;
+static stat_t *st_missed;
+static int stopping, retiring;
+
+static long destq_limit(void *q) { return (long)((struct destq *)q)->limit; }
+static long destq_inflight(void *q) { return ((struct destq *)q)->inflight; }
+static long destq_queued(void *arg)
+{
+    struct destq *q = arg;
+    long n = 0;
+    int c;
+
+    for (c = 0; c < NUM_PRIORITIES; c++)
+        n += gwlist_len(q->jobs[c]);
+    return n + gwlist_len(q->held);
+}
+
+static long class_len(void *arg)
+{
+    long n;
+
+    pthread_mutex_lock(&lock);
+    n = class_queued[(long)arg];
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/* Age of the oldest job waiting in a class, in ms */
+static long class_age(void *arg)
+{
+    double now = stats_now(), oldest = now;
+    long i, k, c = (long)arg;
+    struct destq *q;
+    job_t *j;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; dests && i < gwlist_len(dests); i++)
+        for (q = gwlist_get(dests, i), k = 0; k < gwlist_len(q->jobs[c]); k++)
+            if ((j = gwlist_get(q->jobs[c], k))->queued < oldest)
+                oldest = j->queued; /* not always the first: the queue is by due */
+    pthread_mutex_unlock(&lock);
+    return (long)((now - oldest) * 1000);
+}
+
+/* Caller holds lock */
+static struct destq *destq_get(int id)
+{
+    struct destq *q;
+    char name[64];
+    long i;
+    int c;
+
+    for (i = 0; i < gwlist_len(dests); i++)
+        if ((q = gwlist_get(dests, i))->id == id)
+            return q;
+
+    q = gw_malloc(sizeof *q);
+    memset(q, 0, sizeof *q);
+    q->id = id;
+    for (c = 0; c < NUM_PRIORITIES; c++)
+        q->jobs[c] = gwlist_create();
+    q->held = gwlist_create();
+    q->min = 1;
+    q->max = sconf->num_threads;
+    q->target = sconf->delivery_target_latency;
+    q->limit = q->min;
+    gwlist_append(dests, q);
+
+    sprintf(name, "dest.%d.limit", id);
+    stats_gauge(name, destq_limit, q);
+    sprintf(name, "dest.%d.inflight", id);
+    stats_gauge(name, destq_inflight, q);
+    sprintf(name, "dest.%d.queued", id);
+    stats_gauge(name, destq_queued, q);
+    sprintf(name, "dest.%d.limit_increases", id);
+    q->st_increases = stats_counter(name);
+    sprintf(name, "dest.%d.limit_decreases", id);
+    q->st_decreases = stats_counter(name);
+    sprintf(name, "dest.%d.key_waits", id);
+    q->st_key_waits = stats_counter(name);
+    sprintf(name, "dest.%d.deadline_missed", id);
+    q->st_missed = stats_counter(name);
+    return q;
+}
+
+void sched_init(dispatcher2conf_t config)
+{
+    char name[64];
+    long c;
+
+    sconf = config;
+    dests = gwlist_create();
+    queued = 0;
+    stopping = retiring = 0;
+    vtime = 0;
+    st_missed = stats_counter("delivery.deadline_missed");
+    for (c = 0; c < NUM_PRIORITIES; c++) {
+        class_queued[c] = 0;
+        pass[c] = 0;
+        sprintf(name, "delivery.queue.%s", class_names[c]);
+        stats_gauge(name, class_len, (void *)c);
+        sprintf(name, "delivery.queue.%s.age_ms", class_names[c]);
+        stats_gauge(name, class_age, (void *)c);
+    }
+}
+
+static void job_free(void *j)
+{
+    gw_free(j);
+}
+
+static void destq_destroy(void *p)
+{
+    struct destq *q = p;
+    int c;
+
+    for (c = 0; c < NUM_PRIORITIES; c++)
+        gwlist_destroy(q->jobs[c], job_free);
+    gwlist_destroy(q->held, job_free);
+    gw_free(q->busy);
+    gw_free(q);
+}
+
+void sched_shutdown(void)
+{
+    gwlist_destroy(dests, destq_destroy);
+    dests = NULL;
+}
+
+void sched_configure(int dest, int min, int max, double target_latency)
+{
+    struct destq *q;
+
+    pthread_mutex_lock(&lock);
+    q = destq_get(dest);
+    q->min = min > 0 ? min : 1;
+    q->max = max > 0 ? max : (int)sconf->num_threads;
+    if (q->max < q->min)
+        q->max = q->min;
+    q->target = target_latency > 0 ? target_latency : sconf->delivery_target_latency;
+    if (q->limit < q->min)
+        q->limit = q->min;
+    else if (q->limit > q->max)
+        q->limit = q->max;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Caller holds lock */
+static int key_busy(struct destq *q, uint64_t key)
+{
+    int i;
+
+    for (i = 0; i < q->nbusy; i++)
+        if (q->busy[i] == key)
+            return 1;
+    return 0;
+}
+
+/* Caller holds lock */
+static void key_add(struct destq *q, uint64_t key)
+{
+    if (q->nbusy == q->busy_cap) {
+        q->busy_cap = q->busy_cap ? 2 * q->busy_cap : 8;
+        q->busy = gw_realloc(q->busy, q->busy_cap * sizeof q->busy[0]);
+    }
+    q->busy[q->nbusy++] = key;
+}
+
+/* Caller holds lock */
+static void key_remove(struct destq *q, uint64_t key)
+{
+    int i;
+
+    for (i = 0; i < q->nbusy; i++)
+        if (q->busy[i] == key) {
+            q->busy[i] = q->busy[--q->nbusy];
+            break;
+        }
+}
+
+/* Put j in its class, in order of due; caller holds lock */
+static void enqueue(struct destq *q, job_t *j)
+{
+    List *jobs = q->jobs[j->priority];
+    long i;
+
+    /* from the back: jobs mostly arrive in order of due */
+    for (i = gwlist_len(jobs); i > 0; i--)
+        if (((job_t *)gwlist_get(jobs, i - 1))->due <= j->due)
+            break;
+    gwlist_insert(jobs, i, j);
+    if (class_queued[j->priority]++ == 0 && pass[j->priority] < vtime)
+        pass[j->priority] = vtime; /* no credit for the time it had nothing */
+}
+
+void sched_add(const job_t *job)
+{
+    job_t *j = gw_malloc(sizeof *j);
+    struct destq *q;
+
+    *j = *job;
+    if (j->priority < 0 || j->priority >= NUM_PRIORITIES)
+        j->priority = PRIORITY_NORMAL;
+    j->queued = stats_now();
+    pthread_mutex_lock(&lock);
+    q = destq_get(j->dest);
+    queued++;
+    if (j->key != 0 && key_busy(q, j->key)) {
+        gwlist_append(q->held, j); /* waits for the one before it */
+        stats_incr(q->st_key_waits);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (j->key != 0)
+        key_add(q, j->key);
+    enqueue(q, j);
+    pthread_mutex_unlock(&lock);
+    pthread_cond_signal(&ready);
+}
+
+/* Round-robin over the destinations with a runnable job in class c; caller holds lock */
+static job_t *pick_class(int c)
+{
+    long i, n = gwlist_len(dests);
+    job_t *j;
+
+    for (i = 0; i < n; i++) {
+        struct destq *q = gwlist_get(dests, (rr + i) % n);
+
+        if (q->inflight < (int)q->limit && (j = gwlist_extract_first(q->jobs[c])) != NULL) {
+            rr = (rr + i + 1) % n;
+            q->inflight++;
+            queued--;
+            class_queued[c]--;
+            return j;
+        }
+    }
+    return NULL;
+}
+
+/* Caller holds lock */
+static job_t *pick(void)
+{
+    int order[NUM_PRIORITIES], n = 0, i, c;
+    job_t *j;
+
+    /* critical first, then the others by pass; only classes with jobs */
+    if (class_queued[PRIORITY_CRITICAL] > 0)
+        order[n++] = PRIORITY_CRITICAL;
+    for (c = PRIORITY_HIGH; c < NUM_PRIORITIES; c++) {
+        if (class_queued[c] == 0)
+            continue;
+        for (i = n; i > 0 && order[i - 1] != PRIORITY_CRITICAL && pass[order[i - 1]] > pass[c]; i--)
+            order[i] = order[i - 1];
+        order[i] = c;
+        n++;
+    }
+    for (i = 0; i < n; i++)
+        if ((j = pick_class(order[i])) != NULL) {
+            if (order[i] != PRIORITY_CRITICAL) {
+                vtime = pass[order[i]];
+                pass[order[i]] += 1.0 / sconf->priority_weights[order[i]];
+            }
+            return j;
+        }
+    return NULL;
+}
+
+job_t *sched_next(void)
+{
+    job_t *j = NULL;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        if (stopping)
+            break;
+        if (retiring > 0) {
+            retiring--;
+            break;
+        }
+        if ((j = pick()) != NULL)
+            break;
+        pthread_cond_wait(&ready, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return j;
+}
+
+/* Caller holds lock */
+static void adjust(struct destq *q, int status, double latency)
+{
+    double now = stats_now();
+    int old = (int)q->limit;
+
+    if (status < 0 || status == 429 || status >= 500) {
+        if (now - q->last_decrease < q->target)
+            return; /* one cut per episode, not one per failed request */
+        q->last_decrease = now;
+        q->limit *= AIMD_DECREASE;
+        if (q->limit < q->min)
+            q->limit = q->min;
+        if ((int)q->limit < old) {
+            stats_incr(q->st_decreases);
+            info(0, "scheduler: destination %d concurrency %d -> %d (status %d, %.0fms)",
+                    q->id, old, (int)q->limit, status, latency * 1000);
+        }
+    } else if (latency <= q->target && q->inflight + 1 >= old) {
+        q->limit += 1 / q->limit;
+        if (q->limit > q->max)
+            q->limit = q->max;
+        if ((int)q->limit > old) {
+            stats_incr(q->st_increases);
+            info(0, "scheduler: destination %d concurrency %d -> %d", q->id, old, (int)q->limit);
+        }
+    }
+}
+
+void sched_done(job_t *j, int status, double latency)
+{
+    struct destq *q;
+    job_t *x;
+    long i;
+
+    pthread_mutex_lock(&lock);
+    q = destq_get(j->dest);
+    q->inflight--;
+    if (j->key != 0) {
+        /* the next job under this key, if any, may start now */
+        for (i = 0; i < gwlist_len(q->held); i++)
+            if ((x = gwlist_get(q->held, i))->key == j->key)
+                break;
+        if (i < gwlist_len(q->held)) {
+            gwlist_delete(q->held, i, 1);
+            enqueue(q, x);
+        } else
+            key_remove(q, j->key);
+    }
+    if (status != 0)
+        adjust(q, status, latency);
+    if (status != 0 && j->deadline > 0 && time(NULL) > j->deadline) {
+        stats_incr(q->st_missed);
+        stats_incr(st_missed);
+    }
+    pthread_mutex_unlock(&lock);
+    pthread_cond_broadcast(&ready); /* the limit may have gone up */
+    gw_free(j);
+}
+
+long sched_drop_key(job_t *j, void (*fn)(job_t *))
+{
+    List *dropped;
+    struct destq *q;
+    job_t *x;
+    long i;
+
+    if (j->key == 0)
+        return 0;
+    dropped = gwlist_create();
+    pthread_mutex_lock(&lock);
+    q = destq_get(j->dest);
+    for (i = 0; i < gwlist_len(q->held); )
+        if ((x = gwlist_get(q->held, i))->key == j->key) {
+            gwlist_delete(q->held, i, 1);
+            gwlist_append(dropped, x);
+            queued--;
+        } else
+            i++;
+    pthread_mutex_unlock(&lock);
+
+    /* outside the lock: fn may well add jobs */
+    i = gwlist_len(dropped);
+    while ((x = gwlist_extract_first(dropped)) != NULL) {
+        fn(x);
+        gw_free(x);
+    }
+    gwlist_destroy(dropped, NULL);
+    return i;
+}
+
+void sched_retire(int n)
+{
+    pthread_mutex_lock(&lock);
+    retiring += n;
+    pthread_mutex_unlock(&lock);
+    pthread_cond_broadcast(&ready);
+}
+
+void sched_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_mutex_unlock(&lock);
+    pthread_cond_broadcast(&ready);
+}
+
+long sched_len(void)
+{
+    long n;
+
+    pthread_mutex_lock(&lock);
+    n = queued;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+Octstr *sched_full(long max)
+{
+    Octstr *s = octstr_create("{");
+    struct destq *q;
+    long i, n = 0;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < gwlist_len(dests); i++)
+        if (destq_queued(q = gwlist_get(dests, i)) >= max)
+            octstr_format_append(s, "%s%d", n++ ? "," : "", q->id);
+    pthread_mutex_unlock(&lock);
+    octstr_append_char(s, '}');
+    return s;
+}
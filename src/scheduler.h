@@ -0,0 +1,73 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  scheduler.h
+ *
+ *    Description:  Queue of requests waiting for delivery, handed to the delivery
+ *                  workers subject to a per-destination concurrency limit and, where
+ *                  a destination has a partition key, one at a time per key. Priority
+ *                  classes are served critical first, the rest by weight; within a
+ *                  class, earliest deadline first.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 17:40:12
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_SCHEDULER_H
+#define __DISPATCHER2_SCHEDULER_H
+
+#include <stdint.h>
+#include "conf.h"
+
+typedef struct job {
+    int64_t rid;
+    int dest;
+    uint64_t key; /* partition key hash: one job per key in flight, in order; 0 = none */
+    int priority; /* PRIORITY_* */
+    double due; /* epoch seconds: the deadline, or when it was queued if it has none */
+    double deadline; /* epoch seconds, 0 = none */
+    double queued; /* stats_now() when added */
+} job_t;
+
+void sched_init(dispatcher2conf_t config);
+void sched_shutdown(void);
+
+/* Concurrency bounds for a destination (max 0 = max-concurrent) and the latency, in
+ * seconds, under which its limit is allowed to grow (0 = delivery-target-latency) */
+void sched_configure(int dest, int min, int max, double target_latency);
+
+/* Queue a copy of j (rid, dest, key, priority, due and deadline set). Jobs for a
+ * destination and priority start in order of due, ties in the order added; a job with a
+ * non-zero key waits, whatever its priority, until those added before it with that key
+ * are done */
+void sched_add(const job_t *j);
+
+/* Block until a job may be started. NULL means the calling worker should exit. */
+job_t *sched_next(void);
+
+/* Hand back a job from sched_next() and free it. status is the destination's HTTP
+ * status, -1 if it could not be reached or 0 if nothing was sent; latency in seconds. */
+void sched_done(job_t *j, int status, double latency);
+
+/* Nothing was sent for j and it will be added again later: take out the jobs waiting
+ * behind it under its key, so they don't overtake it, and pass each to fn before it is
+ * freed. Call before sched_done(j). Returns how many were taken out. */
+long sched_drop_key(job_t *j, void (*fn)(job_t *));
+
+/* Make n workers exit at their next sched_next() */
+void sched_retire(int n);
+/* Make all workers exit */
+void sched_stop(void);
+
+/* Jobs waiting */
+long sched_len(void);
+/* Destinations with at least max jobs waiting, as a PostgreSQL array literal */
+Octstr *sched_full(long max);
+
+#endif
@@ -0,0 +1,1015 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  seglog.c
+ *
+ *    Description:  Segment log queue. Records go one after the other into segment files
+ *                  of segment-size bytes, mapped into memory. An appender waits until a
+ *                  syncer thread has flushed its record; the syncer flushes whatever
+ *                  accumulated in segment-fsync-interval in one msync, so concurrent
+ *                  requests share the cost of the flush (group commit).
+ *
+ *                  A request's life is three records: REQUEST when it is queued, DONE
+ *                  with the outcome of its delivery and MIRRORED once a mirror thread
+ *                  has copied it to the requests table. Ids are consecutive, so the
+ *                  index is an array from id to record. A segment whose requests are
+ *                  all mirrored is deleted. On startup the segments are replayed:
+ *                  requests without a DONE are delivered again, DONE without MIRRORED
+ *                  are mirrored again (so a crash may repeat a delivery or a mirror,
+ *                  never lose one).
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 23:36:48
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "seglog.h"
+#include "scheduler.h"
+#include "request_processor.h"
+#include "dedup.h"
+#include "dbpool.h"
+#include "stats.h"
+
+#define SEGLOG_MAGIC 0xD25E610BU
+
+enum { REC_REQUEST = 1, REC_DONE, REC_MIRRORED };
+
+/* The outcome in a DONE record is a code of its own: enum db_stmt moves whenever a
+ * statement is added. The codes are what the first version of the format wrote; never
+ * change one, only add */
+static const struct {
+    int code;
+    enum db_stmt stmt;
+} outcomes[] = {
+    {8, DB_REQUEST_EXPIRED},
+    {9, DB_REQUEST_EMPTY},
+    {10, DB_REQUEST_UNREACHABLE},
+    {11, DB_REQUEST_SENT},
+    {12, DB_REQUEST_BAD_XML},
+    {13, DB_REQUEST_BAD_JSON},
+    {14, DB_REQUEST_NO_STATUS},
+    {15, DB_REQUEST_NO_DESCRIPTION},
+    {16, DB_REQUEST_FAILED},
+    {17, DB_REQUEST_COMPLETED},
+};
+
+/* Record header; the fields follow, and the record is padded to 8 bytes */
+struct rec {
+    uint32_t magic;
+    uint32_t sum; /* FNV-1a over type, id and the fields: a torn write fails it */
+    uint32_t len; /* of the fields */
+    uint32_t type;
+    int64_t id;
+};
+
+#define REC_SIZE(len) ((sizeof (struct rec) + (len) + 7) & ~(size_t)7)
+
+struct segment {
+    int fd;
+    char *base;
+    long used; /* bytes written */
+    long synced; /* bytes known to be on disk */
+    int live; /* requests not mirrored yet */
+    int sealed; /* full: no more appends */
+    int syncing; /* the syncer is flushing it */
+    char path[512];
+};
+
+/* entry states */
+enum { E_UNUSED, E_IDLE, E_QUEUED, E_INFLIGHT, E_DONE, E_MIRRORED };
+
+struct entry {
+    struct segment *seg;
+    long off; /* of the REQUEST record */
+    int64_t lsn; /* end of the REQUEST record in the log, see synced_lsn */
+    int state;
+    int dest, source;
+    int64_t msgid; /* > 0: in submissions until mirrored */
+    uint64_t key; /* partition key hash, for the scheduler */
+    int priority;
+    double due, deadline; /* see job_t */
+    int stmt; /* outcome, once E_DONE */
+    Octstr *statuscode, *errors;
+};
+
+static dispatcher2conf_t sconf;
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dirty = PTHREAD_COND_INITIALIZER; /* for the syncer */
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER; /* for appenders */
+static List *segs; /* of struct segment, oldest first; the last is being appended to */
+static struct segment *active;
+static struct entry *entries; /* entries[i] is id index_base + i */
+static long index_start, index_len, index_cap; /* entries before index_start are gone */
+static int64_t index_base, next_id;
+static int64_t lsn, synced_lsn; /* bytes appended since startup / of those, on disk */
+static long idle; /* entries in E_IDLE */
+static int failed = 0; /* a flush failed: stop taking appends */
+static int sstop = 0;
+static List *to_mirror; /* of boxed ids */
+static List *routes; /* of Octstr server names, empty = all */
+static Dict *submissions; /* "source:msgid" -> id, of requests not in the table yet */
+
+static stat_t *st_appends, *st_commit, *st_flushes, *st_mirrored, *st_compacted;
+
+static uint32_t checksum(const char *p, long len, uint32_t h)
+{
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*p++) * 16777619U;
+    return h;
+}
+
+static int outcome_code(enum db_stmt s)
+{
+    int i;
+
+    for (i = 0; i < NELEMS(outcomes); i++)
+        if (outcomes[i].stmt == s)
+            return outcomes[i].code;
+    return 0;
+}
+
+/* A DONE record's outcome as a statement; one we don't know is mirrored as failed */
+static enum db_stmt outcome_stmt(int64_t id, int64_t code)
+{
+    int i;
+
+    for (i = 0; i < NELEMS(outcomes); i++)
+        if (outcomes[i].code == code)
+            return outcomes[i].stmt;
+    warning(0, "seglog: request %lld has unknown outcome %lld, recording it as failed",
+            (long long)(id & ~SEGLOG_ID_BIT), (long long)code);
+    return DB_REQUEST_FAILED;
+}
+
+/* ---- encoding ---- */
+
+struct writer {
+    char *p;
+};
+
+static void put_i64(struct writer *w, int64_t v)
+{
+    memcpy(w->p, &v, sizeof v);
+    w->p += sizeof v;
+}
+
+static void put_str(struct writer *w, const char *s, long len)
+{
+    uint32_t n = len;
+
+    memcpy(w->p, &n, sizeof n);
+    memcpy(w->p + sizeof n, s, len);
+    w->p += sizeof n + len;
+}
+
+static void put_octstr(struct writer *w, Octstr *s)
+{
+    put_str(w, s ? octstr_get_cstr(s) : "", s ? octstr_len(s) : 0);
+}
+
+struct reader {
+    const char *p, *end;
+};
+
+static int64_t get_i64(struct reader *r)
+{
+    int64_t v = 0;
+
+    if (r->end - r->p >= (long)sizeof v) {
+        memcpy(&v, r->p, sizeof v);
+        r->p += sizeof v;
+    }
+    return v;
+}
+
+static Octstr *get_octstr(struct reader *r)
+{
+    uint32_t n = 0;
+
+    if (r->end - r->p >= (long)sizeof n)
+        memcpy(&n, r->p, sizeof n);
+    if (r->end - r->p < (long)(sizeof n + n)) {
+        r->p = r->end;
+        return octstr_create("");
+    }
+    r->p += sizeof n + n;
+    return octstr_create_from_data(r->p - n, n);
+}
+
+static long request_len(request_t *req)
+{
+    Octstr *s[] = {req->payload, req->ctype, req->is_qparams, req->week, req->month,
+        req->msisdn, req->raw_msg, req->facility, req->district, req->report_type};
+    long len = 7 * sizeof (int64_t);
+    int i;
+
+    for (i = 0; i < sizeof s / sizeof s[0]; i++)
+        len += sizeof (uint32_t) + (s[i] ? octstr_len(s[i]) : 0);
+    return len;
+}
+
+/* due: see job_t */
+static void put_request(struct writer *w, request_t *req, double due)
+{
+    put_i64(w, req->source);
+    put_i64(w, req->destination);
+    put_i64(w, req->msgid);
+    put_i64(w, req->year);
+    put_octstr(w, req->payload);
+    put_octstr(w, req->ctype);
+    put_octstr(w, req->is_qparams);
+    put_octstr(w, req->week);
+    put_octstr(w, req->month);
+    put_octstr(w, req->msisdn);
+    put_octstr(w, req->raw_msg);
+    put_octstr(w, req->facility);
+    put_octstr(w, req->district);
+    put_octstr(w, req->report_type);
+    put_i64(w, req->priority); /* these last: records written before them have none */
+    put_i64(w, req->deadline);
+    put_i64(w, due);
+}
+
+/* all = 0: only what delivery needs; due may be NULL */
+static void get_request(struct reader *r, request_t *req, int all, double *due)
+{
+    memset(req, 0, sizeof *req);
+    req->source = get_i64(r);
+    req->destination = get_i64(r);
+    req->msgid = get_i64(r);
+    req->year = get_i64(r);
+    req->payload = get_octstr(r);
+    req->ctype = get_octstr(r);
+    req->is_qparams = get_octstr(r);
+    if (!all)
+        return;
+    req->week = get_octstr(r);
+    req->month = get_octstr(r);
+    req->msisdn = get_octstr(r);
+    req->raw_msg = get_octstr(r);
+    req->facility = get_octstr(r);
+    req->district = get_octstr(r);
+    req->report_type = get_octstr(r);
+    req->priority = r->p < r->end ? get_i64(r) : PRIORITY_NORMAL;
+    req->deadline = r->p < r->end ? get_i64(r) : 0;
+    if (due)
+        *due = r->p < r->end ? get_i64(r) : time(NULL);
+}
+
+void seglog_request_free(request_t *req)
+{
+    octstr_destroy(req->payload);
+    octstr_destroy(req->ctype);
+    octstr_destroy(req->is_qparams);
+    octstr_destroy(req->week);
+    octstr_destroy(req->month);
+    octstr_destroy(req->msisdn);
+    octstr_destroy(req->raw_msg);
+    octstr_destroy(req->facility);
+    octstr_destroy(req->district);
+    octstr_destroy(req->report_type);
+    memset(req, 0, sizeof *req);
+}
+
+/* ---- segments ---- */
+
+static struct segment *segment_open(const char *path, int create)
+{
+    struct segment *s;
+    struct stat st;
+    int fd, err;
+
+    if ((fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600)) < 0) {
+        error(errno, "seglog: could not open %s", path);
+        return NULL;
+    }
+    /* Allocate the blocks now rather than leave holes: a write through the mapping to a
+     * page the full disk can't back is a SIGBUS, whereas failing here just sends
+     * requests to the database */
+    if (create && (err = posix_fallocate(fd, 0, sconf->segment_size)) != 0) {
+        error(err, "seglog: could not allocate %ld bytes for %s", sconf->segment_size, path);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        error(errno, "seglog: could not size %s", path);
+        close(fd);
+        return NULL;
+    }
+    s = gw_malloc(sizeof *s);
+    memset(s, 0, sizeof *s);
+    s->fd = fd;
+    snprintf(s->path, sizeof s->path, "%s", path);
+    s->base = mmap(NULL, sconf->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (st.st_size < sconf->segment_size || s->base == MAP_FAILED) {
+        error(errno, "seglog: could not map %s (is segment-size smaller than it?)", path);
+        close(fd);
+        gw_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void segment_close(struct segment *s, int remove)
+{
+    munmap(s->base, sconf->segment_size);
+    close(s->fd);
+    if (remove && unlink(s->path) < 0)
+        warning(errno, "seglog: could not remove %s", s->path);
+    gw_free(s);
+}
+
+/* Make the directory entry of a new segment durable too */
+static void sync_dir(void)
+{
+    int fd = open(sconf->segment_log_dir, O_RDONLY);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Start a new segment; called with the lock held */
+static int roll(void)
+{
+    char path[512];
+    struct segment *s;
+
+    snprintf(path, sizeof path, "%s/%020lld.seg", sconf->segment_log_dir,
+            (long long)(next_id & ~SEGLOG_ID_BIT));
+    if ((s = segment_open(path, 1)) == NULL)
+        return -1;
+    sync_dir();
+    if (active != NULL) {
+        /* rare enough to do here: everything before the new segment is now on disk */
+        if (msync(active->base, active->used, MS_SYNC) < 0) {
+            error(errno, "seglog: could not flush %s", active->path);
+            segment_close(s, 1);
+            return -1;
+        }
+        active->synced = active->used;
+        active->sealed = 1;
+        synced_lsn = lsn;
+        pthread_cond_broadcast(&synced);
+    }
+    gwlist_append(segs, s);
+    active = s;
+    return 0;
+}
+
+/* Write a record into the active segment, rolling over if it doesn't fit. Called with
+ * the lock held; returns the record's offset or -1 */
+static long append(int type, int64_t id, long len, struct writer *w)
+{
+    struct rec h;
+    long off;
+
+    if ((long)REC_SIZE(len) > sconf->segment_size || failed)
+        return -1;
+    if (active == NULL || active->used + (long)REC_SIZE(len) > sconf->segment_size)
+        if (roll() < 0)
+            return -1;
+    off = active->used;
+    w->p = active->base + off + sizeof h;
+    h.magic = SEGLOG_MAGIC;
+    h.len = len;
+    h.type = type;
+    h.id = id;
+    /* the caller fills in the fields, then finish_append() seals the record */
+    memcpy(active->base + off, &h, sizeof h);
+    return off;
+}
+
+static void finish_append(long off)
+{
+    struct rec *h = (struct rec *)(active->base + off);
+
+    h->sum = checksum((char *)&h->type, sizeof h->type + sizeof h->id + h->len, 2166136261U);
+    active->used += REC_SIZE(h->len);
+    lsn += REC_SIZE(h->len);
+    pthread_cond_signal(&dirty);
+}
+
+/* Wait until everything appended so far is on disk; called with the lock held */
+static int wait_synced(void)
+{
+    int64_t mine = lsn;
+    double t0 = stats_now();
+
+    while (synced_lsn < mine && !failed)
+        pthread_cond_wait(&synced, &lock);
+    stats_time(st_commit, stats_now() - t0);
+    return synced_lsn >= mine ? 0 : -1;
+}
+
+static void syncer(void *unused)
+{
+    pthread_mutex_lock(&lock);
+    while (!sstop || synced_lsn < lsn) {
+        struct segment *s;
+        long from, to, page = sysconf(_SC_PAGESIZE);
+        int64_t upto;
+        int ret;
+
+        if (synced_lsn >= lsn) {
+            pthread_cond_wait(&dirty, &lock);
+            continue;
+        }
+        /* let more appends join this flush */
+        pthread_mutex_unlock(&lock);
+        gwthread_sleep(sconf->segment_fsync_interval);
+        pthread_mutex_lock(&lock);
+
+        s = active;
+        upto = lsn;
+        from = s->synced - s->synced % page;
+        to = s->used;
+        s->syncing = 1;
+        pthread_mutex_unlock(&lock);
+
+        ret = msync(s->base + from, to - from, MS_SYNC);
+        stats_incr(st_flushes);
+
+        pthread_mutex_lock(&lock);
+        s->syncing = 0;
+        if (ret < 0) {
+            error(errno, "seglog: could not flush %s, new requests go to the database", s->path);
+            failed = 1;
+        } else {
+            if (s->synced < to)
+                s->synced = to;
+            if (synced_lsn < upto)
+                synced_lsn = upto;
+        }
+        pthread_cond_broadcast(&synced);
+        if (failed)
+            break;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* ---- index ---- */
+
+static struct entry *entry(int64_t id)
+{
+    long i = id - index_base;
+
+    return i >= index_start && i < index_len ? &entries[i] : NULL;
+}
+
+static struct entry *index_add(int64_t id)
+{
+    struct entry *e;
+
+    if (index_len == 0 && index_start == 0)
+        index_base = id;
+    while (index_base + index_len <= id) {
+        if (index_len == index_cap) {
+            index_cap = index_cap ? 2 * index_cap : 1024;
+            entries = gw_realloc(entries, index_cap * sizeof entries[0]);
+        }
+        e = &entries[index_len++];
+        memset(e, 0, sizeof *e); /* E_UNUSED: a gap left by a torn record */
+    }
+    return &entries[id - index_base];
+}
+
+static Octstr *submission_key(int source, int64_t msgid)
+{
+    return octstr_format("%d:%lld", source, (long long)msgid);
+}
+
+/* A new entry for a request just appended or replayed; called with the lock held */
+static void remember(struct entry *e, int64_t id, request_t *req, double due)
+{
+    Octstr *xkey;
+
+    e->dest = req->destination;
+    e->source = req->source;
+    e->msgid = req->msgid;
+    e->key = request_partition_key(req);
+    e->priority = req->priority;
+    e->deadline = req->deadline;
+    e->due = due;
+    if (e->msgid > 0) {
+        xkey = submission_key(e->source, e->msgid);
+        dict_put(submissions, xkey, (void *)(intptr_t)id);
+        octstr_destroy(xkey);
+        dedup_add(e->source, e->msgid);
+    }
+}
+
+static void set_state(struct entry *e, int state)
+{
+    Octstr *xkey;
+
+    if (e->state == E_IDLE)
+        idle--;
+    if (state == E_IDLE)
+        idle++;
+    if (state == E_MIRRORED && e->seg != NULL)
+        e->seg->live--;
+    if (state == E_MIRRORED && e->msgid > 0) {
+        /* in requests now, where dedup_lookup() finds it */
+        xkey = submission_key(e->source, e->msgid);
+        dict_remove(submissions, xkey);
+        octstr_destroy(xkey);
+    }
+    e->state = state;
+}
+
+/* Drop segments whose requests are all mirrored; called with the lock held */
+static void compact(void)
+{
+    struct segment *s;
+
+    while (gwlist_len(segs) > 1 && (s = gwlist_get(segs, 0))->sealed && s->live == 0 && !s->syncing) {
+        while (index_start < index_len &&
+                (entries[index_start].seg == s || entries[index_start].state == E_UNUSED)) {
+            octstr_destroy(entries[index_start].statuscode);
+            octstr_destroy(entries[index_start].errors);
+            index_start++;
+        }
+        gwlist_delete(segs, 0, 1);
+        segment_close(s, 1);
+        stats_incr(st_compacted);
+    }
+    if (index_start > 0 && index_start >= index_len / 2) {
+        memmove(entries, entries + index_start, (index_len - index_start) * sizeof entries[0]);
+        index_base += index_start;
+        index_len -= index_start;
+        index_start = 0;
+    }
+}
+
+/* ---- recovery ---- */
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void replay_segment(struct segment *s)
+{
+    request_t req;
+    double due;
+    long off = 0;
+
+    while (off + (long)sizeof (struct rec) <= sconf->segment_size) {
+        struct rec *h = (struct rec *)(s->base + off);
+        struct reader r;
+        struct entry *e;
+
+        if (h->magic != SEGLOG_MAGIC || (long)REC_SIZE(h->len) > sconf->segment_size - off ||
+                h->sum != checksum((char *)&h->type, sizeof h->type + sizeof h->id + h->len, 2166136261U))
+            break; /* end of what was written */
+        r.p = s->base + off + sizeof *h;
+        r.end = r.p + h->len;
+        switch (h->type) {
+            case REC_REQUEST:
+                e = index_add(h->id);
+                e->seg = s;
+                e->off = off;
+                e->lsn = 0; /* on disk */
+                get_request(&r, &req, 1, &due);
+                remember(e, h->id, &req, due);
+                seglog_request_free(&req);
+                set_state(e, E_IDLE);
+                s->live++;
+                if (next_id <= h->id)
+                    next_id = h->id + 1;
+                break;
+            case REC_DONE:
+                if ((e = entry(h->id)) != NULL && e->state == E_IDLE) {
+                    set_state(e, E_DONE);
+                    e->stmt = outcome_stmt(h->id, get_i64(&r));
+                    e->statuscode = get_octstr(&r);
+                    e->errors = get_octstr(&r);
+                }
+                break;
+            case REC_MIRRORED:
+                if ((e = entry(h->id)) != NULL && e->state != E_MIRRORED && e->state != E_UNUSED)
+                    set_state(e, E_MIRRORED);
+                break;
+        }
+        off += REC_SIZE(h->len);
+    }
+    s->used = s->synced = off;
+}
+
+static int replay(void)
+{
+    DIR *d;
+    struct dirent *de;
+    char **names = NULL, path[512];
+    long n = 0, i;
+
+    if ((d = opendir(sconf->segment_log_dir)) == NULL) {
+        error(errno, "seglog: could not open segment-log-dir %s", sconf->segment_log_dir);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        long len = strlen(de->d_name);
+
+        if (len > 4 && strcmp(de->d_name + len - 4, ".seg") == 0) {
+            names = gw_realloc(names, (n + 1) * sizeof names[0]);
+            names[n++] = gw_strdup(de->d_name);
+        }
+    }
+    closedir(d);
+    qsort(names, n, sizeof names[0], by_name);
+
+    for (i = 0; i < n; i++) {
+        struct segment *s;
+
+        snprintf(path, sizeof path, "%s/%s", sconf->segment_log_dir, names[i]);
+        if ((s = segment_open(path, 0)) != NULL) {
+            replay_segment(s);
+            s->sealed = 1;
+            gwlist_append(segs, s);
+            if (next_id <= (strtoll(names[i], NULL, 10) | SEGLOG_ID_BIT))
+                next_id = strtoll(names[i], NULL, 10) | SEGLOG_ID_BIT;
+        }
+        gw_free(names[i]);
+    }
+    gw_free(names);
+    /* carry on in the last one */
+    if ((active = gwlist_len(segs) > 0 ? gwlist_get(segs, gwlist_len(segs) - 1) : NULL) != NULL)
+        active->sealed = 0;
+    return 0;
+}
+
+/* ---- mirroring to the requests table ---- */
+
+static int mirror_one(PGconn *c, int64_t id)
+{
+    struct request_params p;
+    struct reader rd;
+    request_t req;
+    struct entry *e;
+    Octstr *statuscode, *errors;
+    PGresult *r;
+    char *state;
+    int stmt, ok = 0, duplicate = 0;
+
+    pthread_mutex_lock(&lock);
+    if ((e = entry(id)) == NULL || e->state != E_DONE) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    rd.p = e->seg->base + e->off + sizeof (struct rec);
+    rd.end = rd.p + ((struct rec *)(e->seg->base + e->off))->len;
+    get_request(&rd, &req, 1, NULL);
+    stmt = e->stmt;
+    statuscode = octstr_duplicate(e->statuscode);
+    errors = octstr_duplicate(e->errors);
+    pthread_mutex_unlock(&lock);
+
+    request_to_params(&req, sconf, &p);
+    p.pvals[13] = "completed"; /* until the outcome below, in the same transaction */
+    PQclear(PQexec(c, "BEGIN"));
+    r = db_run(c, DB_SAVE_REQUEST, p.pvals, p.plens, p.pfrmt);
+    if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0) {
+        const char *pvals[] = {PQgetvalue(r, 0, 0), octstr_get_cstr(statuscode), octstr_get_cstr(errors)};
+        PGresult *r2 = db_run(c, stmt, pvals, NULL, NULL);
+
+        ok = PQresultStatus(r2) == PGRES_COMMAND_OK;
+        PQclear(r2);
+    } else if ((state = PQresultErrorField(r, PG_DIAG_SQLSTATE)) && strcmp(state, "23505") == 0) {
+        /* a copy of this submission went to requests while we had it: that row stands */
+        warning(0, "seglog: request %lld duplicates source %d msgid %lld in requests, not copied",
+                (long long)id, req.source, (long long)req.msgid);
+        duplicate = ok = 1;
+    }
+    PQclear(r);
+    PQclear(PQexec(c, ok && !duplicate ? "COMMIT" : "ROLLBACK"));
+    if (ok && PQstatus(c) != CONNECTION_OK)
+        ok = 0;
+    seglog_request_free(&req);
+    octstr_destroy(statuscode);
+    octstr_destroy(errors);
+    if (!ok)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    if ((e = entry(id)) != NULL && e->state == E_DONE) {
+        struct writer w;
+        long off = append(REC_MIRRORED, id, 0, &w);
+
+        /* not waited for: if it is lost the request is mirrored twice, not dropped */
+        if (off >= 0)
+            finish_append(off);
+        set_state(e, E_MIRRORED);
+        octstr_destroy(e->statuscode);
+        octstr_destroy(e->errors);
+        e->statuscode = e->errors = NULL;
+    }
+    compact();
+    pthread_mutex_unlock(&lock);
+    stats_incr(st_mirrored);
+    return 0;
+}
+
+static void mirror(void *unused)
+{
+    int64_t *id;
+
+    while ((id = gwlist_consume(to_mirror)) != NULL) {
+        PGconn *c = dbpool_get(DB_POOL_MAINTENANCE);
+
+        if (c == NULL || mirror_one(c, *id) < 0) {
+            dbpool_put(DB_POOL_MAINTENANCE, c);
+            if (sstop) { /* still DONE on disk: mirrored after the restart */
+                gw_free(id);
+                continue;
+            }
+            gwlist_produce(to_mirror, id);
+            gwthread_sleep(1);
+            continue;
+        }
+        dbpool_put(DB_POOL_MAINTENANCE, c);
+        gw_free(id);
+    }
+}
+
+static void queue_mirror(int64_t id)
+{
+    int64_t *x = gw_malloc(sizeof *x);
+
+    *x = id;
+    gwlist_produce(to_mirror, x);
+}
+
+/* ---- API ---- */
+
+int seglog_routes(Octstr *dest)
+{
+    long i;
+
+    if (!enabled || dest == NULL)
+        return 0;
+    if (gwlist_len(routes) == 0)
+        return 1;
+    for (i = 0; i < gwlist_len(routes); i++)
+        if (octstr_compare(gwlist_get(routes, i), dest) == 0)
+            return 1;
+    return 0;
+}
+
+int64_t seglog_find(int source, int64_t msgid)
+{
+    Octstr *xkey;
+    void *id;
+
+    if (!enabled || msgid <= 0)
+        return -1;
+    xkey = submission_key(source, msgid);
+    id = dict_get(submissions, xkey);
+    octstr_destroy(xkey);
+    return id ? (int64_t)(intptr_t)id : -1;
+}
+
+int64_t seglog_append(request_t *req)
+{
+    struct writer w;
+    struct entry *e;
+    int64_t id;
+    double due;
+    long off, len = request_len(req);
+
+    pthread_mutex_lock(&lock);
+    if (sstop || (off = append(REC_REQUEST, next_id, len, &w)) < 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    id = next_id++;
+    due = req->deadline > 0 ? req->deadline : time(NULL);
+    put_request(&w, req, due);
+    finish_append(off);
+
+    e = index_add(id);
+    e->seg = active;
+    e->off = off;
+    e->lsn = lsn;
+    remember(e, id, req, due);
+    set_state(e, E_IDLE);
+    active->live++;
+    if (wait_synced() < 0) {
+        /* it may or may not be on disk: don't deliver it now, the caller saves it */
+        set_state(entry(id), E_MIRRORED); /* e may have moved while we waited */
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&lock);
+    stats_incr(st_appends);
+    return id;
+}
+
+long seglog_feed(long room)
+{
+    job_t *jobs;
+    long i, n = 0;
+
+    if (!enabled || room <= 0)
+        return 0;
+    pthread_mutex_lock(&lock);
+    if (idle == 0) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    jobs = gw_malloc((idle < room ? idle : room) * sizeof jobs[0]);
+    for (i = index_start; i < index_len && n < room && n < idle; i++) {
+        struct entry *e = &entries[i];
+
+        if (e->state == E_IDLE && e->lsn <= synced_lsn) {
+            jobs[n].rid = index_base + i;
+            jobs[n].dest = e->dest;
+            jobs[n].key = e->key;
+            jobs[n].priority = e->priority;
+            jobs[n].due = e->due;
+            jobs[n++].deadline = e->deadline;
+        }
+    }
+    for (i = 0; i < n; i++)
+        set_state(entry(jobs[i].rid), E_QUEUED);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n; i++)
+        sched_add(&jobs[i]);
+    gw_free(jobs);
+    return n;
+}
+
+int seglog_claim(int64_t id, request_t *req)
+{
+    struct entry *e;
+    struct reader r;
+
+    pthread_mutex_lock(&lock);
+    if ((e = entry(id)) == NULL || e->state != E_QUEUED) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    set_state(e, E_INFLIGHT);
+    r.p = e->seg->base + e->off + sizeof (struct rec);
+    r.end = r.p + ((struct rec *)(e->seg->base + e->off))->len;
+    get_request(&r, req, 0, NULL);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void seglog_complete(int64_t id, enum db_stmt s, const char *statuscode, const char *errors)
+{
+    struct writer w;
+    struct entry *e;
+    long off;
+
+    pthread_mutex_lock(&lock);
+    if ((e = entry(id)) == NULL || e->state != E_INFLIGHT) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    off = append(REC_DONE, id, sizeof (int64_t) + 2 * sizeof (uint32_t) +
+            strlen(statuscode) + strlen(errors), &w);
+    if (off >= 0) {
+        put_i64(&w, outcome_code(s));
+        put_str(&w, statuscode, strlen(statuscode));
+        put_str(&w, errors, strlen(errors));
+        finish_append(off);
+        wait_synced();
+        e = entry(id); /* may have moved while we waited */
+    } else
+        warning(0, "seglog: could not record the outcome of %lld, it may be delivered again after a restart",
+                (long long)(id & ~SEGLOG_ID_BIT));
+    set_state(e, E_DONE);
+    e->stmt = s;
+    e->statuscode = octstr_create(statuscode);
+    e->errors = octstr_create(errors);
+    pthread_mutex_unlock(&lock);
+    queue_mirror(id);
+}
+
+void seglog_release(int64_t id)
+{
+    struct entry *e;
+
+    pthread_mutex_lock(&lock);
+    if ((e = entry(id)) != NULL && (e->state == E_QUEUED || e->state == E_INFLIGHT))
+        set_state(e, E_IDLE);
+    pthread_mutex_unlock(&lock);
+}
+
+static long pending_len(void *unused)
+{
+    long n = 0, i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < gwlist_len(segs); i++)
+        n += ((struct segment *)gwlist_get(segs, i))->live;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+static long segments_len(void *unused)
+{
+    long n;
+
+    pthread_mutex_lock(&lock);
+    n = gwlist_len(segs);
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+int seglog_init(dispatcher2conf_t config)
+{
+    Octstr *s;
+    long i;
+
+    sconf = config;
+    if (config->segment_log_dir[0] == 0)
+        return 0;
+    segs = gwlist_create();
+    submissions = dict_create(1024, NULL);
+    to_mirror = gwlist_create();
+    gwlist_add_producer(to_mirror);
+    next_id = SEGLOG_ID_BIT;
+    if (replay() < 0 || (active == NULL && roll() < 0)) {
+        gwlist_remove_producer(to_mirror);
+        return -1;
+    }
+    for (i = index_start; i < index_len; i++)
+        if (entries[i].state == E_DONE)
+            queue_mirror(index_base + i);
+
+    s = octstr_create(config->segment_log_destinations);
+    routes = octstr_split(s, octstr_imm(","));
+    octstr_destroy(s);
+    for (i = 0; i < gwlist_len(routes); i++)
+        octstr_strip_blanks(gwlist_get(routes, i));
+
+    st_appends = stats_counter("seglog.appends");
+    st_commit = stats_timer("seglog.commit");
+    st_flushes = stats_counter("seglog.flushes");
+    st_mirrored = stats_counter("seglog.mirrored");
+    st_compacted = stats_counter("seglog.segments_removed");
+    stats_gauge("seglog.pending", pending_len, NULL);
+    stats_gauge("seglog.segments", segments_len, NULL);
+    stats_gauge("seglog.mirror_queue", stats_list_len, to_mirror);
+
+    sstop = 0;
+    enabled = 1;
+    gwthread_create(syncer, NULL);
+    gwthread_create(mirror, NULL);
+    info(0, "seglog: %ld segment(s) in %s, %ld request(s) to deliver, %ld to mirror",
+            gwlist_len(segs), config->segment_log_dir, idle, gwlist_len(to_mirror));
+    return 0;
+}
+
+void seglog_shutdown(void)
+{
+    struct segment *s;
+
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    sstop = 1;
+    pthread_cond_broadcast(&dirty);
+    pthread_mutex_unlock(&lock);
+    gwthread_join_every(syncer);
+    gwlist_remove_producer(to_mirror);
+    gwthread_join_every(mirror);
+
+    enabled = 0;
+    while ((s = gwlist_extract_first(segs)) != NULL)
+        segment_close(s, 0);
+    gwlist_destroy(segs, NULL);
+    gwlist_destroy(to_mirror, NULL);
+    gwlist_destroy(routes, octstr_destroy_item);
+    dict_destroy(submissions);
+    for (; index_start < index_len; index_start++) {
+        octstr_destroy(entries[index_start].statuscode);
+        octstr_destroy(entries[index_start].errors);
+    }
+    gw_free(entries);
+    entries = NULL;
+    index_start = index_len = index_cap = 0;
+    active = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  seglog.h
+ *
+ *    Description:  Optional on-disk queue for the busiest routes, in place of the
+ *                  requests table: requests are appended to memory mapped segment
+ *                  files, delivered from there, and their final outcome is copied to
+ *                  requests afterwards so that the web UI still sees them.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 23:36:48
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_SEGLOG_H
+#define __DISPATCHER2_SEGLOG_H
+
+#include <stdint.h>
+#include "conf.h"
+#include "misc.h"
+#include "db.h"
+
+/* Ids of requests in the segment log have this bit set, so they never clash with
+ * requests table ids in the scheduler */
+#define SEGLOG_ID_BIT ((int64_t)1 << 62)
+#define seglog_owns(id) (((id) & SEGLOG_ID_BIT) != 0)
+
+/* Opens segment-log-dir and recovers what is in it. Does nothing unless segment-log-dir
+ * is set; -1 if it is set but can't be used */
+int seglog_init(dispatcher2conf_t config);
+void seglog_shutdown(void);
+
+/* Whether requests for this destination (a server name) should go to the log */
+int seglog_routes(Octstr *dest);
+
+/* Append a request with source and destination ids set. Returns its id once it is on
+ * disk, or -1 (e.g. too big for a segment, disk trouble) and the caller should fall
+ * back to the requests table */
+int64_t seglog_append(request_t *req);
+
+/* The id of a request from source with this msgid that is in the log and not yet in
+ * requests, or -1 */
+int64_t seglog_find(int source, int64_t msgid);
+
+/* Hand up to room waiting requests to the scheduler; returns how many */
+long seglog_feed(long room);
+
+/* Take a scheduled request for delivery. Fills in source, destination, payload, ctype
+ * and is_qparams, which the caller frees with seglog_request_free(). -1 if the request
+ * is not waiting for delivery */
+int seglog_claim(int64_t id, request_t *req);
+void seglog_request_free(request_t *req);
+
+/* Record the outcome as the db_stmt that would have recorded it in requests, with
+ * its statuscode and errors parameters. Returns once it is on disk */
+void seglog_complete(int64_t id, enum db_stmt s, const char *statuscode, const char *errors);
+
+/* A claimed request that got no outcome, e.g. out of its submission period: it is
+ * fed to the scheduler again later */
+void seglog_release(int64_t id);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  smssender.c
+ *
+ *    Description:  /sendsms only queues the message; sms-concurrency threads here pass
+ *                  them on to the gateway over kept-alive connections. Queued messages
+ *                  with the same sender and text are sent as one call with several
+ *                  space separated recipients, up to sms-batch-size (Kannel allows this).
+ *                  A call that fails for want of the gateway (no answer, 429, 5xx) is
+ *                  retried up to max-retries times, waiting twice as long each time. The
+ *                  queue is only in memory: messages still in it are lost in a crash.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 19:09:12
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#include "smssender.h"
+#include "outbound.h"
+#include "stats.h"
+#include "log.h"
+
+#define SMS_RETRY_DELAY 2.0 /* seconds before the first retry */
+#define SMS_MAX_RETRY_DELAY 60.0
+
+struct sms {
+    Octstr *from;
+    Octstr *to;
+    Octstr *text;
+};
+
+static dispatcher2conf_t sconf;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stopping = PTHREAD_COND_INITIALIZER; /* wakes senders backing off */
+static List *pending; /* of struct sms, oldest first */
+static int sstop = 0;
+static outbound_t *gateway; /* NULL: use gwlib's client */
+
+static stat_t *st_queued, *st_sent, *st_failed, *st_retried, *st_calls;
+
+static void sms_destroy(struct sms *m)
+{
+    octstr_destroy(m->from);
+    octstr_destroy(m->to);
+    octstr_destroy(m->text);
+    gw_free(m);
+}
+
+long smssender_len(void)
+{
+    long n;
+
+    pthread_mutex_lock(&lock);
+    n = pending ? gwlist_len(pending) : 0;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+static long queue_len(void *unused)
+{
+    return smssender_len();
+}
+
+int smssender_queue(Octstr *from, Octstr *to, Octstr *text)
+{
+    struct sms *m;
+
+    pthread_mutex_lock(&lock);
+    if (sstop || gwlist_len(pending) >= sconf->max_ingest_queue) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    m = gw_malloc(sizeof *m);
+    m->from = from ? octstr_duplicate(from) : octstr_create(sconf->default_sender);
+    m->to = octstr_duplicate(to);
+    m->text = octstr_duplicate(text);
+    gwlist_append(pending, m);
+    pthread_mutex_unlock(&lock);
+    pthread_cond_signal(&ready);
+    stats_incr(st_queued);
+    return 0;
+}
+
+/* Next message plus any others queued for the same sender and text. NULL when stopping */
+static List *next_batch(void)
+{
+    List *batch = NULL;
+    struct sms *first, *m;
+    long i;
+
+    pthread_mutex_lock(&lock);
+    while (!sstop && gwlist_len(pending) == 0)
+        pthread_cond_wait(&ready, &lock);
+    if ((first = gwlist_extract_first(pending)) != NULL) {
+        batch = gwlist_create();
+        gwlist_append(batch, first);
+        for (i = 0; i < gwlist_len(pending) && gwlist_len(batch) < sconf->sms_batch_size; ) {
+            m = gwlist_get(pending, i);
+            if (octstr_compare(m->from, first->from) == 0 && octstr_compare(m->text, first->text) == 0) {
+                gwlist_delete(pending, i, 1);
+                gwlist_append(batch, m);
+            } else
+                i++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return batch;
+}
+
+/* Sets *written unless the call failed before any of it reached the gateway */
+static int send_batch(List *batch, int *written)
+{
+    struct sms *m = gwlist_get(batch, 0);
+    Octstr *to = octstr_duplicate(m->to), *url, *rbody;
+    List *rh = http_create_empty_headers();
+    double t0 = stats_now();
+    long i;
+    int status = -1;
+
+    *written = 1;
+    for (i = 1; i < gwlist_len(batch); i++)
+        octstr_format_append(to, " %S", ((struct sms *)gwlist_get(batch, i))->to);
+    url = octstr_format("%s%stext=%E&to=%E&from=%E", sconf->sendsmsurl,
+            strchr(sconf->sendsmsurl, '?') != NULL ? "&" : "?", m->text, to, m->from);
+    http_header_add(rh, "Content-Type", "text/plain; charset=us-ascii");
+
+    if (gateway != NULL) {
+        rbody = outbound_request_real(gateway, HTTP_METHOD_GET, url, rh, NULL, &status, written);
+    } else {
+        HTTPCaller *caller = http_caller_create();
+        Octstr *furl = NULL;
+        List *resh = NULL;
+
+        http_start_request(caller, HTTP_METHOD_GET, url, rh, NULL, 1, NULL, NULL);
+        rbody = NULL;
+        http_receive_result_real(caller, &status, &furl, &resh, &rbody, 1);
+        http_caller_destroy(caller);
+        http_destroy_headers(resh);
+        octstr_destroy(furl);
+    }
+    stats_time(st_calls, stats_now() - t0);
+
+    if (http_status_class(status) == HTTP_STATUS_SUCCESSFUL) {
+        stats_add(st_sent, gwlist_len(batch));
+        d2log_info("Successfully called SMS URL [%s]", octstr_get_cstr(url));
+    } else {
+        error(0, "SMS gateway call failed (status %d) to=%s: %s", status, octstr_get_cstr(to),
+                rbody ? octstr_get_cstr(rbody) : "");
+    }
+    octstr_destroy(rbody);
+    octstr_destroy(url);
+    octstr_destroy(to);
+    http_destroy_headers(rh);
+    return status;
+}
+
+/* Whether the same call can be made again without risking a second copy of the texts:
+ * it never reached the gateway, or the gateway said it was too busy to take it */
+static int retryable(int status, int written)
+{
+    return (status < 0 && !written) || status == 429 || status == 503;
+}
+
+/* Waits delay seconds. Returns 0 at once when stopping, so shutdown isn't held up */
+static int backoff(double delay)
+{
+    struct timeval tv;
+    struct timespec ts;
+    double until;
+
+    gettimeofday(&tv, NULL);
+    until = tv.tv_sec + tv.tv_usec / 1e6 + delay;
+    ts.tv_sec = (long)until;
+    ts.tv_nsec = (long)((until - (long)until) * 1e9);
+
+    pthread_mutex_lock(&lock);
+    while (!sstop && pthread_cond_timedwait(&stopping, &lock, &ts) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&lock);
+    return !sstop;
+}
+
+static void sender(void *unused)
+{
+    List *batch;
+    struct sms *m;
+    double delay;
+    int status, tries, written;
+
+    while ((batch = next_batch()) != NULL) {
+        delay = SMS_RETRY_DELAY;
+        for (tries = 0; ; tries++) {
+            status = send_batch(batch, &written);
+            if (http_status_class(status) == HTTP_STATUS_SUCCESSFUL)
+                break;
+            if (!retryable(status, written) || tries >= sconf->max_retries || !backoff(delay)) {
+                stats_add(st_failed, gwlist_len(batch));
+                error(0, "Dropping SMS to %ld recipient(s) after %d attempt(s)",
+                        gwlist_len(batch), tries + 1);
+                break;
+            }
+            stats_incr(st_retried);
+            delay = delay * 2 > SMS_MAX_RETRY_DELAY ? SMS_MAX_RETRY_DELAY : delay * 2;
+        }
+        while ((m = gwlist_extract_first(batch)) != NULL)
+            sms_destroy(m);
+        gwlist_destroy(batch, NULL);
+    }
+}
+
+void smssender_init(dispatcher2conf_t config)
+{
+    Octstr *url;
+    int i;
+
+    sconf = config;
+    pending = gwlist_create();
+    sstop = 0;
+
+    outbound_init();
+    url = octstr_create(config->sendsmsurl);
+    gateway = outbound_create(url, NULL);
+    octstr_destroy(url);
+
+    st_queued = stats_counter("sms.queued");
+    st_sent = stats_counter("sms.sent");
+    st_failed = stats_counter("sms.failed");
+    st_retried = stats_counter("sms.retried");
+    st_calls = stats_timer("sms.gateway");
+    stats_gauge("sms.queue", queue_len, NULL);
+
+    for (i = 0; i < config->sms_concurrency; i++)
+        gwthread_create(sender, NULL);
+}
+
+void smssender_shutdown(void)
+{
+    pthread_mutex_lock(&lock);
+    sstop = 1;
+    pthread_mutex_unlock(&lock);
+    pthread_cond_broadcast(&ready);
+    pthread_cond_broadcast(&stopping);
+    gwthread_join_every(sender);
+
+    pthread_mutex_lock(&lock);
+    gwlist_destroy(pending, NULL); /* empty: the senders finish the queue before leaving */
+    pending = NULL;
+    pthread_mutex_unlock(&lock);
+    outbound_destroy(gateway);
+    gateway = NULL;
+}
@@ -0,0 +1,33 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  smssender.h
+ *
+ *    Description:  Background sender for /sendsms: messages are queued and handed to
+ *                  the SMS gateway (sendsms-url) by a few threads of our own.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 19:05:31
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_SMSSENDER_H
+#define __DISPATCHER2_SMSSENDER_H
+
+#include <gwlib/gwlib.h>
+#include "conf.h"
+
+void smssender_init(dispatcher2conf_t config);
+/* Sends whatever is still queued, then stops the sender threads */
+void smssender_shutdown(void);
+
+/* Queue a message; from may be NULL for default-sender. Returns -1 if the queue is full */
+int smssender_queue(Octstr *from, Octstr *to, Octstr *text);
+long smssender_len(void);
+
+#endif
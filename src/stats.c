@@ -0,0 +1,180 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stats.c
+ *
+ *    Description:  Named counters, timers and gauges reported on /stats. Counters are
+ *                  gwlib Counters so the hot paths never take the registry lock.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 14:05:40
+ *       Revision:  none
+ *       Copyright: Copyright (c) 2016, GoodCitizen Co. Ltd.
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <gwlib/gwlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+enum { STAT_COUNTER, STAT_TIMER, STAT_GAUGE, STAT_SAMPLE };
+
+struct d2stat {
+    char name[64];
+    int kind;
+    Counter *count;
+    Mutex *lock; /* timers and samples: sum and max */
+    double sum, max;
+    long (*fn)(void *);
+    void *arg;
+};
+
+static List *stats; /* of stat_t, in registration order */
+static Mutex *stats_lock;
+
+void stats_init(void)
+{
+    stats = gwlist_create();
+    stats_lock = mutex_create();
+}
+
+static void stat_destroy(void *p)
+{
+    stat_t *s = p;
+
+    counter_destroy(s->count);
+    if (s->lock)
+        mutex_destroy(s->lock);
+    gw_free(s);
+}
+
+void stats_shutdown(void)
+{
+    gwlist_destroy(stats, stat_destroy);
+    mutex_destroy(stats_lock);
+    stats = NULL;
+}
+
+static stat_t *stat_register(const char *name, int kind)
+{
+    stat_t *s;
+    long i;
+
+    mutex_lock(stats_lock);
+    for (i = 0; i < gwlist_len(stats); i++)
+        if (strcmp((s = gwlist_get(stats, i))->name, name) == 0 && s->kind == kind)
+            goto done;
+
+    s = gw_malloc(sizeof *s);
+    memset(s, 0, sizeof *s);
+    snprintf(s->name, sizeof s->name, "%s", name);
+    s->kind = kind;
+    s->count = counter_create();
+    if (kind == STAT_TIMER || kind == STAT_SAMPLE)
+        s->lock = mutex_create();
+    gwlist_append(stats, s);
+done:
+    mutex_unlock(stats_lock);
+    return s;
+}
+
+stat_t *stats_counter(const char *name)
+{
+    return stat_register(name, STAT_COUNTER);
+}
+
+stat_t *stats_timer(const char *name)
+{
+    return stat_register(name, STAT_TIMER);
+}
+
+stat_t *stats_sample(const char *name)
+{
+    return stat_register(name, STAT_SAMPLE);
+}
+
+void stats_gauge(const char *name, long (*fn)(void *), void *arg)
+{
+    stat_t *s = stat_register(name, STAT_GAUGE);
+
+    s->fn = fn;
+    s->arg = arg;
+}
+
+long stats_list_len(void *list)
+{
+    return list ? gwlist_len(list) : 0;
+}
+
+void stats_incr(stat_t *s)
+{
+    counter_increase(s->count);
+}
+
+void stats_add(stat_t *s, long n)
+{
+    counter_increase_with(s->count, n);
+}
+
+void stats_time(stat_t *s, double secs)
+{
+    mutex_lock(s->lock);
+    counter_increase(s->count);
+    s->sum += secs;
+    if (secs > s->max)
+        s->max = secs;
+    mutex_unlock(s->lock);
+}
+
+void stats_record(stat_t *s, double value)
+{
+    stats_time(s, value);
+}
+
+double stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Octstr *stats_report(void)
+{
+    Octstr *out = octstr_create("");
+    long i;
+
+    mutex_lock(stats_lock);
+    for (i = 0; i < gwlist_len(stats); i++) {
+        stat_t *s = gwlist_get(stats, i);
+        unsigned long n = counter_value(s->count);
+
+        switch (s->kind) {
+            case STAT_COUNTER:
+                octstr_format_append(out, "%s %lu\n", s->name, n);
+                break;
+            case STAT_GAUGE:
+                octstr_format_append(out, "%s %ld\n", s->name, s->fn ? s->fn(s->arg) : 0L);
+                break;
+            case STAT_TIMER:
+                mutex_lock(s->lock);
+                octstr_format_append(out, "%s.count %lu\n%s.mean_ms %.3f\n%s.max_ms %.3f\n%s.total_ms %.0f\n",
+                        s->name, n, s->name, n ? 1000 * s->sum / n : 0.0, s->name, 1000 * s->max,
+                        s->name, 1000 * s->sum);
+                mutex_unlock(s->lock);
+                break;
+            case STAT_SAMPLE:
+                mutex_lock(s->lock);
+                octstr_format_append(out, "%s.count %lu\n%s.mean %.2f\n%s.max %.0f\n",
+                        s->name, n, s->name, n ? s->sum / n : 0.0, s->name, s->max);
+                mutex_unlock(s->lock);
+                break;
+        }
+    }
+    mutex_unlock(stats_lock);
+    return out;
+}
@@ -0,0 +1,53 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stats.h
+ *
+ *    Description:  Named counters, timers and gauges reported on /stats
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 14:02:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Samuel Sekiwere (SS), sekiskylink@gmail.com
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#ifndef __DISPATCHER2_STATS_H
+#define __DISPATCHER2_STATS_H
+
+#include <gwlib/gwlib.h>
+
+/* Not "struct stat", which <sys/stat.h> already defines */
+typedef struct d2stat stat_t;
+
+void stats_init(void);
+void stats_shutdown(void);
+
+/* Register (or look up, if already there) a stat by name. Handles live until stats_shutdown() */
+stat_t *stats_counter(const char *name);
+stat_t *stats_timer(const char *name);
+/* A gauge is read from fn(arg) each time the report is built e.g. a queue length */
+void stats_gauge(const char *name, long (*fn)(void *), void *arg);
+
+void stats_incr(stat_t *s);
+void stats_add(stat_t *s, long n);
+/* Gauge function for a gwlib List */
+long stats_list_len(void *list);
+
+/* Record one timing, in seconds */
+void stats_time(stat_t *s, double secs);
+
+/* Like a timer but for plain values e.g. round trips per request; gives count, mean and max */
+stat_t *stats_sample(const char *name);
+void stats_record(stat_t *s, double value);
+
+/* Monotonic clock in seconds, for timings */
+double stats_now(void);
+
+/* One "name value" line per stat; timers give count, mean, max and total in ms */
+Octstr *stats_report(void);
+
+#endif
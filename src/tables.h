@@ -211,4 +211,68 @@ static char *table_cmds[] = {
 "\n"
 ,NULL
 };
+
+/* Run after upgrade_cmds, and only while the index is missing and requests holds no older
+ * duplicates (see handle_db_upgrade): without it retries are still caught by the lookup,
+ * but not two copies racing each other */
+#define SUBMISSION_INDEX_CMD \
+"CREATE UNIQUE INDEX IF NOT EXISTS requests_submission_idx ON requests(source, submissionid)\n" \
+"    WHERE submissionid > 0;\n"
+
+/* Schema changes since 2.1. These run on every start (after table_cmds on a
+ * fresh database) so each one must be idempotent. */
+static char *upgrade_cmds[] = {
+"CREATE TABLE IF NOT EXISTS cluster_nodes (\n"
+"    id serial PRIMARY KEY NOT NULL,\n"
+"    name TEXT NOT NULL UNIQUE, -- node-name from the config file\n"
+"    hostname TEXT NOT NULL DEFAULT '',\n"
+"    http_port INTEGER NOT NULL DEFAULT 0,\n"
+"    pid INTEGER NOT NULL DEFAULT 0,\n"
+"    started timestamptz DEFAULT current_timestamp,\n"
+"    heartbeat timestamptz DEFAULT current_timestamp\n"
+");\n"
+"\n"
+,
+"ALTER TABLE users ADD COLUMN IF NOT EXISTS max_rate REAL NOT NULL DEFAULT 0;\n" /* requests/sec, 0 = rate-limit */
+,
+"ALTER TABLE users ADD COLUMN IF NOT EXISTS daily_quota INTEGER NOT NULL DEFAULT 0;\n" /* 0 = daily-quota */
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS min_concurrency INTEGER NOT NULL DEFAULT 1;\n"
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS max_concurrency INTEGER NOT NULL DEFAULT 0;\n" /* 0 = max-concurrent */
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS target_latency INTEGER NOT NULL DEFAULT 0;\n" /* ms, 0 = delivery-target-latency */
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS partition_key TEXT NOT NULL DEFAULT '';\n" /* '' = unordered */
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS supersede BOOLEAN NOT NULL DEFAULT 'f';\n"
+,
+"ALTER TABLE requests ADD COLUMN IF NOT EXISTS priority SMALLINT NOT NULL DEFAULT 2;\n" /* PRIORITY_NORMAL */
+,
+"CREATE TABLE IF NOT EXISTS priority_rules (\n"
+"    id serial PRIMARY KEY NOT NULL,\n"
+"    report_type TEXT NOT NULL DEFAULT '', -- '' = any\n"
+"    source INTEGER REFERENCES servers(id), -- NULL = any\n"
+"    priority SMALLINT NOT NULL DEFAULT 2, -- 0 critical, 1 high, 2 normal, 3 low\n"
+"    created timestamptz DEFAULT current_timestamp,\n"
+"    updated timestamptz DEFAULT current_timestamp\n"
+");\n"
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS deadline_days INTEGER NOT NULL DEFAULT 0;\n" /* 0 = no deadline */
+,
+"ALTER TABLE requests ADD COLUMN IF NOT EXISTS deadline timestamptz;\n"
+,
+"CREATE INDEX IF NOT EXISTS requests_due_idx ON requests(priority, COALESCE(deadline, created))\n"
+"    WHERE status = 'ready';\n"
+,
+"ALTER TABLE servers ADD COLUMN IF NOT EXISTS async_import BOOLEAN NOT NULL DEFAULT 'f';\n"
+,
+"ALTER TABLE requests ADD COLUMN IF NOT EXISTS import_task TEXT NOT NULL DEFAULT '';\n"
+"ALTER TABLE requests ADD COLUMN IF NOT EXISTS import_started timestamptz;\n"
+"ALTER TABLE requests ADD COLUMN IF NOT EXISTS import_poll_at timestamptz;\n"
+,
+"CREATE INDEX IF NOT EXISTS requests_import_idx ON requests(import_poll_at)\n"
+"    WHERE status = 'inprogress' AND import_task <> '';\n"
+,NULL
+};
 #endif
@@ -0,0 +1,89 @@
+#!/bin/sh
+# Author: Samuel Sekiwere <sekiskylink@gmail.com>
+#
+# End-to-end throughput benchmark: starts the mock DHIS2 server, points the
+# destination server at it, runs dispatcher2d against a local Postgres and
+# drives /queue with d2loadgen. Run from the top of a built source tree.
+#
+# Everything can be overridden from the environment, e.g.
+#   REQUESTS=20000 CONCURRENCY=50 LATENCY=exp:80 ERRORS=0.01 sh testcases/run_bench.sh
+
+BUILD=${BUILD:-src}
+DBNAME=${DBNAME:-dispatcher2}
+DBUSER=${DBUSER:-postgres}
+DBPASS=${DBPASS:-postgres}
+DBHOST=${DBHOST:-localhost}
+HTTP_PORT=${HTTP_PORT:-9191}
+MOCK_PORT=${MOCK_PORT:-8080}
+DESTINATION=${DESTINATION:-dhis2}
+SOURCE=${SOURCE:-mtrack}
+REQUESTS=${REQUESTS:-5000}
+CONCURRENCY=${CONCURRENCY:-20}
+JSON_PERCENT=${JSON_PERCENT:-30}
+SIZES=${SIZES:-5,50,500}
+AUTH=${AUTH:-basic}
+CREDENTIALS=${CREDENTIALS:-admin:admin}
+LATENCY=${LATENCY:-uniform:20:200}
+ERRORS=${ERRORS:-0}
+IMPORT_ERRORS=${IMPORT_ERRORS:-0}
+MAX_CONCURRENT=${MAX_CONCURRENT:-10}
+
+WORKDIR=`mktemp -d /tmp/d2bench.XXXXXX`
+CONNINFO="host=$DBHOST dbname=$DBNAME user=$DBUSER password=$DBPASS"
+
+cleanup() {
+    [ -n "$DAEMON_PID" ] && kill $DAEMON_PID 2>/dev/null
+    [ -n "$MOCK_PID" ] && kill $MOCK_PID 2>/dev/null
+    wait 2>/dev/null
+    # put the destination back the way we found it
+    if [ -n "$SAVED_SERVER" ]; then
+        set -- $SAVED_SERVER
+        PGPASSWORD=$DBPASS psql -q -h $DBHOST -U $DBUSER -v url="$SAVED_URL" $DBNAME <<EOF
+UPDATE servers SET url = :'url', use_ssl = '$1',
+    start_submission_period = $2, end_submission_period = $3
+    WHERE name = '$DESTINATION';
+EOF
+        SAVED_SERVER=
+    fi
+}
+trap cleanup EXIT INT TERM
+
+cat > $WORKDIR/dispatcher2.conf <<EOF
+database: $DBNAME
+http-port: $HTTP_PORT
+password: $DBPASS
+host: $DBHOST
+user: $DBUSER
+use-global-submission-period: true
+start-submission-period: 0
+end-submission-period: 23
+max-concurrent: $MAX_CONCURRENT
+max-retries: 3
+logdir: $WORKDIR
+loglevel: 1
+use-ssl: false
+default-queue-status: ready
+EOF
+
+SAVED_URL=`PGPASSWORD=$DBPASS psql -q -t -A -h $DBHOST -U $DBUSER $DBNAME \
+    -c "SELECT url FROM servers WHERE name = '$DESTINATION'"` || exit 1
+SAVED_SERVER=`PGPASSWORD=$DBPASS psql -q -t -A -F ' ' -h $DBHOST -U $DBUSER $DBNAME \
+    -c "SELECT use_ssl, start_submission_period, end_submission_period
+        FROM servers WHERE name = '$DESTINATION'"` || exit 1
+PGPASSWORD=$DBPASS psql -q -h $DBHOST -U $DBUSER $DBNAME <<EOF || exit 1
+UPDATE servers SET url = 'http://localhost:$MOCK_PORT/api/dataValueSets', use_ssl = 'f',
+    start_submission_period = 0, end_submission_period = 23
+    WHERE name = '$DESTINATION';
+EOF
+
+$BUILD/d2mockserver -p $MOCK_PORT -l $LATENCY -e $ERRORS -i $IMPORT_ERRORS > $WORKDIR/mock.log 2>&1 &
+MOCK_PID=$!
+$BUILD/dispatcher2d -c $WORKDIR/dispatcher2.conf -p $WORKDIR/dispatcher2.pid > $WORKDIR/daemon.log 2>&1 &
+DAEMON_PID=$!
+sleep 3
+
+echo "dispatcher2 benchmark: $REQUESTS requests, concurrency $CONCURRENCY, sizes $SIZES," \
+    "json $JSON_PERCENT%, auth $AUTH, latency $LATENCY, logs in $WORKDIR"
+$BUILD/d2loadgen -u http://localhost:$HTTP_PORT/queue -n $REQUESTS -c $CONCURRENCY \
+    -J $JSON_PERCENT -s $SIZES -a $AUTH -U $CREDENTIALS -f $SOURCE -t $DESTINATION \
+    -D "$CONNINFO"